@@ -0,0 +1,422 @@
+/*
+ * File: batch.c
+ * Implements: scripted send/expect against many consoles
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netpacket/packet.h>
+#include <regex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "egetty.h"
+#include "skbuff.h"
+#include "batch.h"
+#include "proto.h"
+#include "lz.h"
+#include "vlan.h"
+#include "rec.h"
+
+#define BATCH_MATCHBUF 8192
+#define BATCH_FRAME (1500 - PROTO_HDRMAX)
+
+enum { STEP_SEND, STEP_EXPECT };
+
+struct batch_step {
+	int type;
+	char *data;
+	int len;
+	regex_t re;
+	int timeout; /* ms */
+};
+
+struct batch_script {
+	struct batch_step *step;
+	int count;
+};
+
+struct batch_sess {
+	int step;
+	int done; /* 1 ok, -1 failed */
+	long long start, deadline;
+	char buf[BATCH_MATCHBUF];
+	int len;
+	unsigned char utf8[4]; /* sequence cut off at the end of the last output */
+	int utf8len;
+};
+
+static int batch_vlan; /* VLAN of the targets, 0 if untagged */
+
+static long long batch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* decode C escapes in place. Returns new length */
+static int batch_unescape(char *s)
+{
+	char *d = s, *start = s;
+	unsigned int c;
+
+	while(*s) {
+		if(*s != '\\' || !s[1]) {
+			*d++ = *s++;
+			continue;
+		}
+		s++;
+		switch(*s) {
+		case 'r': *d++ = '\r'; break;
+		case 'n': *d++ = '\n'; break;
+		case 't': *d++ = '\t'; break;
+		case 'e': *d++ = 033; break;
+		case 'x':
+			if(sscanf(s+1, "%2x", &c) == 1) {
+				*d++ = c;
+				s += isxdigit(s[2]) ? 2 : 1;
+			}
+			break;
+		default: *d++ = *s;
+		}
+		s++;
+	}
+	return d - start;
+}
+
+struct batch_script *batch_load(const char *fn)
+{
+	struct batch_script *script;
+	struct batch_step *step;
+	char line[1024], *p, *arg;
+	int timeout = 10000, lineno = 0, rc;
+	FILE *f;
+
+	f = fopen(fn, "r");
+	if(!f) return NULL;
+
+	script = malloc(sizeof(struct batch_script));
+	memset(script, 0, sizeof(struct batch_script));
+	
+	while(fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = line + strlen(line);
+		while(p > line && (p[-1] == '\n' || p[-1] == '\r')) *--p = 0;
+		p = line;
+		while(isspace(*p)) p++;
+		if(!*p || *p == '#')
+			continue;
+		arg = p;
+		while(*arg && !isspace(*arg)) arg++;
+		if(*arg) *arg++ = 0;
+		
+		if(!strcmp(p, "timeout")) {
+			timeout = atof(arg) * 1000;
+			continue;
+		}
+		script->step = realloc(script->step, (script->count + 1) * sizeof(struct batch_step));
+		step = &script->step[script->count];
+		memset(step, 0, sizeof(struct batch_step));
+		step->timeout = timeout;
+		if(!strcmp(p, "send")) {
+			step->type = STEP_SEND;
+			step->data = strdup(arg);
+			step->len = batch_unescape(step->data);
+		} else if(!strcmp(p, "expect")) {
+			step->type = STEP_EXPECT;
+			step->data = strdup(arg);
+			if((rc = regcomp(&step->re, arg, REG_EXTENDED|REG_NEWLINE))) {
+				regerror(rc, &step->re, line, sizeof(line));
+				fprintf(stderr, "%s:%d: %s\n", fn, lineno, line);
+				fclose(f);
+				return NULL;
+			}
+		} else {
+			fprintf(stderr, "%s:%d: unknown step '%s'\n", fn, lineno, p);
+			fclose(f);
+			return NULL;
+		}
+		script->count++;
+	}
+	fclose(f);
+	return script;
+}
+
+/*
+ * Output as a JSON string, which must be valid UTF-8: invalid bytes
+ * become U+FFFD and a sequence split between two frames is held back
+ * in bs until the next output of the target.
+ */
+static void batch_json_string(struct batch_sess *bs, const unsigned char *data, int len)
+{
+	unsigned char seq[4];
+	int i = 0, k, n = bs->utf8len;
+
+	putchar('"');
+	if(n) {
+		memcpy(seq, bs->utf8, n);
+		while(n < 4 && i < len)
+			seq[n++] = data[i++];
+		k = rec_utf8(seq, n);
+		if(k == -1) {
+			memcpy(bs->utf8, seq, n);
+			bs->utf8len = n;
+			i = len;
+		} else {
+			i -= n - (k ? k : bs->utf8len);
+			if(k)
+				fwrite(seq, 1, k, stdout);
+			else
+				printf("\\ufffd");
+			bs->utf8len = 0;
+		}
+	}
+	for(;i<len;i++) {
+		if(data[i] == '"' || data[i] == '\\')
+			printf("\\%c", data[i]);
+		else if(data[i] < 0x20 || data[i] == 0x7f)
+			printf("\\u%04x", data[i]);
+		else if(data[i] < 0x80)
+			putchar(data[i]);
+		else {
+			k = rec_utf8(data + i, len - i);
+			if(k == -1) {
+				memcpy(bs->utf8, data + i, len - i);
+				bs->utf8len = len - i;
+				break;
+			}
+			if(!k) {
+				printf("\\ufffd");
+				continue;
+			}
+			fwrite(data + i, 1, k, stdout);
+			i += k - 1;
+		}
+	}
+	putchar('"');
+}
+
+static void batch_json_target(const struct session *sess)
+{
+	printf("{\"target\": \"%02x:%02x:%02x:%02x:%02x:%02x/%d\"",
+	       sess->mac[0], sess->mac[1], sess->mac[2],
+	       sess->mac[3], sess->mac[4], sess->mac[5], sess->console);
+}
+
+/* send one frame of at most BATCH_FRAME bytes data */
+static int batch_frame(int s, int ifindex, const struct session *sess, int type, const char *data, int len)
+{
+	static struct sk_buff *skb;
+	struct sockaddr_ll dest;
+
+	if(!skb && !(skb = alloc_skb(1500)))
+		return -1;
+	skb_reset(skb);
+	skb_reserve(skb, PROTO_HDRMAX);
+	if(len)
+		memcpy(skb_put(skb, len), data, len);
+	proto_push(skb, sess->version, type, sess->console, sess->sid);
+
+	memset(&dest, 0, sizeof(dest));
+	dest.sll_family = AF_PACKET;
+	dest.sll_halen = 6;
+	dest.sll_protocol = htons(ETH_P_EGETTY);
+	dest.sll_ifindex = ifindex;
+	memcpy(dest.sll_addr, sess->mac, 6);
+	if(vlan_sendto(NULL, s, batch_vlan, skb->data, skb->len, &dest) == -1)
+		return -1;
+	return 0;
+}
+
+static int batch_send(int s, int ifindex, const struct session *sess, const char *data, int len)
+{
+	int n;
+
+	while(len) {
+		n = len > BATCH_FRAME ? BATCH_FRAME : len;
+		if(batch_frame(s, ifindex, sess, EGETTY_IN, data, n))
+			return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void batch_finish(struct session *sess, int ok, const char *reason, long long now)
+{
+	struct batch_sess *bs = sess->priv;
+
+	bs->done = ok ? 1 : -1;
+	batch_json_target(sess);
+	printf(", \"status\": \"%s\", \"step\": %d, \"elapsed_ms\": %lld}\n",
+	       reason, bs->step, now - bs->start);
+}
+
+/* run steps until an expect has to wait */
+static void batch_advance(int s, int ifindex, struct session *sess,
+			  struct batch_script *script, long long now)
+{
+	struct batch_sess *bs = sess->priv;
+	struct batch_step *step;
+	regmatch_t m;
+
+	while(!bs->done) {
+		if(bs->step == script->count) {
+			batch_finish(sess, 1, "ok", now);
+			return;
+		}
+		step = &script->step[bs->step];
+		if(step->type == STEP_SEND) {
+			if(batch_send(s, ifindex, sess, step->data, step->len)) {
+				batch_finish(sess, 0, "send failed", now);
+				return;
+			}
+			bs->step++;
+			bs->deadline = 0;
+			continue;
+		}
+		if(!bs->deadline)
+			bs->deadline = now + step->timeout;
+		bs->buf[bs->len] = 0;
+		if(regexec(&step->re, bs->buf, 1, &m, 0)) {
+			if(now >= bs->deadline)
+				batch_finish(sess, 0, "timeout", now);
+			return;
+		}
+		/* consume output up to end of match */
+		memmove(bs->buf, bs->buf + m.rm_eo, bs->len - m.rm_eo);
+		bs->len -= m.rm_eo;
+		bs->step++;
+		bs->deadline = 0;
+	}
+}
+
+static void batch_output(struct session *sess, const unsigned char *data, int len)
+{
+	struct batch_sess *bs = sess->priv;
+	int i, drop;
+
+	batch_json_target(sess);
+	printf(", \"out\": ");
+	batch_json_string(bs, data, len);
+	printf("}\n");
+
+	if(len > BATCH_MATCHBUF - 1) {
+		data += len - (BATCH_MATCHBUF - 1);
+		len = BATCH_MATCHBUF - 1;
+	}
+	if(bs->len + len > BATCH_MATCHBUF - 1) {
+		drop = bs->len + len - (BATCH_MATCHBUF - 1);
+		memmove(bs->buf, bs->buf + drop, bs->len - drop);
+		bs->len -= drop;
+	}
+	for(i=0;i<len;i++)
+		bs->buf[bs->len++] = data[i] ? data[i] : ' ';
+}
+
+int batch_run(int s, int ifindex, int vlan, struct session_table *t, struct batch_script *script)
+{
+	struct session *sess;
+	struct batch_sess *bs;
+	struct sockaddr_ll from;
+	socklen_t fromlen;
+	unsigned char frame[1600];
+	struct proto_hdr h;
+	const unsigned char *msg, *data;
+	unsigned int off, len;
+	long long now = batch_now(), next;
+	int i, n, rc, left, failed = 0;
+
+	batch_vlan = vlan;
+	for(i=0;i<t->count;i++) {
+		sess = t->list[i];
+		bs = malloc(sizeof(struct batch_sess));
+		memset(bs, 0, sizeof(struct batch_sess));
+		bs->start = now;
+		sess->priv = bs;
+	}
+	for(i=0;i<t->count;i++)
+		batch_advance(s, ifindex, t->list[i], script, now);
+
+	while(1) {
+		struct pollfd fds[1];
+		int timeout;
+
+		/* next deadline of any waiting session */
+		left = 0;
+		next = -1;
+		for(i=0;i<t->count;i++) {
+			bs = t->list[i]->priv;
+			if(bs->done) continue;
+			left++;
+			if(next == -1 || bs->deadline < next)
+				next = bs->deadline;
+		}
+		fflush(stdout);
+		if(!left)
+			break;
+		timeout = next > now ? next - now : 0;
+		
+		fds[0].fd = s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		n = poll(fds, 1, timeout);
+		now = batch_now();
+		
+		/* drain socket before looking at deadlines */
+		while(n > 0) {
+			fromlen = sizeof(from);
+			n = recvfrom(s, frame, sizeof(frame), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+			if(n == -1) break;
+			off = 0;
+			while((msg = proto_next(frame, n, &off, &h))) {
+				if(h.type == EGETTY_HELLO) {
+					session_hello(t, from.sll_addr, &h, msg + h.hlen);
+					continue;
+				}
+				if(h.type != EGETTY_OUT && h.type != EGETTY_KMSG)
+					continue;
+				sess = session_find(t, from.sll_addr, h.console);
+				if(!sess || ((struct batch_sess *)sess->priv)->done)
+					continue;
+				if(h.version >= PROTO_V2) {
+					sess->version = h.version;
+					sess->flags = h.flags;
+					sess->sid = h.session;
+				}
+				data = msg + h.hlen;
+				len = h.len - h.hlen;
+				rc = lz_output(&sess->lz, h.flags & PROTO_F_LZ, &data, &len);
+				if(rc == -1)
+					batch_frame(s, ifindex, sess, EGETTY_LZRESET, NULL, 0);
+				if(rc < 0)
+					continue;
+				batch_output(sess, data, len);
+				batch_advance(s, ifindex, sess, script, now);
+			}
+		}
+		for(i=0;i<t->count;i++) {
+			bs = t->list[i]->priv;
+			if(!bs->done && bs->deadline && now >= bs->deadline)
+				batch_advance(s, ifindex, t->list[i], script, now);
+		}
+	}
+	/* hang up the sessions we logged in to */
+	for(i=0;i<t->count;i++) {
+		batch_frame(s, ifindex, t->list[i], EGETTY_HUP, NULL, 0);
+		bs = t->list[i]->priv;
+		if(bs->done != 1) failed++;
+	}
+	return failed;
+}
@@ -0,0 +1,29 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "session.h"
+
+/*
+ * Non-interactive execution of send/expect scripts against many consoles
+ * in one event loop.
+ *
+ * Script format, one step per line:
+ *   send TEXT        send TEXT, C escapes allowed (\r \n \t \e \xHH \\)
+ *   expect REGEX     wait for output matching POSIX extended REGEX
+ *   timeout SECONDS  timeout for following expects (default 10)
+ *   # comment
+ *
+ * Progress is written to stdout as JSON, one object per line.
+ */
+
+struct batch_script;
+
+struct batch_script *batch_load(const char *fn);
+
+/*
+ * Run 'script' on the targets, on VLAN 'vlan' (0 untagged).
+ * Returns number of targets that did not complete the script.
+ */
+int batch_run(int s, int ifindex, int vlan, struct session_table *t, struct batch_script *script);
+
+#endif
@@ -0,0 +1,778 @@
+/*
+ * File: broker.c
+ * Implements: many existing terminals exported by one egetty
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netpacket/packet.h>
+#include <linux/filter.h>
+#include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "egetty.h"
+#include "broker.h"
+#include "proto.h"
+#include "lowlat.h"
+
+#ifndef PACKET_FANOUT
+#define PACKET_FANOUT 18
+#endif
+#ifndef PACKET_FANOUT_DATA
+#define PACKET_FANOUT_DATA 22
+#endif
+#ifndef PACKET_FANOUT_CBPF
+#define PACKET_FANOUT_CBPF 6
+#endif
+
+struct broker_con {
+	int fd;
+	int dead; /* removed, freed at the end of the loop round */
+	unsigned int console;
+	char name[32];
+	uint32_t session;
+	unsigned char client[6]; /* last client, broadcast until one attaches */
+	int clientver;
+	int clientpack;
+};
+
+/* one thread with its own socket, queues and share of the consoles */
+struct broker_worker {
+	int index;
+	int s;
+	struct txsched *txs;
+	struct sk_buff *skb;
+	int ctl[2]; /* others send on [0], the worker reads [1] */
+	struct broker_con *con[BROKER_MAX];
+	int ncon;
+	/* HELLOs still to send in answer to a scan */
+	struct {
+		int active;
+		int next;
+		unsigned char mac[6];
+		int version, pack;
+	} scan;
+	struct pollfd fds[3 + BROKER_REGS + BROKER_MAX];
+	pthread_t thread;
+};
+
+/* passed to a worker on its ctl socket, followed by the data */
+struct broker_fwd {
+	int type;
+	int reply; /* BROKER_REG: first fd passed is the connection to answer */
+	int raw; /* BROKER_REG: put the terminal in raw mode */
+	struct sockaddr_ll from; /* BROKER_MSG: sender */
+};
+enum { BROKER_REG=1,	/* registration message, with the terminal fd if any */
+       BROKER_MSG };	/* message from the network for a console of the worker */
+
+static struct {
+	int ifindex, debug;
+	const struct lowlat *ll;
+	int listen;
+	int reg[BROKER_REGS];
+	struct broker_worker *w[BROKER_WORKERS];
+	int nworker;
+} b;
+
+static void broker_dest(struct sockaddr_ll *dest, const unsigned char *mac)
+{
+	memset(dest, 0, sizeof(struct sockaddr_ll));
+	dest->sll_family = AF_PACKET;
+	dest->sll_halen = 6;
+	dest->sll_protocol = htons(ETH_P_EGETTY);
+	dest->sll_ifindex = b.ifindex;
+	memcpy(dest->sll_addr, mac, 6);
+}
+
+/* the fanout program puts a console on the same worker */
+static struct broker_worker *broker_owner(unsigned int console)
+{
+	return b.w[console % b.nworker];
+}
+
+static struct broker_con *broker_find(struct broker_worker *w, unsigned int console)
+{
+	int i;
+
+	for(i=0;i<w->ncon;i++)
+		if(!w->con[i]->dead && w->con[i]->console == console)
+			return w->con[i];
+	return NULL;
+}
+
+static int broker_hello(struct broker_worker *w, const struct broker_con *c,
+			const unsigned char *mac, int version, int pack)
+{
+	struct sockaddr_ll dest;
+	struct sk_buff *skb;
+
+	skb = txsched_alloc(w->txs, TXQ_CTRL);
+	if(!skb)
+		return -1;
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_put_caps(skb, c->console, c->session);
+	proto_push(skb, proto_version(version, c->console), EGETTY_HELLO, c->console, c->session);
+	broker_dest(&dest, mac);
+	return txsched_enqueue(w->txs, TXQ_CTRL, skb, &dest, pack);
+}
+
+/* answer a scan with one HELLO per console, as buffers allow */
+static void broker_scan_run(struct broker_worker *w)
+{
+	if(!w->scan.active)
+		return;
+	while(w->scan.next < w->ncon && txsched_avail(w->txs, TXQ_BULK)) {
+		if(!w->con[w->scan.next]->dead)
+			broker_hello(w, w->con[w->scan.next], w->scan.mac, w->scan.version, w->scan.pack);
+		w->scan.next++;
+	}
+	if(w->scan.next >= w->ncon)
+		w->scan.active = 0;
+}
+
+static int broker_add(struct broker_worker *w, int fd, unsigned int console, const char *name, int raw)
+{
+	static const unsigned char bcast[6] = { 255, 255, 255, 255, 255, 255 };
+	struct broker_con *c;
+	struct termios tio;
+
+	c = broker_find(w, console);
+	if(c) {
+		close(c->fd);
+	} else {
+		if(w->ncon == BROKER_MAX)
+			return ENOSPC;
+		c = malloc(sizeof(struct broker_con));
+		if(!c)
+			return ENOMEM;
+		memset(c, 0, sizeof(struct broker_con));
+		c->console = console;
+		memcpy(c->client, bcast, 6);
+		c->clientver = PROTO_V1;
+		w->con[w->ncon++] = c;
+	}
+	c->fd = fd;
+	c->session = (lowlat_now() ^ ((uint32_t)console << 16) ^ fd) | 1;
+	strncpy(c->name, name, sizeof(c->name) - 1);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if(raw && !tcgetattr(fd, &tio)) {
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	if(b.debug)
+		printf("console %u: %s fd %d worker %d\n", console, c->name, fd, w->index);
+	broker_hello(w, c, bcast, PROTO_V1, 0);
+	return 0;
+}
+
+static void broker_del(struct broker_con *c)
+{
+	if(b.debug)
+		printf("console %u: %s removed\n", c->console, c->name);
+	close(c->fd);
+	c->fd = -1;
+	c->dead = 1;
+}
+
+/* free removed consoles, keeping the order of the rest */
+static void broker_compact(struct broker_worker *w)
+{
+	int i, n = 0;
+
+	for(i=0;i<w->ncon;i++) {
+		if(w->con[i]->dead) {
+			free(w->con[i]);
+			if(w->scan.active && w->scan.next > n)
+				w->scan.next--;
+			continue;
+		}
+		w->con[n++] = w->con[i];
+	}
+	w->ncon = n;
+}
+
+/* hand data and fds to worker 'w'. Never blocks: a full worker drops it */
+static int broker_forward(struct broker_worker *w, const struct broker_fwd *f,
+			  const void *data, unsigned int len, const int *fd, int nfd)
+{
+	char ctrl[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	iov[0].iov_base = (void *)f;
+	iov[0].iov_len = sizeof(struct broker_fwd);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if(nfd) {
+		msg.msg_control = ctrl;
+		msg.msg_controllen = CMSG_SPACE(nfd * sizeof(int));
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfd * sizeof(int));
+		memcpy(CMSG_DATA(cm), fd, nfd * sizeof(int));
+	}
+	if(sendmsg(w->ctl[0], &msg, MSG_DONTWAIT|MSG_NOSIGNAL) == -1)
+		return errno;
+	return 0;
+}
+
+/* open devices named as PATH:CONSOLE */
+static void broker_ttys(char **ttys, int ntty)
+{
+	struct broker_fwd f;
+	char path[256], data[34], *p;
+	int i, fd, rc;
+	unsigned int console;
+
+	memset(&f, 0, sizeof(f));
+	f.type = BROKER_REG;
+	f.raw = 1;
+	for(i=0;i<ntty;i++) {
+		strncpy(path, ttys[i], sizeof(path) - 1);
+		path[sizeof(path) - 1] = 0;
+		p = strrchr(path, ':');
+		if(!p) {
+			fprintf(stderr, "tty %s: no console number\n", ttys[i]);
+			continue;
+		}
+		*p++ = 0;
+		fd = open(path, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC);
+		if(fd == -1) {
+			fprintf(stderr, "tty %s: %s\n", path, strerror(errno));
+			continue;
+		}
+		console = atoi(p) & 0xffff;
+		data[0] = console >> 8;
+		data[1] = console;
+		strncpy(data + 2, path, sizeof(data) - 2);
+		rc = broker_forward(broker_owner(console), &f, data, 2 + strnlen(data + 2, sizeof(data) - 2), &fd, 1);
+		if(rc)
+			fprintf(stderr, "tty %s: %s\n", path, strerror(rc));
+		close(fd);
+	}
+}
+
+static int broker_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	   chmod(path, 0600) || listen(fd, 8)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * One registration message, passed on to the worker that owns the
+ * console, which answers. Returns -1 when the connection is done.
+ */
+static int broker_register(int fd)
+{
+	char data[64], ctrl[CMSG_SPACE(4 * sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct broker_fwd f;
+	int i, n, rxfd = -1, nfd, fds[2];
+	unsigned char rc = 0;
+	unsigned int console;
+
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data) - 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if(n == -1)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfd = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(i=0;i<nfd;i++) {
+			int f;
+			memcpy(&f, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			/* one terminal per message */
+			if(rxfd == -1)
+				rxfd = f;
+			else
+				close(f);
+		}
+	}
+	if(n == 0 && rxfd == -1)
+		return -1;
+	if(n < 2) {
+		rc = EINVAL;
+	} else {
+		console = ((unsigned char)data[0] << 8) | (unsigned char)data[1];
+		memset(&f, 0, sizeof(f));
+		f.type = BROKER_REG;
+		f.reply = 1;
+		fds[0] = fd;
+		fds[1] = rxfd;
+		rc = broker_forward(broker_owner(console), &f, data, n, fds, rxfd == -1 ? 1 : 2);
+	}
+	if(rxfd != -1)
+		close(rxfd);
+	if(rc)
+		send(fd, &rc, 1, MSG_NOSIGNAL|MSG_DONTWAIT);
+	return 0;
+}
+
+/* terminal output to the client of the console */
+static void broker_output(struct broker_worker *w, struct broker_con *c)
+{
+	struct sockaddr_ll dest;
+	struct sk_buff *skb;
+	ssize_t n;
+
+	skb = txsched_alloc(w->txs, TXQ_BULK);
+	if(!skb)
+		return;
+	skb_reserve(skb, PROTO_HDRMAX);
+	n = read(c->fd, skb_put(skb, 0), skb_tailroom(skb));
+	if(n <= 0) {
+		txsched_free(w->txs, skb);
+		if(n == 0 || (errno != EAGAIN && errno != EINTR))
+			broker_del(c);
+		return;
+	}
+	skb_put(skb, n);
+	proto_push(skb, proto_version(c->clientver, c->console), EGETTY_OUT, c->console, c->session);
+	broker_dest(&dest, c->client);
+	/* one class: output of a terminal stays in order */
+	txsched_enqueue(w->txs, TXQ_BULK, skb, &dest, c->clientpack);
+}
+
+static void broker_client(struct broker_con *c, const struct sockaddr_ll *from, const struct proto_hdr *h)
+{
+	memcpy(c->client, from->sll_addr, 6);
+	c->clientver = h->version;
+	c->clientpack = (h->version >= PROTO_V2 && (h->flags & PROTO_F_BUNDLE)) ? TXQ_PACK : 0;
+}
+
+static void broker_msg(struct broker_worker *w, const struct sockaddr_ll *from, const struct proto_hdr *h,
+		       const uint8_t *p, unsigned int len)
+{
+	struct sockaddr_ll dest;
+	struct sk_buff *skb;
+	struct broker_con *c;
+	struct winsize winp;
+	int flags = 0;
+
+	if(h->type == EGETTY_SCAN) {
+		memcpy(w->scan.mac, from->sll_addr, 6);
+		w->scan.version = proto_caps(h, p, NULL, NULL, &flags);
+		w->scan.pack = (w->scan.version >= PROTO_V2 && (flags & PROTO_F_BUNDLE)) ? TXQ_PACK : 0;
+		w->scan.next = 0;
+		w->scan.active = 1;
+		return;
+	}
+	if(h->type == EGETTY_PING) {
+		/* only for consoles we have */
+		c = broker_find(w, h->console);
+		if(!c)
+			return;
+		skb = txsched_alloc(w->txs, TXQ_CTRL);
+		if(!skb)
+			return;
+		skb_reserve(skb, PROTO_HDRMAX);
+		memcpy(skb_put(skb, len), p, len);
+		proto_push(skb, h->version, EGETTY_PONG, h->console, c->session);
+		broker_dest(&dest, from->sll_addr);
+		txsched_enqueue(w->txs, TXQ_CTRL, skb, &dest,
+				(h->version >= PROTO_V2 && (h->flags & PROTO_F_BUNDLE)) ? TXQ_PACK : 0);
+		return;
+	}
+
+	c = broker_find(w, h->console);
+	if(!c) {
+		if(b.debug)
+			printf("no console %u\n", h->console);
+		return;
+	}
+	if(h->type == EGETTY_IN) {
+		broker_client(c, from, h);
+		if(write(c->fd, p, len) != len && b.debug)
+			printf("console %u: input dropped\n", c->console);
+		return;
+	}
+	if(h->type == EGETTY_WINCH) {
+		broker_client(c, from, h);
+		if(h->version == PROTO_V1) {
+			winp.ws_row = p[0];
+			winp.ws_col = p[1];
+		} else {
+			if(len < 4)
+				return;
+			winp.ws_row = (p[0] << 8) | p[1];
+			winp.ws_col = (p[2] << 8) | p[3];
+		}
+		winp.ws_xpixel = 0;
+		winp.ws_ypixel = 0;
+		ioctl(c->fd, TIOCSWINSZ, &winp);
+		return;
+	}
+	/* there is no login to hang up; other requests need features we lack */
+	if(b.debug)
+		printf("console %u: ignored type %d\n", c->console, h->type);
+}
+
+/*
+ * A message from the network. Bundles may hold messages for consoles of
+ * other workers, and every worker answers a scan for its own consoles.
+ * 'p' is the message header.
+ */
+static void broker_rx(struct broker_worker *w, const struct sockaddr_ll *from,
+		      const struct proto_hdr *h, const uint8_t *p)
+{
+	struct broker_worker *owner = broker_owner(h->console);
+	struct broker_fwd f;
+	int i;
+
+	if(b.nworker > 1 && (h->type == EGETTY_SCAN || owner != w)) {
+		memset(&f, 0, sizeof(f));
+		f.type = BROKER_MSG;
+		f.from = *from;
+		for(i=0;i<b.nworker;i++)
+			if(b.w[i] != w && (h->type == EGETTY_SCAN || b.w[i] == owner))
+				broker_forward(b.w[i], &f, p, h->len, NULL, 0);
+		if(h->type != EGETTY_SCAN)
+			return;
+	}
+	broker_msg(w, from, h, p + h->hlen, h->len - h->hlen);
+}
+
+/* what other threads passed on to worker 'w' */
+static void broker_ctl(struct broker_worker *w)
+{
+	unsigned char buf[sizeof(struct broker_fwd) + PROTO_MTU];
+	char ctrl[CMSG_SPACE(2 * sizeof(int))], name[64];
+	struct broker_fwd f;
+	struct proto_hdr h;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct broker_con *c;
+	const uint8_t *p;
+	unsigned int off, console;
+	int n, i, nfd, fd[2], reply, tty;
+	unsigned char rc;
+
+	while(1) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		n = recvmsg(w->ctl[1], &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+		if(n < (int)sizeof(f))
+			return;
+		memcpy(&f, buf, sizeof(f));
+		n -= sizeof(f);
+		nfd = 0;
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+				continue;
+			for(i=0;i < (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int) && nfd < 2;i++)
+				memcpy(&fd[nfd++], CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+		}
+
+		if(f.type == BROKER_MSG) {
+			off = 0;
+			while((p = proto_next(buf + sizeof(f), n, &off, &h)))
+				broker_msg(w, &f.from, &h, p + h.hlen, h.len - h.hlen);
+			continue;
+		}
+		if(f.type != BROKER_REG || n < 2)
+			continue;
+
+		reply = f.reply && nfd ? fd[0] : -1;
+		tty = nfd > (reply != -1) ? fd[reply != -1] : -1;
+		console = (buf[sizeof(f)] << 8) | buf[sizeof(f) + 1];
+		n -= 2;
+		if(n >= (int)sizeof(name))
+			n = sizeof(name) - 1;
+		memcpy(name, buf + sizeof(f) + 2, n);
+		name[n] = 0;
+		rc = 0;
+		if(tty != -1) {
+			rc = broker_add(w, tty, console, name, f.raw);
+			if(rc)
+				close(tty);
+		} else {
+			c = broker_find(w, console);
+			if(c)
+				broker_del(c);
+			else
+				rc = ENOENT;
+		}
+		if(reply != -1) {
+			send(reply, &rc, 1, MSG_NOSIGNAL|MSG_DONTWAIT);
+			close(reply);
+		} else if(rc)
+			fprintf(stderr, "console %u: %s\n", console, strerror(rc));
+	}
+}
+
+static void broker_loop(struct broker_worker *w)
+{
+	struct sockaddr_ll from;
+	socklen_t fromlen;
+	struct proto_hdr h;
+	struct txsched *txs = w->txs;
+	struct pollfd *fds = w->fds;
+	const uint8_t *p;
+	unsigned int off;
+	int i, n, nfds, ncon, timeout, rx;
+
+	/* registrations come in on the first worker, the main thread */
+	while(1) {
+		broker_scan_run(w);
+		if(txsched_pending(txs))
+			txsched_run(txs, w->s);
+
+		timeout = -1;
+		fds[0].fd = w->s;
+		fds[0].events = POLLIN;
+		if(txs->due) {
+			timeout = txsched_timeout(txs);
+		} else if(txsched_pending(txs)) {
+			if(txs->blocked == ENOBUFS)
+				timeout = 1;
+			else
+				fds[0].events |= POLLOUT;
+		}
+		/* rest of a scan waits for buffers */
+		if(w->scan.active && timeout == -1)
+			timeout = 1;
+		fds[1].fd = w->ctl[1];
+		fds[1].events = POLLIN;
+		fds[2].fd = w->index ? -1 : b.listen;
+		fds[2].events = POLLIN;
+		for(i=0;i<BROKER_REGS;i++) {
+			fds[3+i].fd = w->index ? -1 : b.reg[i];
+			fds[3+i].events = POLLIN;
+		}
+		/* no buffers: output stays in the terminals */
+		ncon = w->ncon;
+		for(i=0;i<ncon;i++) {
+			fds[3+BROKER_REGS+i].fd = txsched_avail(txs, TXQ_BULK) ? w->con[i]->fd : -1;
+			fds[3+BROKER_REGS+i].events = POLLIN;
+		}
+		nfds = 3 + BROKER_REGS + ncon;
+		for(i=0;i<nfds;i++)
+			fds[i].revents = 0;
+
+		n = poll(fds, nfds, timeout);
+		if(n <= 0)
+			continue;
+
+		/* several frames per wakeup: many consoles share this socket */
+		for(rx = 0; (fds[0].revents & POLLIN) && rx < 64; rx++) {
+			fromlen = sizeof(from);
+			skb_reset(w->skb);
+			n = recvfrom(w->s, w->skb->data, skb_tailroom(w->skb), MSG_DONTWAIT,
+				     (struct sockaddr *)&from, &fromlen);
+			if(n == -1)
+				break;
+			off = 0;
+			while((p = proto_next(w->skb->data, n, &off, &h)))
+				broker_rx(w, &from, &h, p);
+		}
+		if(fds[1].revents & POLLIN)
+			broker_ctl(w);
+
+		if(fds[2].revents & POLLIN) {
+			int fd = accept4(b.listen, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+			for(i=0;fd != -1 && i<BROKER_REGS;i++)
+				if(b.reg[i] == -1) {
+					b.reg[i] = fd;
+					fd = -1;
+				}
+			if(fd != -1)
+				close(fd);
+		}
+		for(i=0;i<BROKER_REGS;i++) {
+			if(!fds[3+i].revents || fds[3+i].fd != b.reg[i])
+				continue;
+			if(broker_register(b.reg[i])) {
+				close(b.reg[i]);
+				b.reg[i] = -1;
+			}
+		}
+
+		for(i=0;i<ncon;i++) {
+			n = fds[3+BROKER_REGS+i].revents;
+			if(!n || w->con[i]->dead)
+				continue;
+			if(n & POLLIN)
+				broker_output(w, w->con[i]);
+			else
+				broker_del(w->con[i]);
+		}
+		broker_compact(w);
+	}
+}
+
+static void *broker_thread(void *arg)
+{
+	struct broker_worker *w = arg;
+
+	/* with cpu= each worker gets its own cpu */
+	lowlat_thread(b.ll, w->index);
+	broker_loop(w);
+	return NULL;
+}
+
+/* worker 'index' on packet socket 's', or a new one if -1 */
+static struct broker_worker *broker_worker(int index, int s, struct txsched *txs, int hold)
+{
+	struct broker_worker *w;
+	struct sockaddr_ll addr;
+
+	w = calloc(1, sizeof(struct broker_worker));
+	if(!w)
+		return NULL;
+	w->index = index;
+	w->skb = alloc_skb(PROTO_MTU);
+	if(!w->skb)
+		return NULL;
+	w->txs = txs;
+	if(!w->txs) {
+		w->txs = malloc(sizeof(struct txsched));
+		if(!w->txs || txsched_init(w->txs, 1500))
+			return NULL;
+		w->txs->hold = hold;
+	}
+	w->s = s;
+	if(w->s == -1) {
+		w->s = socket(PF_PACKET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, htons(ETH_P_EGETTY));
+		if(w->s == -1)
+			return NULL;
+		memset(&addr, 0, sizeof(addr));
+		addr.sll_family = AF_PACKET;
+		addr.sll_protocol = htons(ETH_P_EGETTY);
+		addr.sll_ifindex = b.ifindex;
+		if(bind(w->s, (const struct sockaddr *)&addr, sizeof(addr)))
+			return NULL;
+		lowlat_socket(w->s, b.ll);
+	}
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, w->ctl))
+		return NULL;
+	return w;
+}
+
+/*
+ * Join the worker sockets to one fanout group, in worker order. The
+ * kernel runs the program on each frame and takes the result modulo the
+ * number of sockets: the console number picks the worker. Scans and
+ * bundles have console 0.
+ */
+static int broker_fanout(void)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, EGETTY_V2, 2, 0),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 1), /* version 1 */
+		BPF_STMT(BPF_RET|BPF_A, 0),
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 2), /* version 2 */
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct sock_fprog prog;
+	int i, arg = (getpid() & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+
+	for(i=0;i<b.nworker;i++)
+		if(setsockopt(b.w[i]->s, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)))
+			return -1;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(b.w[0]->s, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog));
+}
+
+int broker_run(int s, int ifindex, struct txsched *txs, const char *path,
+	       char **ttys, int ntty, int workers, const struct lowlat *ll, int debug)
+{
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.ifindex = ifindex;
+	b.ll = ll;
+	b.debug = debug;
+	for(i=0;i<BROKER_REGS;i++)
+		b.reg[i] = -1;
+	b.listen = -1;
+	if(path) {
+		b.listen = broker_listen(path);
+		if(b.listen == -1) {
+			fprintf(stderr, "broker %s: %s\n", path, strerror(errno));
+			return 1;
+		}
+	}
+	if(workers < 1)
+		workers = 1;
+	if(workers > BROKER_WORKERS)
+		workers = BROKER_WORKERS;
+	for(i=0;i<workers;i++) {
+		b.w[i] = broker_worker(i, i ? -1 : s, i ? NULL : txs, txs->hold);
+		if(!b.w[i]) {
+			fprintf(stderr, "broker worker: %s\n", strerror(errno ? errno : ENOMEM));
+			return 1;
+		}
+		b.nworker++;
+	}
+	if(b.nworker > 1 && broker_fanout()) {
+		fprintf(stderr, "broker fanout: %s\n", strerror(errno));
+		return 1;
+	}
+	broker_ttys(ttys, ntty);
+	for(i=1;i<b.nworker;i++) {
+		errno = pthread_create(&b.w[i]->thread, NULL, broker_thread, b.w[i]);
+		if(errno) {
+			fprintf(stderr, "broker worker: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	broker_loop(b.w[0]);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef BROKER_H
+#define BROKER_H
+
+#include "txq.h"
+
+/*
+ * Broker mode: egetty exports terminals that already exist, pty masters
+ * of containers or serial lines of virtual machines, instead of running
+ * login. Each gets a console number and is reached with the usual scan
+ * and attach, all through one event loop and one packet socket.
+ *
+ * Terminals are registered over a unix socket (SOCK_SEQPACKET), one
+ * message per terminal, the fd passed with SCM_RIGHTS and as data
+ *  uint16_t console;  big endian
+ *  char name[];       optional, shown in debug output
+ * The same message without an fd removes the console. An fd for a
+ * console that exists replaces it. Each message is answered with one
+ * byte: 0, or an errno.
+ *
+ * Devices can also be named at startup as PATH:CONSOLE. These are put in
+ * raw mode; registered fds are used as they are.
+ *
+ * A terminal is removed when it hangs up. Compression, the screen model,
+ * history and file transfer are not available for brokered consoles.
+ *
+ * With more than one worker each is a thread with its own packet socket
+ * in a PACKET_FANOUT group, its own transmit queues and the consoles
+ * whose number modulo the worker count is its index. A fanout program
+ * sends frames for a console to its worker, so the fast path shares
+ * nothing. Scans, and messages in bundles for consoles of another
+ * worker, are passed on over a socketpair. Registrations are read by
+ * the main thread, which is worker 0, and answered by the owner.
+ */
+
+#define BROKER_MAX 1024 /* consoles per worker */
+#define BROKER_REGS 16 /* open registration connections */
+#define BROKER_WORKERS 64
+
+struct lowlat;
+
+int broker_run(int s, int ifindex, struct txsched *txs, const char *path,
+	       char **ttys, int ntty, int workers, const struct lowlat *ll, int debug);
+
+#endif
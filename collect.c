@@ -0,0 +1,282 @@
+/*
+ * File: collect.c
+ * Implements: passive capture of console traffic
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "egetty.h"
+#include "session.h"
+#include "collect.h"
+#include "proto.h"
+#include "lz.h"
+
+#define COLLECT_BLOCK 65536
+#define COLLECT_BLOCKS 64
+#define COLLECT_FRAME 2048
+#define COLLECT_BUF 65536
+#define COLLECT_IDXBUF (COLLECT_BUF / 4)
+
+struct collect_if {
+	int s;
+	int ifindex;
+	unsigned char *ring;
+	unsigned int frames, next;
+};
+
+struct collect_src {
+	int logfd, idxfd;
+	uint64_t offset; /* size of .log including buffered data */
+	unsigned int loglen, idxlen;
+	struct lz *lz; /* decoder for compressed output */
+	unsigned char log[COLLECT_BUF];
+	unsigned char idx[COLLECT_IDXBUF];
+};
+
+static volatile sig_atomic_t collect_stop;
+
+static void collect_signal(int sig)
+{
+	collect_stop = 1;
+}
+
+static int collect_open(struct collect_if *cif, const char *device, int promisc)
+{
+	struct tpacket_req req;
+	struct sockaddr_ll addr;
+	int version = TPACKET_V2;
+
+	cif->ifindex = if_nametoindex(device);
+	if(!cif->ifindex) {
+		fprintf(stderr, "no such device %s\n", device);
+		return -1;
+	}
+	/* no protocol yet: nothing is queued until bind() */
+	cif->s = socket(PF_PACKET, SOCK_DGRAM, 0);
+	if(cif->s == -1) {
+		fprintf(stderr, "socket(): %s\n", strerror(errno));
+		return -1;
+	}
+	/* bound before the ring is set up, so it only ever sees this interface */
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_EGETTY);
+	addr.sll_ifindex = cif->ifindex;
+	if(bind(cif->s, (const struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "bind failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(setsockopt(cif->s, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+		fprintf(stderr, "PACKET_VERSION: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = COLLECT_BLOCK;
+	req.tp_block_nr = COLLECT_BLOCKS;
+	req.tp_frame_size = COLLECT_FRAME;
+	req.tp_frame_nr = COLLECT_BLOCK / COLLECT_FRAME * COLLECT_BLOCKS;
+	if(setsockopt(cif->s, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		fprintf(stderr, "PACKET_RX_RING: %s\n", strerror(errno));
+		return -1;
+	}
+	cif->frames = req.tp_frame_nr;
+	cif->ring = mmap(NULL, COLLECT_BLOCK * COLLECT_BLOCKS, PROT_READ|PROT_WRITE,
+			 MAP_SHARED, cif->s, 0);
+	if(cif->ring == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(promisc) {
+		struct packet_mreq mr;
+		memset(&mr, 0, sizeof(mr));
+		mr.mr_ifindex = cif->ifindex;
+		mr.mr_type = PACKET_MR_PROMISC;
+		if(setsockopt(cif->s, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)))
+			fprintf(stderr, "PACKET_MR_PROMISC: %s\n", strerror(errno));
+	}
+	return 0;
+}
+
+static void collect_flush(struct collect_src *src)
+{
+	if(src->loglen && write(src->logfd, src->log, src->loglen) != src->loglen)
+		fprintf(stderr, "log write: %s\n", strerror(errno));
+	if(src->idxlen && write(src->idxfd, src->idx, src->idxlen) != src->idxlen)
+		fprintf(stderr, "idx write: %s\n", strerror(errno));
+	src->loglen = src->idxlen = 0;
+}
+
+static struct collect_src *collect_src(struct session_table *t, const char *dir,
+				       const unsigned char *mac, int console)
+{
+	struct session *sess;
+	struct collect_src *src;
+	char fn[512];
+	int n;
+
+	sess = session_find(t, mac, console);
+	if(sess)
+		return sess->priv;
+	sess = session_add(t, mac, console);
+	src = malloc(sizeof(struct collect_src));
+	if(!sess || !src) return NULL;
+	memset(src, 0, sizeof(struct collect_src));
+	
+	n = snprintf(fn, sizeof(fn) - 4, "%s/%02x%02x%02x%02x%02x%02x-%d.", dir,
+		     mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], console);
+	strcpy(fn + n, "log");
+	src->logfd = open(fn, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	strcpy(fn + n, "idx");
+	src->idxfd = open(fn, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if(src->logfd == -1 || src->idxfd == -1) {
+		fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+		exit(1);
+	}
+	src->offset = lseek(src->logfd, 0, SEEK_END);
+	sess->priv = src;
+	return src;
+}
+
+static void collect_msg(struct session_table *t, const char *dir, int ifindex,
+			const unsigned char *mac, const struct proto_hdr *h, const unsigned char *p,
+			uint64_t ns)
+{
+	struct collect_src *src;
+	struct collect_idx idx;
+	const unsigned char *data = p + h->hlen;
+	unsigned int len, console;
+
+	if(h->type != EGETTY_OUT && h->type != EGETTY_KMSG && h->type != EGETTY_HELLO)
+		return;
+	len = 0;
+	console = h->console;
+	if(h->type == EGETTY_HELLO)
+		proto_caps(h, p + h->hlen, &console, NULL, NULL);
+	else
+		len = h->len - h->hlen;
+	src = collect_src(t, dir, mac, console);
+	if(!src) return;
+	/* a compressed stream joined midway is unreadable until egetty restarts it */
+	if(h->type != EGETTY_HELLO && lz_output(&src->lz, h->flags & PROTO_F_LZ, &data, &len) < 0)
+		return;
+
+	if(src->loglen + len > COLLECT_BUF || src->idxlen + sizeof(idx) > COLLECT_IDXBUF)
+		collect_flush(src);
+
+	memset(&idx, 0, sizeof(idx));
+	idx.ns = ns;
+	idx.offset = src->offset;
+	idx.len = len;
+	idx.type = h->type;
+	idx.ifindex = ifindex;
+	memcpy(src->idx + src->idxlen, &idx, sizeof(idx));
+	src->idxlen += sizeof(idx);
+	memcpy(src->log + src->loglen, data, len);
+	src->loglen += len;
+	src->offset += len;
+}
+
+/* log each message in frame, bundles are split up */
+static void collect_frame(struct session_table *t, const char *dir, int ifindex,
+			  const unsigned char *mac, const unsigned char *p, unsigned int n,
+			  uint64_t ns)
+{
+	const unsigned char *msg;
+	struct proto_hdr h;
+	unsigned int off = 0;
+
+	while((msg = proto_next(p, n, &off, &h)))
+		collect_msg(t, dir, ifindex, mac, &h, msg, ns);
+}
+
+/* process all frames the kernel has handed over */
+static int collect_ring(struct collect_if *cif, struct session_table *t, const char *dir)
+{
+	struct tpacket2_hdr *h;
+	struct sockaddr_ll *sll;
+	int count = 0;
+
+	while(1) {
+		h = (struct tpacket2_hdr *)(cif->ring + cif->next * COLLECT_FRAME);
+		if(!(__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+		sll = (struct sockaddr_ll *)((unsigned char *)h + TPACKET_ALIGN(sizeof(struct tpacket2_hdr)));
+		if(sll->sll_pkttype != PACKET_OUTGOING)
+			collect_frame(t, dir, cif->ifindex, sll->sll_addr,
+				      (unsigned char *)h + h->tp_net, h->tp_snaplen,
+				      (uint64_t)h->tp_sec * 1000000000ULL + h->tp_nsec);
+		__atomic_store_n(&h->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		cif->next = (cif->next + 1) % cif->frames;
+		count++;
+	}
+	return count;
+}
+
+int collect_run(const char *dir, char **devices, int ndevices, int promisc)
+{
+	struct collect_if *cif;
+	struct pollfd *fds;
+	struct session_table t;
+	struct tpacket_stats st;
+	socklen_t stlen;
+	unsigned long drops = 0;
+	time_t lastflush = time(0);
+	int i;
+
+	mkdir(dir, 0755);
+	if(session_table_init(&t, 4096))
+		return 1;
+	cif = calloc(ndevices, sizeof(struct collect_if));
+	fds = calloc(ndevices, sizeof(struct pollfd));
+	for(i=0;i<ndevices;i++) {
+		if(collect_open(&cif[i], devices[i], promisc))
+			return 1;
+		fds[i].fd = cif[i].s;
+		fds[i].events = POLLIN;
+	}
+	signal(SIGINT, collect_signal);
+	signal(SIGTERM, collect_signal);
+
+	while(!collect_stop) {
+		for(i=0;i<ndevices;i++)
+			fds[i].revents = 0;
+		poll(fds, ndevices, 1000);
+		for(i=0;i<ndevices;i++)
+			collect_ring(&cif[i], &t, dir);
+
+		if(time(0) != lastflush) {
+			lastflush = time(0);
+			for(i=0;i<t.count;i++)
+				collect_flush(t.list[i]->priv);
+		}
+	}
+	for(i=0;i<t.count;i++)
+		collect_flush(t.list[i]->priv);
+	for(i=0;i<ndevices;i++) {
+		stlen = sizeof(st);
+		if(!getsockopt(cif[i].s, SOL_PACKET, PACKET_STATISTICS, &st, &stlen))
+			drops += st.tp_drops;
+	}
+	fprintf(stderr, "%d sources, %lu frames dropped by kernel\n", t.count, drops);
+	return 0;
+}
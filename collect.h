@@ -0,0 +1,27 @@
+#ifndef COLLECT_H
+#define COLLECT_H
+
+/*
+ * Passive collector. Captures EGETTY_OUT, EGETTY_KMSG and EGETTY_HELLO
+ * frames on one or more interfaces through a memory-mapped receive ring
+ * and writes, for every source (MAC, console):
+ *  DIR/<mac>-<console>.log  payload bytes in arrival order
+ *  DIR/<mac>-<console>.idx  one struct collect_idx per frame
+ * File writes are batched per source.
+ */
+
+#include <stdint.h>
+
+struct collect_idx {
+	uint64_t ns; /* CLOCK_REALTIME receive timestamp */
+	uint64_t offset; /* of payload in .log */
+	uint16_t len;
+	uint8_t type;
+	uint8_t reserved;
+	uint32_t ifindex; /* interface indexes go past 255 */
+};
+
+/* runs until SIGINT/SIGTERM. Returns exit code */
+int collect_run(const char *dir, char **devices, int ndevices, int promisc);
+
+#endif
@@ -28,6 +28,8 @@
 
 #include <termios.h> /* for tcgetattr */
 #include <sys/ioctl.h> /* for winsize */
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <signal.h>
 
 #include <time.h>
@@ -37,26 +39,120 @@
 #include "egetty.h"
 #include "skbuff.h"
 #include "jelopt.h"
+#include "lowlat.h"
+#include "rec.h"
+#include "session.h"
+#include "batch.h"
+#include "collect.h"
+#include "xfer.h"
+#include "proto.h"
+#include "lz.h"
+#include "tstamp.h"
+#include "vlan.h"
+
+#define SCAN_PROBES 3 /* rounds of direct probes for silent scan targets */
+#define SCAN_PROBE_WAIT 300 /* ms to wait for answers to a probe */
 
 struct {
 	int debug;
 	int console;
+	int version; /* protocol version egetty speaks */
+	uint32_t session; /* login session id seen from egetty */
 	int devsocket;
 	int scan;
+	int ping, count;
+	int stats;
+	int replay;
+	char *batch;
+	int scantime;
+	int spread; /* ms scanned egettys spread their answers over */
+	struct {
+		struct session_table seen; /* consoles that answered */
+		int rounds; /* re-probes of silent targets left */
+		long long next; /* lowlat_now() of the next round */
+	} probe;
+	char *collect;
+	char *ifaces[64];
+	int nifaces, promisc;
+
+	/* file transfer */
+	int put, get, resume, window;
+	char *local, *remote;
 	int ucast;
 	int row, col;
+	volatile int winched;
 	int s;
 	int ifindex;
+	int vlan; /* 802.1Q VLAN on a trunk, 0 if untagged */
 	
 	struct sockaddr_ll dest;
 	
 	struct termios term;
+	struct lowlat lowlat;
+
+	/* cluster mode */
+	struct session_table targets;
+	struct session *last; /* session that wrote output last */
+	struct sk_buff *txskb;
+	struct sk_buff *packskb; /* bundle being built */
+	unsigned char packmac[6];
+	int packcount;
+	int cmdmode;
+	char cmdline[256];
+	int cmdlen;
+
+	struct rec *rec;
+	char *record;
+	int recordsize;
+
+	struct lz *lz; /* decoder for compressed output */
+
+	struct tstamp tstamp;
+	long long keytime; /* last keystroke sent, for TSTAMP_ECHO */
+
+	/* input batching */
+	struct {
+		int gap; /* usecs between reads that still counts as a paste */
+		int window; /* bytes the remote is sent per interval */
+		int interval; /* ms */
+		int active; /* inside bracketed paste */
+		int tokens;
+		long long last, refill;
+		struct sk_buff *skb; /* pending paste data */
+	} paste;
+
+	/* terminal output stage */
+	struct {
+		int skip; /* drop old output when the terminal falls behind */
+		int delay; /* ms output may be held back */
+		int flags; /* original flags of fd 1 */
+		unsigned int size, head, len;
+		unsigned char *buf;
+		long long first; /* when oldest buffered byte arrived */
+		unsigned long long skipped, unreported;
+	} out;
+
+	/* predictive local echo */
+	struct {
+		int on;
+		int timeout; /* ms a shown key may go without echo */
+		int shown; /* echo seen since the last barrier: draw keys */
+		int barrier; /* sent a key we cannot predict, until output arrives */
+		unsigned char key[64]; /* sent, echo not seen yet */
+		int n, drawn;
+		long long since; /* when key[0] was sent */
+		unsigned long long hits, misses;
+		int saved; /* remote saved the cursor: its slot is not ours */
+		int alt; /* remote is on the alternate screen */
+		int esc; /* escape sequence state of remote output */
+		char csi[16];
+		int csilen;
+	} predict;
 } conf;
 
-static int console_send(int s, int ifindex, struct sk_buff *skb)
+static int console_send_to(int s, int ifindex, const unsigned char *mac, struct sk_buff *skb)
 {
 	struct sockaddr_ll dest;
-	socklen_t destlen = sizeof(dest);
 	int rc;
 
 	memset(&dest, 0, sizeof(dest));
@@ -65,12 +161,12 @@ static int console_send(int s, int ifindex, struct sk_buff *skb)
 	dest.sll_halen = 6;
 	dest.sll_protocol = htons(ETH_P_EGETTY);
 	dest.sll_ifindex = ifindex;
-	if(conf.ucast)
-		memcpy(dest.sll_addr, conf.dest.sll_addr, 6);
+	if(mac)
+		memcpy(dest.sll_addr, mac, 6);
 	else
 		memset(dest.sll_addr, 255, 6);
 	
-	rc = sendto(s, skb->data, skb->len, 0, (const struct sockaddr *)&dest, destlen);
+	rc = vlan_sendto(&conf.tstamp, s, conf.vlan, skb->data, skb->len, &dest);
 	if(rc == -1) {
 		return -1;
 	}
@@ -84,16 +180,16 @@ static int console_send(int s, int ifindex, struct sk_buff *skb)
 	return 0;
 }
 
+static int console_send(int s, int ifindex, struct sk_buff *skb)
+{
+	return console_send_to(s, ifindex, conf.ucast ? conf.dest.sll_addr : NULL, skb);
+}
+
 static int console_put(int s, int ifindex, struct sk_buff *skb)
 {
 	int rc;
-	uint8_t *p;
 
-	p = skb_push(skb, 4);
-	*p++ = EGETTY_IN;
-	*p++ = conf.console;
-	*p++ = skb->len >> 8;
-	*p = skb->len & 0xff;
+	proto_push(skb, conf.version, EGETTY_IN, conf.console, conf.session);
 	
 	rc = console_send(s, ifindex, skb);
 	if(rc == -1) {
@@ -103,39 +199,853 @@ static int console_put(int s, int ifindex, struct sk_buff *skb)
 	return 0;
 }
 
+/*
+ * Terminal output is collected in a ring buffer and written with writev()
+ * when it fills, when it has been held for out.delay ms, or when there is
+ * keyboard input to handle. fd 1 is non-blocking so a slow terminal never
+ * stalls the loop.
+ */
+static int out_init(unsigned int size)
+{
+	conf.out.buf = malloc(size);
+	if(!conf.out.buf) return -1;
+	conf.out.size = size;
+	conf.out.flags = fcntl(1, F_GETFL);
+	return fcntl(1, F_SETFL, conf.out.flags | O_NONBLOCK);
+}
+
+static unsigned int out_room(void)
+{
+	return conf.out.size - conf.out.len;
+}
+
+static int out_flush(void)
+{
+	struct iovec iov[3];
+	char note[64];
+	int iovcnt = 0, notelen = 0;
+	ssize_t n;
+	unsigned int first;
+
+	if(!conf.out.len) return 0;
+
+	if(conf.out.unreported) {
+		notelen = snprintf(note, sizeof(note), "\r\n[econsole: skipped %llu bytes]\r\n",
+				   conf.out.unreported);
+		iov[iovcnt].iov_base = note;
+		iov[iovcnt++].iov_len = notelen;
+	}
+	first = conf.out.size - conf.out.head;
+	if(first > conf.out.len) first = conf.out.len;
+	iov[iovcnt].iov_base = conf.out.buf + conf.out.head;
+	iov[iovcnt++].iov_len = first;
+	if(conf.out.len > first) {
+		iov[iovcnt].iov_base = conf.out.buf;
+		iov[iovcnt++].iov_len = conf.out.len - first;
+	}
+
+	n = writev(1, iov, iovcnt);
+	if(n == -1) {
+		if(errno == EAGAIN || errno == EINTR) return 0;
+		/* the terminal is gone, nothing will take the rest */
+		conf.out.len = 0;
+		conf.out.unreported = 0;
+		return -1;
+	}
+	if(notelen) {
+		/* a partly written note is not repeated */
+		conf.out.unreported = 0;
+		if(n < notelen) return 0;
+		n -= notelen;
+	}
+	if(conf.tstamp.enable && n)
+		tstamp_add(&conf.tstamp, TSTAMP_TERM, lowlat_now() - conf.out.first);
+	conf.out.head = (conf.out.head + n) % conf.out.size;
+	conf.out.len -= n;
+	if(conf.out.len)
+		conf.out.first = lowlat_now();
+	return n;
+}
+
+static void out_restore(void)
+{
+	if(conf.out.buf) {
+		/* blocking again, so what is buffered goes out before we exit */
+		fcntl(1, F_SETFL, conf.out.flags);
+		while(conf.out.len && out_flush() > 0);
+		if(conf.out.skipped)
+			fprintf(stderr, "%llu bytes of output skipped\n", conf.out.skipped);
+	}
+}
+
+/*
+ * Block until the terminal has taken enough to leave room for len bytes.
+ * What still does not fit, as when the terminal is gone, is reported as
+ * skipped.
+ */
+static void out_wait(unsigned int len)
+{
+	struct pollfd pfd;
+
+	if(len > conf.out.size)
+		len = conf.out.size;
+	while(out_room() < len) {
+		if(out_flush() == -1)
+			return;
+		if(out_room() >= len)
+			return;
+		pfd.fd = 1;
+		pfd.events = POLLOUT;
+		if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return;
+	}
+}
+
+static void out_put(const unsigned char *data, unsigned int len)
+{
+	unsigned int tail, n;
+
+	if(len > out_room()) {
+		unsigned int drop;
+
+		if(!conf.out.skip) {
+			/* tags may grow it past what the caller checked */
+			out_wait(len);
+		}
+		if(len > out_room()) {
+			if(len > conf.out.size) {
+				drop = len - conf.out.size;
+				data += drop;
+				len -= drop;
+				conf.out.skipped += drop;
+				conf.out.unreported += drop;
+			}
+			drop = len - out_room();
+			conf.out.head = (conf.out.head + drop) % conf.out.size;
+			conf.out.len -= drop;
+			conf.out.skipped += drop;
+			conf.out.unreported += drop;
+		}
+	}
+	if(!conf.out.len)
+		conf.out.first = lowlat_now();
+	while(len) {
+		tail = (conf.out.head + conf.out.len) % conf.out.size;
+		n = conf.out.size - tail;
+		if(n > len) n = len;
+		memcpy(conf.out.buf + tail, data, n);
+		conf.out.len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/* ms until buffered output is due */
+static int out_timeout(long long now)
+{
+	long long t = conf.out.first + conf.out.delay * 1000000LL;
+
+	if(t <= now)
+		return 0;
+	return (t - now + 999999) / 1000000;
+}
+
+/*
+ * Predictive echo. Printable keys are shown underlined at once and
+ * checked against the echo when it arrives. Keys are only shown after
+ * one key since the last Enter, control key or paste has been echoed as
+ * predicted, so nothing is drawn at a password prompt. Output that does
+ * not match, or no echo in time, erases what was drawn.
+ *
+ * Drawn keys are bracketed by save and restore cursor, which also puts
+ * back the attributes the remote set. There is only one save slot, so
+ * nothing is drawn once the remote has saved the cursor itself, or while
+ * it is on the alternate screen.
+ */
+static void predict_csi(char final)
+{
+	const char *p = conf.predict.csi;
+	int mode;
+
+	if(!conf.predict.csilen && final == 's')
+		conf.predict.saved = 1;
+	if(*p != '?' || (final != 'h' && final != 'l'))
+		return;
+	while(*p) {
+		mode = atoi(++p);
+		if(mode == 47 || mode == 1047 || mode == 1049)
+			conf.predict.alt = final == 'h';
+		if(mode == 1048 && final == 'h')
+			conf.predict.saved = 1;
+		p = strchr(p, ';');
+		if(!p)
+			break;
+	}
+}
+
+/* watch remote output for cursor saves and the alternate screen */
+static void predict_scan(const uint8_t *data, unsigned int len)
+{
+	unsigned int i;
+
+	for(i=0;i<len;i++) {
+		switch(conf.predict.esc) {
+		case 0:
+			if(data[i] == 0x1b)
+				conf.predict.esc = 1;
+			break;
+		case 1:
+			conf.predict.esc = 0;
+			if(data[i] == '7')
+				conf.predict.saved = 1;
+			if(data[i] == '[') {
+				conf.predict.esc = 2;
+				conf.predict.csilen = 0;
+				conf.predict.csi[0] = 0;
+			}
+			break;
+		case 2:
+			if(data[i] >= 0x40 && data[i] <= 0x7e) {
+				conf.predict.esc = 0;
+				predict_csi(data[i]);
+			} else if(conf.predict.csilen < sizeof(conf.predict.csi) - 1) {
+				conf.predict.csi[conf.predict.csilen++] = data[i];
+				conf.predict.csi[conf.predict.csilen] = 0;
+			}
+			break;
+		}
+	}
+}
+
+static void predict_clear(int erase)
+{
+	char seq[16];
+	int n;
+
+	if(conf.predict.drawn) {
+		out_put((const unsigned char *)"\0338", 2);
+		if(erase) {
+			n = snprintf(seq, sizeof(seq), "\033[%dX", conf.predict.drawn);
+			out_put((unsigned char *)seq, n);
+		}
+		conf.predict.misses++;
+	}
+	conf.predict.n = 0;
+	conf.predict.drawn = 0;
+	conf.predict.shown = 0;
+}
+
+static void predict_draw(void)
+{
+	if(!conf.predict.shown || conf.predict.drawn == conf.predict.n ||
+	   conf.predict.saved || conf.predict.alt)
+		return;
+	if(!conf.predict.drawn)
+		out_put((const unsigned char *)"\0337", 2);
+	out_put((const unsigned char *)"\033[4m", 4);
+	out_put(conf.predict.key + conf.predict.drawn, conf.predict.n - conf.predict.drawn);
+	out_put((const unsigned char *)"\033[24m", 5);
+	conf.predict.drawn = conf.predict.n;
+}
+
+/* keys sent to the remote */
+static void predict_key(const uint8_t *buf, int n, long long now)
+{
+	int i;
+
+	for(i=0;i<n;i++) {
+		if(buf[i] < 0x20 || buf[i] > 0x7e || conf.predict.barrier ||
+		   conf.predict.n == sizeof(conf.predict.key)) {
+			conf.predict.barrier = 1;
+			conf.predict.shown = 0;
+			break;
+		}
+		if(!conf.predict.n)
+			conf.predict.since = now;
+		conf.predict.key[conf.predict.n++] = buf[i];
+	}
+	predict_draw();
+}
+
+/* remote output in place of out_put() */
+static void predict_output(const uint8_t *data, unsigned int len)
+{
+	int m = 0;
+
+	predict_scan(data, len);
+	if(!conf.predict.n) {
+		conf.predict.barrier = 0;
+		out_put(data, len);
+		return;
+	}
+	while(m < len && m < conf.predict.n && data[m] == conf.predict.key[m])
+		m++;
+	if(m < len && m < conf.predict.n) {
+		predict_clear(1);
+		out_put(data, len);
+		return;
+	}
+	/* echo of the first m keys, maybe followed by other output */
+	if(conf.predict.drawn)
+		out_put((const unsigned char *)"\0338", 2);
+	out_put(data, len);
+	conf.predict.hits += m;
+	conf.predict.n -= m;
+	memmove(conf.predict.key, conf.predict.key + m, conf.predict.n);
+	conf.predict.drawn = 0;
+	conf.predict.shown = 1;
+	conf.predict.since = lowlat_now();
+	if(!conf.predict.n)
+		conf.predict.barrier = 0;
+	predict_draw();
+}
+
+/* ms until shown keys without echo are given up */
+static int predict_timeout(long long now)
+{
+	long long t = conf.predict.since + conf.predict.timeout * 1000000LL;
+
+	if(t <= now)
+		return 0;
+	return (t - now + 999999) / 1000000;
+}
+
+static void predict_stats(void)
+{
+	if(conf.debug && conf.predict.on)
+		fprintf(stderr, "predicted %llu keys, %llu misses\n",
+			conf.predict.hits, conf.predict.misses);
+}
+
+/*
+ * Cluster mode: one socket, many targets.
+ * Input goes to every selected target. Output is merged with each line
+ * tagged by the target it came from.
+ */
+/* send the bundle being built. A single message is sent as it is */
+static int cluster_flush(int s, int ifindex)
+{
+	int rc;
+
+	if(!conf.packcount)
+		return 0;
+	if(conf.packcount > 1)
+		proto_bundle_close(conf.packskb);
+	rc = console_send_to(s, ifindex, conf.packmac, conf.packskb);
+	skb_reset(conf.packskb);
+	skb_reserve(conf.packskb, PROTO_HDRMAX);
+	conf.packcount = 0;
+	return rc;
+}
+
+/*
+ * Send message in skb to sess. Messages for consoles behind the same MAC
+ * share a frame if the target takes bundles. cluster_flush() sends what
+ * is left.
+ */
+static int cluster_send(int s, int ifindex, struct session *sess, struct sk_buff *skb)
+{
+	int rc = 0;
+
+	if(!(sess->flags & PROTO_F_BUNDLE) || sess->version < PROTO_V2)
+		return console_send_to(s, ifindex, sess->mac, skb);
+	if(conf.packcount && memcmp(conf.packmac, sess->mac, 6))
+		rc = cluster_flush(s, ifindex);
+	if(proto_bundle_add(conf.packskb, skb->data, skb->len)) {
+		rc |= cluster_flush(s, ifindex);
+		if(proto_bundle_add(conf.packskb, skb->data, skb->len))
+			return rc | console_send_to(s, ifindex, sess->mac, skb);
+	}
+	memcpy(conf.packmac, sess->mac, 6);
+	conf.packcount++;
+	return rc;
+}
+
+static int cluster_put(int s, int ifindex, const uint8_t *data, unsigned int len)
+{
+	struct session *sess;
+	struct sk_buff *skb = conf.txskb;
+	int i, rc = 0;
+
+	for(i=0;i<conf.targets.count;i++) {
+		sess = conf.targets.list[i];
+		if(!sess->selected)
+			continue;
+		skb_reset(skb);
+		skb_reserve(skb, PROTO_HDRMAX);
+		memcpy(skb_put(skb, len), data, len);
+		proto_push(skb, sess->version, EGETTY_IN, sess->console, sess->sid);
+		if(cluster_send(s, ifindex, sess, skb))
+			rc = -1;
+	}
+	if(cluster_flush(s, ifindex))
+		rc = -1;
+	return rc;
+}
+
+static int cluster_ctrl(int s, int ifindex, int type, int row, int col)
+{
+	struct session *sess;
+	struct sk_buff *skb = conf.txskb;
+	int i;
+
+	for(i=0;i<conf.targets.count;i++) {
+		sess = conf.targets.list[i];
+		skb_reset(skb);
+		skb_reserve(skb, PROTO_HDRMAX);
+		if(type == EGETTY_WINCH)
+			proto_winch(skb, sess->version, sess->console, sess->sid, row, col);
+		else
+			proto_push(skb, sess->version, type, sess->console, sess->sid);
+		cluster_send(s, ifindex, sess, skb);
+	}
+	cluster_flush(s, ifindex);
+	return 0;
+}
+
+static void cluster_output(struct session *sess, const uint8_t *data, unsigned int len)
+{
+	char tag[48];
+	uint8_t *nl;
+	unsigned int n;
+	int i;
+
+	if(conf.last != sess) {
+		if(conf.last && !conf.last->bol)
+			out_put((const unsigned char *)"\r\n", 2);
+		conf.last = sess;
+		sess->bol = 1;
+	}
+	while(len) {
+		if(sess->bol) {
+			n = snprintf(tag, sizeof(tag), "\033[1m[%d ", sess->index);
+			for(i=0;i<6;i++)
+				n += snprintf(tag + n, sizeof(tag) - n, "%02x%s", sess->mac[i], i==5?"":":");
+			n += snprintf(tag + n, sizeof(tag) - n, "/%d]\033[0m ", sess->console);
+			out_put((unsigned char *)tag, n);
+			sess->bol = 0;
+		}
+		nl = memchr(data, '\n', len);
+		n = nl ? nl - data + 1 : len;
+		out_put(data, n);
+		if(nl) sess->bol = 1;
+		data += n;
+		len -= n;
+	}
+}
+
+static void cluster_list(void)
+{
+	struct session *sess;
+	int i, j;
+
+	for(i=0;i<conf.targets.count;i++) {
+		sess = conf.targets.list[i];
+		fprintf(stderr, "%c%d ", sess->selected ? '*' : ' ', sess->index);
+		for(j=0;j<6;j++)
+			fprintf(stderr, "%02x%s", sess->mac[j], j==5?"":":");
+		fprintf(stderr, "/%d\r\n", sess->console);
+	}
+}
+
+/*
+ * Commands after CTRL-]:
+ *  all | none | sel N[-M] ... | toggle N[-M] ... | list | quit
+ */
+static int cluster_command(char *line)
+{
+	char *tok, *save;
+	int i, a, b, set;
+
+	tok = strtok_r(line, " ", &save);
+	if(!tok) return 0;
+	if(!strcmp(tok, "q") || !strcmp(tok, "quit"))
+		return -1;
+	if(!strcmp(tok, "all") || !strcmp(tok, "none")) {
+		for(i=0;i<conf.targets.count;i++)
+			conf.targets.list[i]->selected = (*tok == 'a');
+		return 0;
+	}
+	if(!strcmp(tok, "list")) {
+		cluster_list();
+		return 0;
+	}
+	if(strcmp(tok, "sel") && strcmp(tok, "toggle")) {
+		fprintf(stderr, "commands: all none sel toggle list quit\r\n");
+		return 0;
+	}
+	set = (*tok == 's');
+	if(set)
+		for(i=0;i<conf.targets.count;i++)
+			conf.targets.list[i]->selected = 0;
+	while((tok = strtok_r(NULL, " ", &save))) {
+		a = b = atoi(tok);
+		if(strchr(tok, '-'))
+			b = atoi(strchr(tok, '-') + 1);
+		for(i=a;i<=b && i<conf.targets.count;i++) {
+			if(i < 0) continue;
+			if(set)
+				conf.targets.list[i]->selected = 1;
+			else
+				conf.targets.list[i]->selected ^= 1;
+		}
+	}
+	return 0;
+}
+
+/* local line editing for cluster commands */
+static int cluster_cmdinput(const uint8_t *buf, int n)
+{
+	int i;
+
+	for(i=0;i<n;i++) {
+		if(buf[i] == '\r' || buf[i] == '\n') {
+			fprintf(stderr, "\r\n");
+			conf.cmdline[conf.cmdlen] = 0;
+			conf.cmdmode = 0;
+			conf.cmdlen = 0;
+			return cluster_command(conf.cmdline);
+		}
+		if(buf[i] == 0x7f || buf[i] == 8) {
+			if(conf.cmdlen) {
+				conf.cmdlen--;
+				fprintf(stderr, "\b \b");
+			}
+			continue;
+		}
+		if(buf[i] == 0x1d || buf[i] == 3) {
+			fprintf(stderr, "\r\n");
+			conf.cmdmode = 0;
+			conf.cmdlen = 0;
+			return 0;
+		}
+		if(conf.cmdlen < sizeof(conf.cmdline) - 1 && isprint(buf[i])) {
+			conf.cmdline[conf.cmdlen++] = buf[i];
+			fputc(buf[i], stderr);
+		}
+	}
+	return 0;
+}
+
+static int input_send(int s, int ifindex, struct sk_buff *skb)
+{
+	if(conf.targets.count)
+		return cluster_put(s, ifindex, skb->data, skb->len);
+	return console_put(s, ifindex, skb);
+}
+
+/*
+ * Send pending paste data when the paste has paused or a frame is full,
+ * but never more than paste.window bytes per paste.interval so the
+ * remote pty input queue is not overrun.
+ */
+static int paste_send(long long now)
+{
+	struct sk_buff *skb = conf.paste.skb;
+
+	if(!skb->len) return 0;
+	
+	if(now >= conf.paste.refill) {
+		conf.paste.tokens = conf.paste.window;
+		conf.paste.refill = now + conf.paste.interval * 1000000LL;
+	}
+	if(skb_tailroom(skb) > 1 && (now - conf.paste.last) < conf.paste.gap * 1000LL)
+		return 0;
+	if(conf.paste.tokens < skb->len)
+		return 0;
+	conf.paste.tokens -= skb->len;
+	if(conf.debug) printf("paste %d bytes\n", skb->len);
+	input_send(conf.s, conf.ifindex, skb);
+	skb_reset(skb);
+	skb_reserve(skb, PROTO_HDRMAX);
+	return 1;
+}
+
+/* ms until paste_send() may have something to do */
+static int paste_timeout(long long now)
+{
+	long long t;
+
+	t = conf.paste.refill;
+	if(skb_tailroom(conf.paste.skb) > 1 && conf.paste.last + conf.paste.gap * 1000LL > now)
+		t = conf.paste.last + conf.paste.gap * 1000LL;
+	if(t <= now)
+		return 0;
+	return (t - now + 999999) / 1000000;
+}
+
+/* track bracketed paste markers in data read from the terminal */
+static void paste_bracket(const uint8_t *buf, int n)
+{
+	int i;
+
+	for(i=0;i+5<n;i++) {
+		if(buf[i] != 033 || buf[i+1] != '[' || buf[i+2] != '2' || buf[i+3] != '0' || buf[i+5] != '~')
+			continue;
+		if(buf[i+4] == '0') conf.paste.active = 1;
+		if(buf[i+4] == '1') conf.paste.active = 0;
+	}
+}
+
 static int console_winch(int s, int ifindex, int row, int col)
+{
+	int rc;
+	struct sk_buff *skb = alloc_skb(64);
+
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_winch(skb, conf.version, conf.console, conf.session, row, col);
+	
+	rc = console_send(s, ifindex, skb);
+	if(rc == -1) {
+		printf("sendto failed: %s\n", strerror(errno));
+		free_skb(skb);
+		return -1;
+	}
+	free_skb(skb);
+	return 0;
+}
+
+static int console_ping(int s, int ifindex, unsigned int seq)
+{
+	int rc;
+	struct lowlat_probe probe;
+	struct sk_buff *skb = alloc_skb(64);
+
+	probe.seq = seq;
+	probe.stamp = lowlat_now();
+
+	skb_reserve(skb, PROTO_HDRMAX);
+	memcpy(skb_put(skb, sizeof(probe)), &probe, sizeof(probe));
+	proto_push(skb, conf.version, EGETTY_PING, conf.console, conf.session);
+	
+	rc = console_send(s, ifindex, skb);
+	free_skb(skb);
+	if(rc == -1) {
+		printf("sendto failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Measure round trip to egetty with echo probes.
+ * The probes never touch the remote pty.
+ */
+static int ping_run(struct sk_buff *skb)
+{
+	struct sockaddr_ll from;
+	socklen_t fromlen = sizeof(from);
+	struct lowlat_probe probe;
+	struct proto_hdr h;
+	const uint8_t *msg;
+	unsigned int off, seq, received = 0;
+	long long rtt, min = -1, max = 0, sum = 0, deadline;
+	int n;
+
+	for(seq = 0; seq < conf.count; seq++) {
+		if(console_ping(conf.s, conf.ifindex, seq))
+			return -1;
+		deadline = lowlat_now() + 1000000000LL;
+		while(1) {
+			struct pollfd fds[1];
+			int timeout = (deadline - lowlat_now()) / 1000000;
+
+			if(timeout <= 0) {
+				printf("seq=%u timeout\n", seq);
+				break;
+			}
+			fds[0].fd = conf.s;
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			if(poll(fds, 1, timeout) <= 0)
+				continue;
+			if(fds[0].revents & POLLERR)
+				tstamp_errqueue(&conf.tstamp, conf.s);
+			if(!(fds[0].revents & POLLIN))
+				continue;
+
+			skb_reset(skb);
+			n = tstamp_recv(&conf.tstamp, conf.s, skb->data, skb_tailroom(skb), 0,
+					(struct sockaddr *)&from, &fromlen, NULL);
+			if(n < 0 || memcmp(conf.dest.sll_addr, from.sll_addr, 6))
+				continue;
+			off = 0;
+			while((msg = proto_next(skb->data, n, &off, &h)))
+				if(h.type == EGETTY_PONG && h.console == conf.console &&
+				   h.len - h.hlen >= sizeof(probe))
+					break;
+			if(!msg)
+				continue;
+			memcpy(&probe, msg + h.hlen, sizeof(probe));
+			if(probe.seq != seq)
+				continue;
+			rtt = lowlat_now() - probe.stamp;
+			if(conf.tstamp.enable)
+				tstamp_add(&conf.tstamp, TSTAMP_RTT, rtt);
+			printf("seq=%u rtt=%lld.%03lld us\n", seq, rtt / 1000, rtt % 1000);
+			if(min == -1 || rtt < min) min = rtt;
+			if(rtt > max) max = rtt;
+			sum += rtt;
+			received++;
+			break;
+		}
+		usleep(200000);
+	}
+	printf("%u sent, %u received", conf.count, received);
+	if(received)
+		printf(", rtt min/avg/max = %lld/%lld/%lld us",
+		       min / 1000, sum / received / 1000, max / 1000);
+	printf("\n");
+	return received ? 0 : 1;
+}
+
+/* print latency histograms of egetty */
+static int stats_run(struct sk_buff *skb)
+{
+	struct sockaddr_ll from;
+	socklen_t fromlen = sizeof(from);
+	struct proto_hdr h;
+	const uint8_t *msg;
+	unsigned int off;
+	long long deadline;
+	int n, timeout;
+
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_push(skb, conf.version, EGETTY_STATS, conf.console, conf.session);
+	if(console_send(conf.s, conf.ifindex, skb) == -1) {
+		printf("sendto failed: %s\n", strerror(errno));
+		return -1;
+	}
+	deadline = lowlat_now() + 1000000000LL;
+	while((timeout = (deadline - lowlat_now()) / 1000000) > 0) {
+		struct pollfd fds[1];
+
+		fds[0].fd = conf.s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		if(poll(fds, 1, timeout) <= 0)
+			continue;
+		if(fds[0].revents & POLLERR)
+			tstamp_errqueue(&conf.tstamp, conf.s);
+		if(!(fds[0].revents & POLLIN))
+			continue;
+		skb_reset(skb);
+		n = recvfrom(conf.s, skb->data, skb_tailroom(skb), 0, (struct sockaddr *)&from, &fromlen);
+		if(n < 0 || memcmp(conf.dest.sll_addr, from.sll_addr, 6))
+			continue;
+		off = 0;
+		while((msg = proto_next(skb->data, n, &off, &h))) {
+			if(h.type != EGETTY_STATS || h.console != conf.console)
+				continue;
+			fwrite(msg + h.hlen, 1, h.len - h.hlen, stdout);
+			return 0;
+		}
+	}
+	printf("no reply\n");
+	return 1;
+}
+
+/* our own latency histograms, at exit */
+static void console_tstats(void)
+{
+	char text[1024];
+
+	if(!conf.tstamp.enable)
+		return;
+	tstamp_format(&conf.tstamp, text, sizeof(text));
+	fprintf(stderr, "%s", text);
+}
+
+/* ask egetty for the last 'bytes' of console history */
+static int console_replay(int s, int ifindex, unsigned int bytes)
 {
 	int rc;
 	uint8_t *p;
 	struct sk_buff *skb = alloc_skb(64);
 
-	p = skb_put(skb, 0);
-	*p++ = EGETTY_WINCH;
-	*p++ = conf.console;
-	*p++ = row;
-	*p++ = col;
+	skb_reserve(skb, PROTO_HDRMAX);
 	p = skb_put(skb, 4);
+	*p++ = bytes >> 24;
+	*p++ = bytes >> 16;
+	*p++ = bytes >> 8;
+	*p = bytes & 0xff;
+	proto_push(skb, conf.version, EGETTY_REPLAY, conf.console, conf.session);
 	
 	rc = console_send(s, ifindex, skb);
+	free_skb(skb);
 	if(rc == -1) {
 		printf("sendto failed: %s\n", strerror(errno));
-		free_skb(skb);
 		return -1;
 	}
+	return 0;
+}
+
+/* ask egetty to restart compression of output to us, after a lost frame */
+static int console_lzreset(int s, int ifindex, const struct session *sess)
+{
+	int rc;
+	struct sk_buff *skb = alloc_skb(64);
+
+	skb_reserve(skb, PROTO_HDRMAX);
+	if(sess) {
+		proto_push(skb, sess->version, EGETTY_LZRESET, sess->console, sess->sid);
+		rc = console_send_to(s, ifindex, sess->mac, skb);
+	} else {
+		proto_push(skb, conf.version, EGETTY_LZRESET, conf.console, conf.session);
+		rc = console_send(s, ifindex, skb);
+	}
 	free_skb(skb);
+	return rc;
+}
+
+/* decoding cost of compressed output, in debug mode */
+static void console_lzstats(void)
+{
+	unsigned long long in = 0, out = 0, msgs = 0, ns = 0;
+	struct lz *z;
+	int i;
+
+	if(!conf.debug)
+		return;
+	for(i=-1;i<conf.targets.count;i++) {
+		z = i < 0 ? conf.lz : conf.targets.list[i]->lz;
+		if(!z)
+			continue;
+		in += z->in;
+		out += z->out;
+		msgs += z->msgs;
+		ns += z->ns;
+	}
+	if(msgs)
+		fprintf(stderr, "decompressed %llu messages: %llu -> %llu bytes (%llu%%), %llu us\n",
+			msgs, out, in, out * 100 / in, ns / 1000);
+}
+
+/* ask egetty for the whole screen, if it keeps a model of it */
+static int console_snapshot(int s, int ifindex)
+{
+	int rc;
+	struct sk_buff *skb = alloc_skb(64);
+
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_push(skb, conf.version, EGETTY_SNAPSHOT, conf.console, conf.session);
+
+	rc = console_send(s, ifindex, skb);
+	free_skb(skb);
+	if(rc == -1) {
+		printf("sendto failed: %s\n", strerror(errno));
+		return -1;
+	}
 	return 0;
 }
 
 static int console_hup(int s, int ifindex)
 {
 	int rc;
-	uint8_t *p;
 	struct sk_buff *skb = alloc_skb(64);
 
-	p = skb_put(skb, 0);
-	*p++ = EGETTY_HUP;
-	*p++ = conf.console;
-	p = skb_put(skb, 2);
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_push(skb, conf.version, EGETTY_HUP, conf.console, conf.session);
 	
 	rc = console_send(s, ifindex, skb);
 	if(rc == -1) {
@@ -155,10 +1065,30 @@ static void winch_handler(int sig)
 	{
 		conf.row = winp.ws_row;
 		conf.col = winp.ws_col;
-		console_winch(conf.s, conf.ifindex, conf.row, conf.col);
+		conf.winched = 1;
+		if(!conf.targets.count)
+			console_winch(conf.s, conf.ifindex, conf.row, conf.col);
 	}
 }
 
+static void rec_stop(void)
+{
+	unsigned long dropped = rec_close(conf.rec);
+	
+	conf.rec = NULL;
+	if(dropped)
+		fprintf(stderr, "recording dropped %lu events\n", dropped);
+}
+
+/* killed: leave the terminal as we found it, fd 1 is shared with the shell */
+static void term_handler(int sig)
+{
+	fcntl(1, F_SETFL, conf.out.flags);
+	tcsetattr(0, TCSANOW, &conf.term);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
 static int signals_init()
 {
 	static struct sigaction act;
@@ -169,6 +1099,11 @@ static int signals_init()
 	act.sa_handler = winch_handler;
 	act.sa_flags = 0;
 	rc |= sigaction(SIGWINCH, &act, NULL);
+	act.sa_handler = term_handler;
+	rc |= sigaction(SIGTERM, &act, NULL);
+	rc |= sigaction(SIGHUP, &act, NULL);
+	rc |= sigaction(SIGINT, &act, NULL);
+	rc |= sigaction(SIGQUIT, &act, NULL);
 
 	return rc;
 }
@@ -236,7 +1171,6 @@ static int set_flag(char *ifname, short flag)
 static int console_bcast(int s, int ifindex, struct sk_buff *skb)
 {
 	struct sockaddr_ll dest;
-	socklen_t destlen = sizeof(dest);
 
 	memset(&dest, 0, sizeof(dest));
 
@@ -246,21 +1180,30 @@ static int console_bcast(int s, int ifindex, struct sk_buff *skb)
 	dest.sll_ifindex = ifindex;
 	memset(dest.sll_addr, 255, 6);
 	
-	return sendto(s, skb->data, skb->len, 0, (const struct sockaddr *)&dest, destlen);
+	return vlan_sendto(&conf.tstamp, s, conf.vlan, skb->data, skb->len, &dest);
 }
 
-static int console_scan(int s, int ifindex, struct sk_buff *skb)
+/*
+ * Version 1 SCAN that all egettys answer, telling that we speak
+ * version 2. Broadcast unless 'mac' is given. Answers are spread
+ * over 'spread' ms.
+ */
+static int console_scan(int s, int ifindex, const unsigned char *mac, int spread)
 {
 	int rc;
-	uint8_t *p;
+	struct sk_buff *skb = alloc_skb(64);
 
-	p = skb_push(skb, 4);
-	*p++ = EGETTY_SCAN;
-	*p++ = conf.console;
-	*p++ = skb->len >> 8;
-	*p = skb->len & 0xff;
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_put_caps(skb, conf.console, 0);
+	if(spread)
+		proto_put_spread(skb, spread);
+	proto_push(skb, PROTO_V1, EGETTY_SCAN, conf.console, 0);
 	
-	rc = console_bcast(s, ifindex, skb);
+	if(mac)
+		rc = console_send_to(s, ifindex, mac, skb);
+	else
+		rc = console_bcast(s, ifindex, skb);
+	free_skb(skb);
 	if(rc == -1) {
 		fprintf(stderr, "sendto failed: %s\n", strerror(errno));
 		return -1;
@@ -269,41 +1212,522 @@ static int console_scan(int s, int ifindex, struct sk_buff *skb)
 }
 
 
+static int console_file(int s, int ifindex, struct sk_buff *skb)
+{
+	proto_push(skb, conf.version, EGETTY_FILE, conf.console, conf.session);
+	return console_send(s, ifindex, skb);
+}
+
+/*
+ * put: copy local file to remote path, get: copy remote path to local file.
+ * Remote paths are relative to the directory given to egetty with xfer=.
+ */
+static int file_run(int s, int ifindex)
+{
+	struct xfer x;
+	struct xfer_msg m;
+	struct proto_hdr h;
+	const uint8_t *msg;
+	unsigned int off;
+	struct sockaddr_ll from;
+	socklen_t fromlen;
+	struct sk_buff *tx = alloc_skb(1600), *rx = alloc_skb(1600);
+	struct stat st;
+	uint32_t id;
+	long long now, start, lastreq = 0;
+	int fd, n, tries = 0, opened = 0;
+	uint64_t size = 0;
+
+	fd = open(conf.local, conf.put ? O_RDONLY : O_RDWR|O_CREAT|(conf.resume ? 0 : O_TRUNC), 0644);
+	if(fd == -1 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s\n", conf.local, strerror(errno));
+		return 1;
+	}
+	xfer_socket(s);
+	id = (getpid() << 16) ^ lowlat_now();
+	start = lowlat_now();
+	memset(&x, 0, sizeof(x));
+	
+	while(!opened || x.state != XFER_S_DONE) {
+		struct pollfd fds[1];
+
+		now = lowlat_now() / 1000000;
+		if(!opened && now - lastreq >= 500) {
+			if(tries++ == 10) {
+				fprintf(stderr, "no answer from egetty\n");
+				return 1;
+			}
+			lastreq = now;
+			/* egetty only takes transfers from the attached client */
+			skb_reset(tx);
+			skb_reserve(tx, PROTO_HDRMAX);
+			console_put(s, ifindex, tx);
+			skb_reset(tx);
+			skb_reserve(tx, PROTO_HDRMAX + XFER_HDR);
+			memcpy(skb_put(tx, strlen(conf.remote)), conf.remote, strlen(conf.remote));
+			if(conf.put)
+				xfer_push(tx, XFER_PUT, conf.resume ? XFER_RESUME : 0, id, st.st_size);
+			else
+				xfer_push(tx, XFER_GET, 0, id, conf.resume ? st.st_size : 0);
+			console_file(s, ifindex, tx);
+		}
+		if(opened && xfer_expired(&x, now))
+			break;
+		if(opened) {
+			while(1) {
+				skb_reset(tx);
+				skb_reserve(tx, PROTO_HDRMAX + XFER_HDR);
+				if(!xfer_next(&x, tx, now))
+					break;
+				if(console_file(s, ifindex, tx)) {
+					/* device queue full, send this frame again later */
+					if(!proto_parse(tx->data, tx->len, &h) &&
+				   !xfer_parse(tx->data + h.hlen, tx->len - h.hlen, &m) && m.op == XFER_DATA)
+						x.next = m.off;
+					break;
+				}
+			}
+		}
+
+		fds[0].fd = s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		if(poll(fds, 1, XFER_RTO / 4) <= 0)
+			continue;
+
+		while(1) {
+			skb_reset(rx);
+			fromlen = sizeof(from);
+			n = recvfrom(s, rx->data, skb_tailroom(rx), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+			if(n == -1)
+				break;
+			if(memcmp(conf.dest.sll_addr, from.sll_addr, 6))
+				continue;
+			off = 0;
+			while((msg = proto_next(rx->data, n, &off, &h))) {
+				if(h.type != EGETTY_FILE || h.console != conf.console)
+					continue;
+				if(xfer_parse(msg + h.hlen, h.len - h.hlen, &m) || m.id != id)
+					continue;
+				now = lowlat_now() / 1000000;
+				if(m.op == XFER_OPEN && !opened) {
+					opened = 1;
+					if(conf.put) {
+						xfer_init(&x, fd, 1, id, st.st_size, m.off);
+					} else {
+						size = !conf.resume ? 0 : st.st_size < m.off ? st.st_size : m.off;
+						if(ftruncate(fd, size)) {
+							fprintf(stderr, "%s: %s\n", conf.local, strerror(errno));
+							return 1;
+						}
+						xfer_init(&x, fd, 0, id, m.off, size);
+					}
+					if(conf.window) x.window = conf.window;
+					size = x.base;
+					start = lowlat_now();
+					continue;
+				}
+				if(m.op == XFER_ERR && !opened) {
+					fprintf(stderr, "%s: %s\n", conf.remote, strerror(m.len >= 4 ? (m.data[2] << 8) + m.data[3] : EIO));
+					return 1;
+				}
+				if(!opened)
+					continue;
+				skb_reset(tx);
+				skb_reserve(tx, PROTO_HDRMAX + XFER_HDR);
+				if(xfer_input(&x, &m, tx, now))
+					console_file(s, ifindex, tx);
+			}
+		}
+	}
+	if(!conf.put)
+		fsync(fd);
+	close(fd);
+	
+	now = lowlat_now() - start;
+	size = x.size - size;
+	fprintf(stderr, "%llu bytes in %lld.%03lld s, %.1f MB/s, %llu frames resent\n",
+		(unsigned long long)size, now / 1000000000, (now / 1000000) % 1000,
+		now ? (double)size * 1000 / now : 0.0, x.resent);
+	if(x.status) {
+		fprintf(stderr, "transfer failed: %s\n", x.status == 1 ? "checksum mismatch" : strerror(x.status));
+		return 1;
+	}
+	return 0;
+}
+
+/* ask the egettys we talk to which protocol version they speak */
+static void targets_probe(int s, int ifindex)
+{
+	int i, j;
+
+	if(!conf.targets.count && conf.ucast)
+		console_scan(s, ifindex, conf.dest.sll_addr, 0);
+	for(i=0;i<conf.targets.count;i++) {
+		/* every egetty behind a MAC answers, one scan will do */
+		for(j=0;j<i;j++)
+			if(!memcmp(conf.targets.list[j]->mac, conf.targets.list[i]->mac, 6))
+				break;
+		if(j == i)
+			console_scan(s, ifindex, conf.targets.list[i]->mac, 0);
+	}
+}
+
+/*
+ * Scan with targets given: probe the ones that have not answered
+ * directly, a few times. Returns ms to the next round, -1 when done.
+ */
+static int scan_reprobe(int s, int ifindex, long long now)
+{
+	struct session *sess;
+	int i, j, silent = 0;
+
+	if(conf.probe.rounds < 0 || !conf.targets.count)
+		return -1;
+	if(now < conf.probe.next)
+		return (conf.probe.next - now) / 1000000 + 1;
+	for(i=0;i<conf.targets.count;i++) {
+		sess = conf.targets.list[i];
+		if(session_find(&conf.probe.seen, sess->mac, sess->console))
+			continue;
+		silent++;
+		if(!conf.probe.rounds) {
+			fprintf(stderr, "No answer: %u %02x:%02x:%02x:%02x:%02x:%02x\n", sess->console,
+				sess->mac[0], sess->mac[1], sess->mac[2], sess->mac[3], sess->mac[4], sess->mac[5]);
+			continue;
+		}
+		/* silent consoles behind one MAC share the probe */
+		for(j=0;j<i;j++)
+			if(!memcmp(conf.targets.list[j]->mac, sess->mac, 6) &&
+			   !session_find(&conf.probe.seen, sess->mac, conf.targets.list[j]->console))
+				break;
+		if(j == i)
+			console_scan(s, ifindex, sess->mac, 0);
+	}
+	if(!silent || !conf.probe.rounds) {
+		conf.probe.rounds = -1;
+		return -1;
+	}
+	conf.probe.rounds--;
+	conf.probe.next = now + SCAN_PROBE_WAIT * 1000000LL;
+	return SCAN_PROBE_WAIT;
+}
+
+/* collect every console that answers a scan within 'ms' as a target */
+static int scan_targets(int s, int ifindex, int ms)
+{
+	struct sockaddr_ll from;
+	socklen_t fromlen;
+	unsigned char frame[1600];
+	struct proto_hdr h;
+	unsigned int console;
+	uint32_t sid;
+	long long deadline;
+	int n, timeout;
+
+	console_scan(s, ifindex, NULL, conf.spread < ms / 2 ? conf.spread : ms / 2);
+	
+	deadline = lowlat_now() + ms * 1000000LL;
+	while((timeout = (deadline - lowlat_now()) / 1000000) > 0) {
+		struct pollfd fds[1];
+
+		fds[0].fd = s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		if(poll(fds, 1, timeout) <= 0)
+			continue;
+		fromlen = sizeof(from);
+		n = recvfrom(s, frame, sizeof(frame), 0, (struct sockaddr *)&from, &fromlen);
+		if(n < 0 || proto_parse(frame, n, &h) || h.type != EGETTY_HELLO)
+			continue;
+		proto_caps(&h, frame + h.hlen, &console, &sid, NULL);
+		if(session_add(&conf.targets, from.sll_addr, console))
+			session_hello(&conf.targets, from.sll_addr, &h, frame + h.hlen);
+	}
+	return conf.targets.count;
+}
+
+/*
+ * egetty with several interfaces announces itself on another one when
+ * its link to us dies. Follow it there if it is our console and session.
+ */
+static int console_moved(const struct sockaddr_ll *from, const uint8_t *frame, unsigned int n)
+{
+	struct proto_hdr h;
+	const uint8_t *msg;
+	unsigned int off = 0, console;
+	uint32_t sid;
+
+	if(!conf.session)
+		return 0;
+	while((msg = proto_next(frame, n, &off, &h))) {
+		if(h.type != EGETTY_HELLO)
+			continue;
+		proto_caps(&h, msg + h.hlen, &console, &sid, NULL);
+		if(console != conf.console || sid != conf.session)
+			continue;
+		if(conf.debug)
+			printf("console moved\n");
+		memcpy(conf.dest.sll_addr, from->sll_addr, 6);
+		return 1;
+	}
+	return 0;
+}
+
+/* handle one message from the network */
+static void console_input(const struct sockaddr_ll *from, const struct proto_hdr *h,
+			  const uint8_t *data, unsigned int len)
+{
+	struct session *sess;
+	int i, n;
+
+	if(h->type == EGETTY_HELLO) {
+		unsigned int console;
+		uint32_t sid;
+		int version;
+
+		version = proto_caps(h, data, &console, &sid, NULL);
+		if(conf.scan) {
+			/* re-probes make consoles answer more than once */
+			if(session_find(&conf.probe.seen, from->sll_addr, console))
+				return;
+			session_add(&conf.probe.seen, from->sll_addr, console);
+			printf("Console: %u ", console);
+			for(i=0;i<6;i++)
+				printf("%02x%s", from->sll_addr[i], i==5?"":":");
+			printf("\n");
+		} else if(conf.targets.count) {
+			sess = session_find(&conf.targets, from->sll_addr, console);
+			i = sess && sess->version != proto_version(version, console);
+			session_hello(&conf.targets, from->sll_addr, h, data);
+			/* window size may not have fit in version 1 */
+			if(i)
+				cluster_ctrl(conf.s, conf.ifindex, EGETTY_WINCH, conf.row, conf.col);
+		} else if(conf.ucast && console == conf.console) {
+			conf.session = sid;
+			if(conf.version != version) {
+				conf.version = proto_version(version, conf.console);
+				console_winch(conf.s, conf.ifindex, conf.row, conf.col);
+			}
+		}
+		return;
+	}
+	if(h->type != EGETTY_OUT && h->type != EGETTY_KMSG)
+		return;
+	if(conf.targets.count) {
+		sess = session_find(&conf.targets, from->sll_addr, h->console);
+		if(!sess) return;
+		if(h->version >= PROTO_V2) {
+			sess->version = h->version;
+			sess->flags = h->flags;
+			sess->sid = h->session;
+		}
+		n = lz_output(&sess->lz, h->flags & PROTO_F_LZ, &data, &len);
+		if(n == -1)
+			console_lzreset(conf.s, conf.ifindex, sess);
+		if(n < 0)
+			return;
+		rec_event(conf.rec, 'o', data, len);
+		cluster_output(sess, data, len);
+		return;
+	}
+	if(h->console != conf.console) return;
+	if(h->version >= PROTO_V2) {
+		conf.version = h->version;
+		conf.session = h->session;
+	}
+	n = lz_output(&conf.lz, h->flags & PROTO_F_LZ, &data, &len);
+	if(n == -1)
+		console_lzreset(conf.s, conf.ifindex, NULL);
+	if(n < 0)
+		return;
+	if(!conf.scan) {
+		if(conf.keytime) {
+			tstamp_add(&conf.tstamp, TSTAMP_ECHO, lowlat_now() - conf.keytime);
+			conf.keytime = 0;
+		}
+		rec_event(conf.rec, 'o', data, len);
+		if(conf.predict.on)
+			predict_output(data, len);
+		else
+			out_put(data, len);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct sockaddr_ll from;
 	socklen_t fromlen = sizeof(from);
 	char *device = "eth0", *ps;
-	uint8_t *buf, *p;
-	int n, i, err=0;
-	unsigned int len;
+	uint8_t *buf;
+	int n, i, err=0, outsize;
 	struct sk_buff *skb;
 
 	conf.ifindex=-1;
 	conf.debug = 0;
+	conf.version = PROTO_V1;
+	conf.count = 10;
+	conf.paste.gap = 5000;
+	conf.paste.window = 4096;
+	conf.paste.interval = 10;
+	conf.out.delay = 2;
+	conf.out.size = 65536;
+	lowlat_init(&conf.lowlat);
 
 	if(jelopt(argv, 'h', "help", NULL, &err)) {
-		printf("econsole [DEV] [CONSOLE] [DESTMAC] [(scan|debug)]\n"); 
+		printf("econsole [DEV] [CONSOLE] [DESTMAC] [(scan|ping|stats|debug)]\n"
+		       " -t --target=MAC[/CONSOLE]  attach to several consoles (repeat)\n"
+		       " -T --targets=FILE          read targets from file (or scan output)\n"
+		       " -b --batch=SCRIPT          run send/expect script on all targets\n"
+		       "    --scan-time=MS          batch without targets: scan this long [1000]\n"
+		       "    --scan-spread=MS        egettys spread scan answers over this time [500]\n"
+		       "    --collect=DIR           passively log all console traffic per source\n"
+		       " -i --interface=DEV         collect on this interface too (repeat)\n"
+		       "    --promisc               collect in promiscuous mode\n"
+		       " put LOCAL REMOTE           copy file to egetty host\n"
+		       " get REMOTE LOCAL           copy file from egetty host\n"
+		       "    --resume                continue a partial put/get\n"
+		       "    --window=FRAMES         frames in flight [128]\n"
+		       " -l --lowlat         qdisc bypass and busy polling\n"
+		       "    --busypoll=USEC  busy poll budget [50]\n"
+		       "    --prio=N         SCHED_FIFO priority\n"
+		       "    --cpu=N          pin to cpu\n"
+		       " -c --count=N        number of echo probes for ping [10]\n"
+		       "    --paste-gap=USEC       input closer than this is a paste [5000]\n"
+		       "    --paste-window=BYTES   paste bytes sent per interval [4096]\n"
+		       "    --paste-interval=MS    paste pacing interval [10]\n"
+		       "    --out-delay=MS         max time output is buffered [2]\n"
+		       "    --out-buffer=BYTES     output buffer size [65536]\n"
+		       "    --skip                 skip ahead when the terminal falls behind\n"
+		       "    --replay=BYTES         show console history kept by egetty\n"
+		       "    --record=FILE          record session in asciicast format\n"
+		       "    --record-size=BYTES    start a new recording file at this size\n"
+		       "    --no-compress          do not accept compressed output\n"
+		       "    --timestamp            kernel packet stamps and latency histograms\n"
+		       "    --hw-timestamp         as --timestamp, with NIC hardware stamps\n"
+		       "    --predict              show typed keys before the echo arrives\n"
+		       "    --predict-timeout=MS   give up keys not echoed in this time [1000]\n"
+		       "    --vlan=ID              reach consoles on VLAN ID of trunk DEV\n"
+			); 
 		exit(0);
 	}
+	if(jelopt(argv, 'l', "lowlat", NULL, &err))
+		conf.lowlat.enable = 1;
+	if(jelopt_int(argv, 0, "busypoll", &conf.lowlat.busypoll, &err))
+		conf.lowlat.enable = 1;
+	if(jelopt_int(argv, 0, "prio", &conf.lowlat.prio, &err))
+		conf.lowlat.enable = 1;
+	if(jelopt_int(argv, 0, "cpu", &conf.lowlat.cpu, &err))
+		conf.lowlat.enable = 1;
+	jelopt_int(argv, 'c', "count", &conf.count, &err);
+	jelopt(argv, 'b', "batch", &conf.batch, &err);
+	jelopt(argv, 0, "collect", &conf.collect, &err);
+	while(conf.nifaces < 63 && jelopt(argv, 'i', "interface", &conf.ifaces[conf.nifaces], &err))
+		conf.nifaces++;
+	if(jelopt(argv, 0, "promisc", NULL, &err))
+		conf.promisc = 1;
+	if(jelopt(argv, 0, "resume", NULL, &err))
+		conf.resume = 1;
+	jelopt_int(argv, 0, "window", &conf.window, &err);
+	jelopt_int(argv, 0, "vlan", &conf.vlan, &err);
+	if(conf.vlan < 0 || conf.vlan > VLAN_MAX) {
+		fprintf(stderr, "bad vlan %d\n", conf.vlan);
+		exit(2);
+	}
+	conf.scantime = 1000;
+	jelopt_int(argv, 0, "scan-time", &conf.scantime, &err);
+	session_table_init(&conf.targets, 1024);
+	session_table_init(&conf.probe.seen, 1024);
+	conf.spread = 500;
+	jelopt_int(argv, 0, "scan-spread", &conf.spread, &err);
+	{
+		char *target;
+		unsigned char mac[6];
+		int c;
+		
+		while(jelopt(argv, 't', "target", &target, &err)) {
+			c = 0;
+			if(session_parse(target, mac, &c) || !session_add(&conf.targets, mac, c)) {
+				fprintf(stderr, "bad target %s\n", target);
+				exit(2);
+			}
+			free(target);
+		}
+		if(jelopt(argv, 'T', "targets", &target, &err)) {
+			if(session_load(&conf.targets, target, 0) < 0) {
+				fprintf(stderr, "%s: %s\n", target, strerror(errno));
+				exit(2);
+			}
+			free(target);
+		}
+	}
+	jelopt_int(argv, 0, "paste-gap", &conf.paste.gap, &err);
+	jelopt_int(argv, 0, "paste-window", &conf.paste.window, &err);
+	jelopt_int(argv, 0, "paste-interval", &conf.paste.interval, &err);
+	jelopt_int(argv, 0, "out-delay", &conf.out.delay, &err);
+	if(jelopt_int(argv, 0, "out-buffer", &outsize, &err))
+		conf.out.size = outsize < 4096 ? 4096 : outsize;
+	jelopt_int(argv, 0, "replay", &conf.replay, &err);
+	jelopt(argv, 0, "record", &conf.record, &err);
+	jelopt_int(argv, 0, "record-size", &conf.recordsize, &err);
+	if(jelopt(argv, 0, "skip", NULL, &err))
+		conf.out.skip = 1;
+	proto_flags |= PROTO_F_LZ;
+	if(jelopt(argv, 0, "no-compress", NULL, &err))
+		proto_flags &= ~PROTO_F_LZ;
+	if(jelopt(argv, 0, "timestamp", NULL, &err))
+		conf.tstamp.enable = 1;
+	if(jelopt(argv, 0, "hw-timestamp", NULL, &err))
+		conf.tstamp.enable = conf.tstamp.hw = 1;
+	if(jelopt(argv, 0, "predict", NULL, &err))
+		conf.predict.on = 1;
+	conf.predict.timeout = 1000;
+	jelopt_int(argv, 0, "predict-timeout", &conf.predict.timeout, &err);
+	if(conf.paste.window < 1500)
+		conf.paste.window = 1500;
 	argc = jelopt_final(argv, &err);
 	if(err) {
 		printf("Syntax error in arguments.\n");
 		exit(2);
 	}
 
+	/* put/get take two paths, remove them before looking at the rest */
+	for(i=1;i<argc;i++) {
+		if(strcmp(argv[i], "put") && strcmp(argv[i], "get"))
+			continue;
+		if(i + 2 >= argc) {
+			printf("%s needs two paths\n", argv[i]);
+			exit(2);
+		}
+		conf.put = (argv[i][0] == 'p');
+		conf.get = !conf.put;
+		conf.local = argv[conf.put ? i+1 : i+2];
+		conf.remote = argv[conf.put ? i+2 : i+1];
+		memmove(&argv[i], &argv[i+3], (argc - i - 2) * sizeof(char *));
+		argc -= 3;
+		break;
+	}
+
 	while(--argc > 0) {
 		if(strcmp(argv[argc], "scan")==0) {
 			printf("Scanning for econsoles\n");
 			conf.scan = 1;
 			continue;
 		}
+		if(strcmp(argv[argc], "ping")==0) {
+			conf.ping = 1;
+			continue;
+		}
+		if(strcmp(argv[argc], "stats")==0) {
+			conf.stats = 1;
+			continue;
+		}
 		if(strcmp(argv[argc], "debug")==0) {
 			printf("Debug mode\n");
 			conf.debug++;
 			continue;
 		}
-		if( (strlen(argv[argc]) < 3) && isdigit(*argv[argc])) {
+		if( (strlen(argv[argc]) < 6) && isdigit(*argv[argc])) {
 			conf.console = atoi(argv[argc]);
 			continue;
 		}
@@ -323,6 +1747,18 @@ int main(int argc, char **argv)
 			device = argv[argc];
 		}
 	}
+
+	if(conf.console > 65535) {
+		printf("console number too large\n");
+		exit(2);
+	}
+	conf.version = proto_version(conf.version, conf.console);
+
+	if(conf.collect) {
+		if(!conf.nifaces)
+			conf.ifaces[conf.nifaces++] = device;
+		exit(collect_run(conf.collect, conf.ifaces, conf.nifaces, conf.promisc));
+	}
 	
 	conf.devsocket = devsocket();
 	
@@ -341,7 +1777,8 @@ int main(int argc, char **argv)
 		}
 	}
 
-	conf.s = socket(PF_PACKET, SOCK_DGRAM, htons(ETH_P_EGETTY));
+	/* on a trunk tagged frames only reach ETH_P_ALL sockets */
+	conf.s = socket(PF_PACKET, SOCK_DGRAM, htons(conf.vlan ? ETH_P_ALL : ETH_P_EGETTY));
 	if(conf.s == -1)
 	{
 		fprintf(stderr, "socket(): %s\n", strerror(errno));
@@ -355,7 +1792,7 @@ int main(int argc, char **argv)
 		memset(&addr, 0, sizeof(addr));
 		
 		addr.sll_family = AF_PACKET;
-		addr.sll_protocol = htons(ETH_P_EGETTY);
+		addr.sll_protocol = htons(conf.vlan ? ETH_P_ALL : ETH_P_EGETTY);
 		addr.sll_ifindex = conf.ifindex;
 		
 		if(bind(conf.s, (const struct sockaddr *)&addr, sizeof(addr)))
@@ -364,42 +1801,174 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 	}
+	if(conf.vlan && vlan_socket(conf.s, &conf.vlan, 1)) {
+		fprintf(stderr, "vlan: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	lowlat_socket(conf.s, &conf.lowlat);
+	lowlat_process(&conf.lowlat);
+
+	if(conf.put || conf.get) {
+		if(!conf.ucast) {
+			fprintf(stderr, "%s needs a destination MAC\n", conf.put ? "put" : "get");
+			exit(2);
+		}
+		exit(file_run(conf.s, conf.ifindex));
+	}
+
+	if(conf.batch) {
+		struct batch_script *script = batch_load(conf.batch);
+
+		if(!script) {
+			fprintf(stderr, "%s: cannot load script\n", conf.batch);
+			exit(2);
+		}
+		if(!conf.targets.count)
+			scan_targets(conf.s, conf.ifindex, conf.scantime);
+		else
+			targets_probe(conf.s, conf.ifindex);
+		if(!conf.targets.count) {
+			fprintf(stderr, "no targets\n");
+			exit(1);
+		}
+		exit(batch_run(conf.s, conf.ifindex, conf.vlan, &conf.targets, script) ? 1 : 0);
+	}
+
+	/* after the modes that do not read the error queue */
+	tstamp_socket(&conf.tstamp, conf.s, device);
+	atexit(console_tstats);
+
+	if(conf.ping) {
+		if(!conf.ucast) {
+			fprintf(stderr, "ping needs a destination MAC\n");
+			exit(2);
+		}
+		skb = alloc_skb(1500);
+		exit(ping_run(skb));
+	}
+
+	if(conf.stats) {
+		if(!conf.ucast) {
+			fprintf(stderr, "stats needs a destination MAC\n");
+			exit(2);
+		}
+		skb = alloc_skb(1500);
+		exit(stats_run(skb));
+	}
 
 	if(!conf.scan) {
+		if(out_init(conf.out.size)) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		atexit(out_restore);
+		atexit(console_lzstats);
+		atexit(predict_stats);
 		terminal_settings();
 		signals_init();
 		winch_handler(0);
-		fprintf(stderr, "Use CTRL-] to close connection.\n");
+		if(conf.record) {
+			conf.rec = rec_open(conf.record, conf.recordsize, conf.col, conf.row);
+			if(!conf.rec) {
+				fprintf(stderr, "record %s: %s\n", conf.record, strerror(errno));
+				exit(1);
+			}
+			atexit(rec_stop);
+			conf.winched = 0;
+		}
+		if(conf.targets.count) {
+			conf.txskb = alloc_skb(1500);
+			conf.packskb = alloc_skb(1500);
+			skb_reserve(conf.packskb, PROTO_HDRMAX);
+			fprintf(stderr, "%d targets. Use CTRL-] for commands.\r\n", conf.targets.count);
+		} else
+			fprintf(stderr, "Use CTRL-] to close connection.\n");
+		if(conf.replay)
+			console_replay(conf.s, conf.ifindex, conf.replay);
+		else if(!conf.targets.count)
+			console_snapshot(conf.s, conf.ifindex);
 	}
 
 	skb = alloc_skb(1500);
+	conf.paste.skb = alloc_skb(1500);
+	skb_reserve(conf.paste.skb, PROTO_HDRMAX);
 
-	if(conf.scan)
-		console_scan(conf.s, conf.ifindex, skb);
+	if(conf.scan) {
+		console_scan(conf.s, conf.ifindex, NULL, conf.spread);
+		/* silent targets are probed after the spread window */
+		conf.probe.rounds = SCAN_PROBES;
+		conf.probe.next = lowlat_now() + (conf.spread + SCAN_PROBE_WAIT) * 1000000LL;
+	} else
+		targets_probe(conf.s, conf.ifindex);
 
 	while(1)
 	{
-		struct pollfd fds[2];
+		struct pollfd fds[3];
+		int timeout = -1, t;
+		long long now = lowlat_now();
+
+		if(conf.winched) {
+			conf.winched = 0;
+			rec_resize(conf.rec, conf.col, conf.row);
+			if(conf.targets.count)
+				cluster_ctrl(conf.s, conf.ifindex, EGETTY_WINCH, conf.row, conf.col);
+		}
+		if(conf.scan && (t = scan_reprobe(conf.s, conf.ifindex, now)) >= 0)
+			timeout = t;
+		if(conf.paste.skb->len) {
+			paste_send(now);
+			if(conf.paste.skb->len)
+				timeout = paste_timeout(now);
+		}
+		if(conf.predict.drawn) {
+			if(!predict_timeout(now))
+				predict_clear(1);
+			else if(timeout == -1 || predict_timeout(now) < timeout)
+				timeout = predict_timeout(now);
+		}
+		if(conf.out.len) {
+			if(conf.out.len >= conf.out.size / 2 || !out_timeout(now))
+				out_flush();
+			if(conf.out.len && (timeout == -1 || out_timeout(now) < timeout))
+				timeout = out_timeout(now);
+		}
 
-		fds[0].fd = 0;
+		/* paste buffer full: leave input in the tty until it is sent */
+		fds[0].fd = skb_tailroom(conf.paste.skb) > 1 ? 0 : -1;
 		fds[0].events = POLLIN;
 		fds[0].revents = 0;
 		
-		fds[1].fd = conf.s;
+		/* unless skipping ahead, wait for the terminal to catch up */
+		fds[1].fd = (conf.out.skip || out_room() >= 4096) ? conf.s : -1;
 		fds[1].events = POLLIN;
 		fds[1].revents = 0;
 
-		n = poll(fds, 2, -1);
+		fds[2].fd = conf.out.len ? 1 : -1;
+		fds[2].events = POLLOUT;
+		fds[2].revents = 0;
+
+		n = poll(fds, 3, timeout);
 		if(n == 0) {
-			printf("timeout\n");
 			continue;
 		}
 
+		if(fds[2].revents & (POLLOUT|POLLERR|POLLHUP)) {
+			if(out_flush() == -1) {
+				fprintf(stderr, "write: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+
 		if(fds[0].revents & POLLIN) {
-			skb_reset(skb);
-			skb_reserve(skb, 4);
-			buf = skb_put(skb, 0);
-			n = read(0, buf, skb_tailroom(skb));
+			struct sk_buff *pskb = conf.paste.skb;
+			int pending = pskb->len;
+
+			/* show what we have before handling the keypress */
+			out_flush();
+
+			buf = skb_put(pskb, 0);
+			n = read(0, buf, skb_tailroom(pskb) - 1);
 			if(n == -1) {
 				fprintf(stderr, "read() failed\n");
 				exit(1);
@@ -411,50 +1980,79 @@ int main(int argc, char **argv)
 			buf[n] = 0;
 			if(conf.debug) printf("read %d bytes from stdin\n", n);
 			if(conf.debug > 1) printf("buf[0] == %d\n", buf[0]);
-			if(n==1 && buf[0] == 0x1d) {
+			if(conf.cmdmode) {
+				if(cluster_cmdinput(buf, n)) {
+					cluster_ctrl(conf.s, conf.ifindex, EGETTY_HUP, 0, 0);
+					tcsetattr(0, TCSANOW, &conf.term);
+					exit(0);
+				}
+				continue;
+			}
+			if(n==1 && !pending && buf[0] == 0x1d) {
+				if(conf.targets.count) {
+					conf.cmdmode = 1;
+					fprintf(stderr, "\r\necluster> ");
+					continue;
+				}
 				console_hup(conf.s, conf.ifindex);
 				tcsetattr(0, TCSANOW, &conf.term);
 				exit(0);
 			}
-			skb_put(skb, n);
-			if(!conf.scan) console_put(conf.s, conf.ifindex, skb);
+			skb_put(pskb, n);
+			rec_event(conf.rec, 'i', buf, n);
+
+			/*
+			 * Keystrokes go out at once. Anything that looks like
+			 * a paste is left for paste_send() to coalesce into
+			 * full frames.
+			 */
+			now = lowlat_now();
+			paste_bracket(buf, n);
+			if(conf.scan) {
+				skb_trim(pskb, 0);
+			} else if(!pending && n <= 8 && !conf.paste.active &&
+				  (now - conf.paste.last) >= conf.paste.gap * 1000LL) {
+				input_send(conf.s, conf.ifindex, pskb);
+				skb_reset(pskb);
+				skb_reserve(pskb, PROTO_HDRMAX);
+				if(conf.tstamp.enable && !conf.keytime)
+					conf.keytime = now;
+				if(conf.predict.on && !conf.targets.count) {
+					predict_key(buf, n, now);
+					out_flush();
+				}
+			} else {
+				conf.predict.barrier = 1;
+				conf.predict.shown = 0;
+			}
+			conf.paste.last = now;
 		}
-		if(fds[1].revents) {
+		if(fds[1].revents & POLLERR)
+			tstamp_errqueue(&conf.tstamp, conf.s);
+		if(fds[1].revents & POLLIN) {
 			skb_reset(skb);
 			buf = skb_put(skb, 0);
-			n = recvfrom(conf.s, buf, skb_tailroom(skb), 0, (struct sockaddr *)&from, &fromlen);
+			n = tstamp_recv(&conf.tstamp, conf.s, buf, skb_tailroom(skb), 0,
+					(struct sockaddr *)&from, &fromlen, NULL);
 			if(n == -1) {
 				fprintf(stderr, "recvfrom() failed. ifconfig up?\n");
 				continue;
 			}
 			skb_put(skb, n);
 
-			if(conf.ucast)
-				if(memcmp(conf.dest.sll_addr, from.sll_addr, 6))
+			if(conf.ucast && !conf.targets.count)
+				if(memcmp(conf.dest.sll_addr, from.sll_addr, 6) &&
+				   !console_moved(&from, skb->data, skb->len))
 					continue;
 			
 			if(ntohs(from.sll_protocol) == ETH_P_EGETTY) {
+				struct proto_hdr h;
+				const uint8_t *msg;
+				unsigned int off = 0;
+				
 				if(conf.debug) printf("Received EGETTY\n");
-				p = skb->data;
-				if(*p == EGETTY_HELLO) {
-					if(conf.scan) {
-						p++;
-						printf("Console: %d ", *p);
-						for(i=0;i<6;i++)
-							printf("%02x%s", from.sll_addr[i], i==5?"":":");
-						printf("\n");
-					}
-					continue;
-				}
-				if(*p == EGETTY_OUT || *p == EGETTY_KMSG) {
-					p++;
-					if(*p++ != conf.console) continue;
-					len = *p++ << 8;
-					len += *p;
-					skb_trim(skb, len);
-					skb_pull(skb, 4);
-					if(!conf.scan) write(1, skb->data, skb->len);
-				}
+				while((msg = proto_next(skb->data, skb->len, &off, &h)))
+					console_input(&from, &h, msg + h.hlen, h.len - h.hlen);
 				continue;
 			}
 		}
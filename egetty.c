@@ -7,6 +7,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h> /* superset of previous */
@@ -16,6 +17,9 @@
 #include <pty.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
 
 #include <sys/socket.h>
 #include <netpacket/packet.h>
@@ -36,17 +40,99 @@
 #include "egetty.h"
 
 #include "skbuff.h"
+#include "lowlat.h"
+#include "txq.h"
+#include "rec.h"
+#include "ringlog.h"
+#include "xfer.h"
+#include "proto.h"
+#include "lz.h"
+#include "screen.h"
+#include "tstamp.h"
+#include "trace.h"
+#include "broker.h"
+#include "ifset.h"
+#include "vlan.h"
 
 static char **envp;
+static struct txsched txs;
+static struct rec *rec;
+static volatile sig_atomic_t terminate, upgrade;
+static struct ringlog ring;
+static struct {
+	int active;
+	uint64_t pos;
+} replay;
+static struct xfer xf;
+static struct sockaddr_ll xfpeer;
+static int xfver, xfpack; /* protocol version and TXQ_PACK of xfpeer */
+static int rxvlan; /* VLAN of the frame being handled */
+
+#define HELLO_HELD 16 /* scan answers waiting for their time */
+#define HELLO_SPREAD 10000 /* longest spread window we accept, ms */
+#define IDLE_GRACE 5 /* s from SIGHUP to SIGKILL of an idle login */
+static struct {
+	long long due; /* lowlat_now() time, 0 if slot is free */
+	struct sockaddr_ll dest;
+	int flags;
+} hellos[HELLO_HELD];
+static struct lz *lz;
+static unsigned char lzbuf[PROTO_MTU];
+static struct {
+	struct screen *scr;
+	const unsigned char *out; /* rendered screen still to be queued */
+	unsigned int len, off;
+	int lag; /* client is behind: output only goes to the model */
+} view;
+static struct tstamp stamps;
+static long long rxtime, ptytime; /* last frame received, last pty write */
+static long long spawntime, lastuse; /* login spawned, last pty input or output */
+static long long idlehup; /* idle login was sent SIGHUP */
+static struct {
+	pid_t pid;
+	int fd, go;
+} standby = { -1, -1, -1 };
+static struct trace trace;
+static struct rec_pos recpos; /* recording handed over on upgrade */
+static const int trace_sigs[] = { SIGUSR1, SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, 0 };
 
 struct {
 	int console;
-	char *device;
+	char *device; /* first of devices */
+	char *devices[IFSET_MAX];
+	int ndev;
+	struct ifset ifs;
+	int vlan; /* on a trunk: serve vlans[], or every VLAN if nvlan is 0 */
+	int vlans[64];
+	int nvlan;
 	int kmsg;
 	int waitif;
 	int debug;
+	char **argv; /* to exec ourselves again on upgrade */
+	int resume; /* fd of state from the egetty we replace, or -1 */
+	int hardened;
+	int lazy; /* no login until a client attaches */
+	int idle; /* seconds without input or output before the login is reaped */
+	char *record;
+	unsigned long recordsize;
+	char *ringlog;
+	unsigned long ringsize;
+	int xferdir; /* fd of directory for file transfers */
+	int bundle; /* usecs to wait for a bundle to fill */
+	int compress; /* smallest output to compress, 0 to never compress */
+	int screen; /* keep a screen model */
+	char *trace; /* where the flight recorder is dumped */
+	char *broker; /* registration socket in broker mode */
+	char *ttys[64]; /* devices for broker mode, PATH:CONSOLE */
+	int ntty;
+	int workers; /* broker threads */
 	struct sockaddr_ll client;
+	int clientver; /* protocol version the client speaks */
+	int clientpack; /* TXQ_PACK if client takes bundles */
+	int clientlz; /* client decodes compressed output */
+	uint32_t session; /* id of current login session */
 	int devsocket;
+	struct lowlat lowlat;
 } conf;
 
 char *indextoname(unsigned int ifindex)
@@ -112,16 +198,94 @@ int putfd(int fd, char *s)
 	return 0;
 }
 
-pid_t login(int *fd)
+/* dump the flight recorder on SIGUSR1 and when we crash */
+static void trace_handler(int sig)
+{
+	trace_dump(&trace, conf.trace, sig);
+	if(sig == SIGUSR1)
+		return;
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void trace_signals(void (*handler)(int))
+{
+	int i;
+
+	for(i=0;trace_sigs[i];i++)
+		signal(trace_sigs[i], handler);
+}
+
+/* any exit but the one we are told to make */
+static void trace_exit(void)
+{
+	if(!terminate)
+		trace_dump(&trace, conf.trace, 0);
+}
+
+/*
+ * The login session gets none of our fds: not the packet socket and not
+ * the pty master of a session that is still running. They stay open
+ * across exec in egetty itself, for the upgrade.
+ */
+static void login_closefds(int keep)
+{
+	int fd, max;
+
+	if(keep < 3) {
+		if(!close_range(3, ~0U, 0))
+			return;
+	} else if((keep == 3 || !close_range(3, keep - 1, 0)) &&
+		  !close_range(keep + 1, ~0U, 0))
+		return;
+	max = sysconf(_SC_OPEN_MAX);
+	for(fd=3;fd<max;fd++)
+		if(fd != keep)
+			close(fd);
+}
+
+/*
+ * Fork login on a new pty.
+ * If 'go' is not NULL the child is a standby: it waits until a byte is
+ * written to *go before exec of login. A standby can be activated even
+ * when memory is too tight to fork a new process.
+ */
+pid_t login(int *fd, int *go)
 {
 	pid_t pid;
 	int amaster, tty, rc=0;
 	char name[256];
+	int gofd[2];
+
+	if(go) {
+		if(pipe(gofd))
+			return -1;
+		fcntl(gofd[1], F_SETFD, FD_CLOEXEC);
+	}
 
 	pid = forkpty(&amaster, name,
 		      NULL, NULL);
 	if(pid == 0) {
 		/* child */
+		trace_signals(SIG_DFL);
+		/* the session runs on any cpu, not on the one we poll on */
+		lowlat_child();
+		login_closefds(go ? gofd[0] : -1);
+		if(go) {
+			char c;
+			close(gofd[1]);
+			if(read(gofd[0], &c, 1) != 1)
+				_exit(0);
+			close(gofd[0]);
+		}
+		if(conf.hardened) {
+			/* login session must not inherit our OOM protection */
+			tty = open("/proc/self/oom_score_adj", O_WRONLY);
+			if(tty >= 0) {
+				putfd(tty, "0");
+				close(tty);
+			}
+		}
 		if(conf.kmsg) {
 			if ((rc=ioctl(0, TIOCCONS, 0))) {
 				if(conf.debug) {
@@ -154,7 +318,14 @@ pid_t login(int *fd)
 		char *argv[]={"/bin/login", "--", 0, 0};
 		(void) execve( argv[0], argv, envp );
 		printf("execve failed\n");
-		exit(1);
+		_exit(1);
+	}
+	if(go) {
+		close(gofd[0]);
+		if(pid == -1)
+			close(gofd[1]);
+		else
+			*go = gofd[1];
 	}
 	if(pid == -1) return -1;
 	*fd = amaster;
@@ -162,87 +333,898 @@ pid_t login(int *fd)
 	return pid;
 }
 
-int console_ucast(int s, int ifindex, struct sk_buff *skb)
+/*
+ * Make egetty survive memory pressure:
+ * never OOM-killed, and no page of ours will be swapped or evicted.
+ * All buffers must be allocated before this is called.
+ */
+static int hardened_init(void)
+{
+	int fd, rc = 0;
+	volatile char stack[65536];
+
+	fd = open("/proc/self/oom_score_adj", O_WRONLY);
+	if(fd == -1 || write(fd, "-1000", 5) != 5) {
+		fprintf(stderr, "oom_score_adj: %s\n", strerror(errno));
+		rc = -1;
+	}
+	if(fd >= 0) close(fd);
+
+	/* fault in stack we may need later */
+	memset((char *)stack, 0, sizeof(stack));
+
+	if(mlockall(MCL_CURRENT|MCL_FUTURE)) {
+		fprintf(stderr, "mlockall: %s\n", strerror(errno));
+		rc = -1;
+	}
+	return rc;
+}
+
+static void console_dest(struct sockaddr_ll *dest, int ifindex, const unsigned char *mac)
+{
+	memset(dest, 0, sizeof(struct sockaddr_ll));
+
+	dest->sll_family = AF_PACKET;
+	dest->sll_halen = 6;
+	dest->sll_protocol = htons(ETH_P_EGETTY);
+	dest->sll_ifindex = ifindex;
+	if(mac)
+		memcpy(dest->sll_addr, mac, 6);
+	else
+		memset(dest->sll_addr, 255, 6);
+}
+
+/*
+ * Queue output for the client in 'class'.
+ * Bulk output is compressed if the client can take it. Echo is too
+ * small to gain from it.
+ */
+static int console_out(int ifindex, struct sk_buff *skb, int class)
 {
 	struct sockaddr_ll dest;
-	socklen_t destlen = sizeof(dest);
+	int n, flags = proto_flags;
 
-	memset(&dest, 0, sizeof(dest));
+	if(class == TXQ_BULK && lz && conf.clientlz && skb->len >= conf.compress) {
+		n = lz_msg_encode(lz, skb->data, skb->len, lzbuf, sizeof(lzbuf) - PROTO_HDRMAX);
+		if(n > 0) {
+			skb_trim(skb, n);
+			memcpy(skb->data, lzbuf, n);
+			flags |= PROTO_F_LZ;
+		}
+	}
+
+	proto_push_flags(skb, conf.clientver, EGETTY_OUT, conf.console, conf.session, flags);
 
-	dest.sll_family = AF_PACKET;
-	dest.sll_halen = 6;
-	dest.sll_protocol = htons(ETH_P_EGETTY);
-	dest.sll_ifindex = ifindex;
-	memcpy(dest.sll_addr, conf.client.sll_addr, 6);
+	console_dest(&dest, ifindex, conf.client.sll_addr);
+	return txsched_enqueue(&txs, class, skb, &dest, conf.clientpack);
+}
+
+/*
+ * Queue pty output for the client.
+ * Small writes are most likely echo of what the client typed and skip
+ * ahead of other traffic, but never of output still queued before them.
+ */
+int console_put(int ifindex, struct sk_buff *skb)
+{
+	return console_out(ifindex, skb, txsched_class(&txs, skb->len));
+}
+
+/* flags for txsched_enqueue() to a peer that sent us 'h' */
+static int console_pack(const struct proto_hdr *h)
+{
+	return ((h->version >= PROTO_V2 && (h->flags & PROTO_F_BUNDLE)) ? TXQ_PACK : 0) |
+		TXQ_VLAN(rxvlan);
+}
+
+/* return echo probe to its sender, in the version it was sent in */
+int console_pong(int ifindex, const struct sockaddr_ll *from, const struct proto_hdr *h,
+		 const uint8_t *data, unsigned int len)
+{
+	struct sockaddr_ll dest;
+	struct sk_buff *skb;
+
+	skb = txsched_alloc(&txs, TXQ_CTRL);
+	if(!skb)
+		return -1;
+	skb_reserve(skb, PROTO_HDRMAX);
+	memcpy(skb_put(skb, len), data, len);
+	proto_push(skb, h->version, EGETTY_PONG, h->console, conf.session);
+
+	console_dest(&dest, ifindex, from->sll_addr);
+	return txsched_enqueue(&txs, TXQ_CTRL, skb, &dest, console_pack(h));
+}
+
+/* latency histograms as text to whoever asked */
+static int console_stats(int ifindex, const struct sockaddr_ll *from, const struct proto_hdr *h)
+{
+	struct sockaddr_ll dest;
+	struct sk_buff *skb;
+	int n;
+
+	skb = txsched_alloc(&txs, TXQ_CTRL);
+	if(!skb)
+		return -1;
+	skb_reserve(skb, PROTO_HDRMAX);
+	if(stamps.enable)
+		n = tstamp_format(&stamps, (char *)skb_put(skb, 0), skb_tailroom(skb));
+	else
+		n = snprintf((char *)skb_put(skb, 0), skb_tailroom(skb), "timestamps not enabled\n");
+	skb_put(skb, n);
+	proto_push(skb, h->version, EGETTY_STATS, h->console, conf.session);
+
+	console_dest(&dest, ifindex, from->sll_addr);
+	return txsched_enqueue(&txs, TXQ_CTRL, skb, &dest, console_pack(h));
+}
+
+/* version 1 HELLO that also tells we speak version 2 */
+static int console_hello_to(const struct sockaddr_ll *dest, int flags)
+{
+	struct sk_buff *skb;
+
+	skb = txsched_alloc(&txs, TXQ_CTRL);
+	if(!skb)
+		return -1;
 	
-	return sendto(s, skb->data, skb->len, 0, (const struct sockaddr *)&dest, destlen);
+	skb_reserve(skb, PROTO_HDRMAX);
+	proto_put_caps(skb, conf.console, conf.session);
+	proto_push(skb, proto_version(PROTO_V1, conf.console), EGETTY_HELLO, conf.console, conf.session);
+	return txsched_enqueue(&txs, TXQ_CTRL, skb, dest, flags);
 }
 
-int console_bcast(int s, int ifindex, struct sk_buff *skb)
+/* broadcast HELLO, on every interface if 'ifindex' is 0 */
+int console_hello(int ifindex, int vlan)
 {
 	struct sockaddr_ll dest;
-	socklen_t destlen = sizeof(dest);
+	int i;
+
+	if(!ifindex) {
+		for(i=0;i<conf.ifs.n;i++)
+			console_hello(conf.ifs.dev[i].index, vlan);
+		return 0;
+	}
+	console_dest(&dest, ifindex, NULL);
+	return console_hello_to(&dest, TXQ_VLAN(vlan));
+}
+
+/*
+ * Answer a scan to the scanner only, after a random part of the
+ * spread window it asked for.
+ */
+static void console_scanned(int ifindex, const struct sockaddr_ll *from, const struct proto_hdr *h,
+			    const uint8_t *p)
+{
+	unsigned int spread = proto_spread(h, p);
+	int i, slot = -1;
+
+	if(spread > HELLO_SPREAD)
+		spread = HELLO_SPREAD;
+	for(i=0;i<HELLO_HELD;i++) {
+		if(!hellos[i].due) {
+			if(slot == -1)
+				slot = i;
+			continue;
+		}
+		/* scanned again before we answered: one answer will do */
+		if(!memcmp(hellos[i].dest.sll_addr, from->sll_addr, 6) &&
+		   hellos[i].dest.sll_ifindex == ifindex &&
+		   hellos[i].flags == TXQ_VLAN(rxvlan))
+			return;
+	}
+	if(!spread || slot == -1) {
+		struct sockaddr_ll dest;
+
+		console_dest(&dest, ifindex, from->sll_addr);
+		console_hello_to(&dest, TXQ_VLAN(rxvlan));
+		return;
+	}
+	console_dest(&hellos[slot].dest, ifindex, from->sll_addr);
+	hellos[slot].flags = TXQ_VLAN(rxvlan);
+	hellos[slot].due = lowlat_now() + (random() % spread) * 1000000LL;
+}
+
+/* send held scan answers that are due. Returns ms to the next, or -1 */
+static int hello_run(void)
+{
+	long long now = lowlat_now(), next = 0;
+	int i;
+
+	for(i=0;i<HELLO_HELD;i++) {
+		if(!hellos[i].due)
+			continue;
+		if(hellos[i].due <= now) {
+			if(console_hello_to(&hellos[i].dest, hellos[i].flags))
+				return 1; /* no buffer: try again soon */
+			hellos[i].due = 0;
+			continue;
+		}
+		if(!next || hellos[i].due < next)
+			next = hellos[i].due;
+	}
+	return next ? (next - now) / 1000000 + 1 : -1;
+}
 
-	memset(&dest, 0, sizeof(dest));
+/*
+ * Send console history from the ring to the client, straight from the
+ * mapping. While a replay is running, new output is only added to the ring
+ * and is sent from there, so the client sees it in order.
+ */
+static void replay_run(int ifindex)
+{
+	struct sk_buff *skb;
+	struct iovec iov[2];
+	int i, cnt;
+
+	while(replay.active && txsched_avail(&txs, TXQ_BULK)) {
+		skb = txsched_alloc(&txs, TXQ_BULK);
+		skb_reserve(skb, PROTO_HDRMAX);
+		if(replay.pos < ringlog_start(&ring))
+			replay.pos = ringlog_start(&ring);
+		cnt = ringlog_iov(&ring, replay.pos, skb_tailroom(skb), iov);
+		if(!cnt) {
+			txsched_free(&txs, skb);
+			replay.active = 0;
+			break;
+		}
+		for(i=0;i<cnt;i++) {
+			memcpy(skb_put(skb, iov[i].iov_len), iov[i].iov_base, iov[i].iov_len);
+			replay.pos += iov[i].iov_len;
+		}
+		console_put(ifindex, skb);
+	}
+}
+
+static int console_file(int class, struct sk_buff *skb)
+{
+	proto_push(skb, xfver, EGETTY_FILE, conf.console, conf.session);
+	return txsched_enqueue(&txs, class, skb, &xfpeer, xfpack);
+}
+
+/* send data for a running 'get' */
+static void xfer_run(void)
+{
+	struct sk_buff *skb;
+
+	/* the peer went away: do not resend to it forever */
+	if(xfer_expired(&xf, lowlat_now() / 1000000) && conf.debug)
+		printf("xfer %08x timed out\n", xf.id);
+	while(xf.sender && xf.state != XFER_S_DONE && txsched_avail(&txs, TXQ_BULK)) {
+		skb = txsched_alloc(&txs, TXQ_BULK);
+		skb_reserve(skb, PROTO_HDRMAX + XFER_HDR);
+		if(!xfer_next(&xf, skb, lowlat_now() / 1000000)) {
+			txsched_free(&txs, skb);
+			break;
+		}
+		console_file(TXQ_BULK, skb);
+	}
+	if(xf.state == XFER_S_DONE && xf.fd >= 0) {
+		if(conf.debug)
+			printf("xfer %08x done status %d\n", xf.id, xf.status);
+		close(xf.fd);
+		xf.fd = -1;
+	}
+}
+
+/*
+ * Start a transfer. Paths are relative to the transfer directory and
+ * may not leave it.
+ */
+static int xfer_open(const struct xfer_msg *m, struct sk_buff *reply)
+{
+	char path[256];
+	struct stat st;
+	uint64_t start = 0;
+	int fd;
+
+	if(m->len == 0 || m->len >= sizeof(path))
+		return EINVAL;
+	memcpy(path, m->data, m->len);
+	path[m->len] = 0;
+	if(path[0] == '/' || strstr(path, ".."))
+		return EACCES;
 
-	dest.sll_family = AF_PACKET;
-	dest.sll_halen = 6;
-	dest.sll_protocol = htons(ETH_P_EGETTY);
-	dest.sll_ifindex = ifindex;
-	memset(dest.sll_addr, 255, 6);
+	if(xf.fd >= 0)
+		close(xf.fd);
+	xf.fd = -1;
 	
-	return sendto(s, skb->data, skb->len, 0, (const struct sockaddr *)&dest, destlen);
+	if(m->op == XFER_PUT) {
+		fd = xfer_openat(conf.xferdir, path, O_RDWR|O_CREAT|((m->flags & XFER_RESUME) ? 0 : O_TRUNC), 0600);
+		if(fd == -1) return errno;
+		if(fstat(fd, &st) == 0 && (m->flags & XFER_RESUME))
+			start = st.st_size < m->off ? st.st_size : m->off;
+		if(ftruncate(fd, start)) {
+			close(fd);
+			return errno;
+		}
+		xfer_init(&xf, fd, 0, m->id, m->off, start);
+		xfer_push(reply, XFER_OPEN, 0, m->id, start);
+	} else {
+		fd = xfer_openat(conf.xferdir, path, O_RDONLY, 0);
+		if(fd == -1) return errno;
+		if(fstat(fd, &st)) {
+			close(fd);
+			return errno;
+		}
+		start = m->off < st.st_size ? m->off : st.st_size;
+		xfer_init(&xf, fd, 1, m->id, st.st_size, start);
+		xfer_push(reply, XFER_OPEN, 0, m->id, st.st_size);
+	}
+	if(conf.debug)
+		printf("xfer %08x %s %s from %llu\n", m->id, m->op == XFER_PUT ? "put" : "get",
+		       path, (unsigned long long)start);
+	return 0;
 }
 
-int console_put(int s, int ifindex, struct sk_buff *skb)
+static void xfer_msg(int ifindex, const struct sockaddr_ll *from, const struct proto_hdr *h,
+		     const uint8_t *p, unsigned int len)
 {
+	struct sockaddr_ll dest;
+	struct xfer_msg m;
+	struct sk_buff *reply;
 	int rc;
-	uint8_t *p;
 
-	p = skb_push(skb, 4);
-	*p++ = EGETTY_OUT;
-	*p++ = conf.console;
-	*p++ = skb->len >> 8;
-	*p = skb->len & 0xff;
+	if(xfer_parse(p, len, &m))
+		return;
+	reply = txsched_alloc(&txs, TXQ_CTRL);
+	if(!reply)
+		return;
+	skb_reserve(reply, PROTO_HDRMAX + XFER_HDR);
 
-	rc = console_ucast(s, ifindex, skb);
-	if(rc == -1) {
-		printf("sendto failed: %s\n", strerror(errno));
-		return -1;
+	if(m.op == XFER_PUT || m.op == XFER_GET) {
+		if(memcmp(conf.client.sll_addr, from->sll_addr, 6)) {
+			/* only the client attached to the console */
+			xfer_put32(reply, EACCES);
+			xfer_push(reply, XFER_ERR, 0, m.id, 0);
+			proto_push(reply, h->version, EGETTY_FILE, conf.console, conf.session);
+			console_dest(&dest, ifindex, from->sll_addr);
+			txsched_enqueue(&txs, TXQ_CTRL, reply, &dest, console_pack(h));
+			return;
+		}
+		if(xf.id == m.id && xf.state != XFER_S_IDLE) {
+			/* our OPEN was lost */
+			xfer_push(reply, XFER_OPEN, 0, m.id, m.op == XFER_PUT ? xf.base : xf.size);
+		} else {
+			console_dest(&xfpeer, ifindex, from->sll_addr);
+			xfver = h->version;
+			xfpack = console_pack(h);
+			if((rc = xfer_open(&m, reply))) {
+				xfer_put32(reply, rc);
+				xfer_push(reply, XFER_ERR, 0, m.id, 0);
+			}
+		}
+		console_file(TXQ_CTRL, reply);
+		return;
+	}
+	if(memcmp(xfpeer.sll_addr, from->sll_addr, 6) ||
+	   !xfer_input(&xf, &m, reply, lowlat_now() / 1000000)) {
+		txsched_free(&txs, reply);
+		return;
+	}
+	console_file(TXQ_CTRL, reply);
+}
+
+/*
+ * new id for each login session, never 0. Starts a new compression
+ * stream and a blank screen.
+ */
+static uint32_t session_id(pid_t pid)
+{
+	uint32_t id = lowlat_now() ^ ((uint32_t)pid << 16) ^ conf.session;
+
+	if(lz)
+		lz_reset(lz);
+	if(view.scr)
+		screen_reset(view.scr);
+	return id ? id : 1;
+}
+
+/*
+ * Start a login session: the standby if there is one, else a new login.
+ * Exits if login cannot be forked.
+ */
+static pid_t console_spawn(int *loginfd)
+{
+	pid_t pid;
+
+	spawntime = lastuse = lowlat_now();
+	idlehup = 0;
+	if(standby.pid != -1) {
+		pid = standby.pid;
+		*loginfd = standby.fd;
+		write(standby.go, "", 1);
+		close(standby.go);
+		standby.pid = -1;
+		conf.session = session_id(pid);
+		trace_ev(&trace, TRACE_SPAWN, 0, 0, pid);
+		if(conf.debug)
+			printf("activated standby pid = %d\n", pid);
+		return pid;
+	}
+	pid = login(loginfd, NULL);
+	if(pid == -1)
+		exit(1);
+	conf.session = session_id(pid);
+	trace_ev(&trace, TRACE_SPAWN, 0, 0, pid);
+	if(conf.debug) {
+		printf("child pid = %d\n", pid);
+		printf("loginfd = %d\n", *loginfd);
+	}
+	return pid;
+}
+
+/* frames that attach to the console, and start a login in lazy mode */
+static int console_attach(const struct proto_hdr *h)
+{
+	if(h->console != conf.console)
+		return 0;
+	return h->type == EGETTY_IN || h->type == EGETTY_WINCH ||
+		h->type == EGETTY_SNAPSHOT || h->type == EGETTY_REPLAY;
+}
+
+static void terminate_handler(int sig)
+{
+	terminate = 1;
+}
+
+static void rec_stop(void)
+{
+	unsigned long dropped = rec_close(rec);
+	
+	rec = NULL;
+	if(dropped)
+		fprintf(stderr, "recording dropped %lu events\n", dropped);
+}
+
+/*
+ * Screen model. While the client keeps up it gets pty output as it is.
+ * When the bulk queue is full, output only updates the model. Once the
+ * queue has drained, the client gets the difference between the screen
+ * it has and the current one instead of everything in between.
+ */
+static void view_run(int ifindex)
+{
+	struct sk_buff *skb;
+	unsigned int n;
+
+	if(view.lag && !view.len && !txs.q[TXQ_BULK].count) {
+		view.len = screen_render(view.scr, 0, &view.out);
+		view.off = 0;
+		view.lag = 0;
+		if(conf.debug)
+			printf("screen: %u bytes of changes\n", view.len);
+	}
+	while(view.off < view.len && txsched_avail(&txs, TXQ_BULK)) {
+		skb = txsched_alloc(&txs, TXQ_BULK);
+		skb_reserve(skb, PROTO_HDRMAX);
+		n = view.len - view.off;
+		if(n > skb_tailroom(skb))
+			n = skb_tailroom(skb);
+		memcpy(skb_put(skb, n), view.out + view.off, n);
+		view.off += n;
+		console_put(ifindex, skb);
+	}
+	if(view.off == view.len)
+		view.len = 0;
+}
+
+/* whole screen to a client that attaches */
+static void view_snapshot(void)
+{
+	view.len = screen_render(view.scr, 1, &view.out);
+	view.off = 0;
+	view.lag = 0;
+	if(conf.debug)
+		printf("screen: %u bytes snapshot\n", view.len);
+}
+
+/* client lost queued output: it gets a full screen when the queue drains */
+static void view_lost(void)
+{
+	if(!view.scr)
+		return;
+	screen_invalidate(view.scr);
+	view.len = 0;
+	view.lag = 1;
+}
+
+/* pty output 'p' that the client will not get as it is */
+static void view_skip(const uint8_t *p, unsigned int len)
+{
+	if(!view.lag && !view.len)
+		screen_sync(view.scr);
+	view.lag = 1;
+	screen_feed(view.scr, p, len);
+}
+
+/*
+ * Client sent an interrupt character. Whatever bulk output we still have
+ * queued is not wanted anymore (compare TIOCFLUSH in rlogin).
+ */
+static int console_intr(int fd, const uint8_t *p, unsigned int len)
+{
+	struct termios tio;
+	unsigned int i;
+
+	if(!txs.q[TXQ_BULK].count)
+		return 0;
+	if(tcgetattr(fd, &tio) || !(tio.c_lflag & ISIG))
+		return 0;
+	for(i=0;i<len;i++) {
+		if(p[i] == _POSIX_VDISABLE)
+			continue;
+		if(p[i] == tio.c_cc[VINTR] ||
+		   p[i] == tio.c_cc[VQUIT] ||
+		   p[i] == tio.c_cc[VSUSP]) {
+			i = txsched_flush(&txs, TXQ_BULK);
+			trace_ev(&trace, TRACE_FLUSH, 0, 0, i);
+			/* flushed messages are part of the stream */
+			if(lz && i)
+				lz_reset(lz);
+			if(i)
+				view_lost();
+			if(conf.debug)
+				printf("interrupt: flushed %d queued frames\n", i);
+			return i;
+		}
 	}
 	return 0;
 }
 
-int console_hello(int s, int ifindex, struct sk_buff *skb)
+/* output to the client goes out on 'ifindex' from now on */
+static void console_move(int ifindex, int linklost)
 {
-	int rc;
-	uint8_t *p;
+	trace_ev(&trace, TRACE_IFACE, linklost, conf.client.sll_ifindex, ifindex);
+	if(conf.debug)
+		printf("client now on %s%s\n", indextoname(ifindex), linklost ? ", link lost" : "");
+	txsched_redirect(&txs, conf.client.sll_ifindex, ifindex);
+	conf.client.sll_ifindex = ifindex;
+	/* the client only knows our other address: tell it where we are */
+	if(linklost)
+		console_hello(ifindex, TXQ_VID(conf.clientpack));
+}
+
+/* 'from' is now the client we send output to */
+static void console_client(const struct sockaddr_ll *from, const struct proto_hdr *h)
+{
+	int clientlz = h->version >= PROTO_V2 && (h->flags & PROTO_F_LZ);
+	int moved = memcmp(conf.client.sll_addr, from->sll_addr, 6) ||
+		TXQ_VID(conf.clientpack) != rxvlan;
+
+	if(moved || h->version != conf.clientver)
+		trace_ev(&trace, TRACE_CLIENT, h->version,
+			 from->sll_addr[0] << 8 | from->sll_addr[1],
+			 (uint32_t)from->sll_addr[2] << 24 | from->sll_addr[3] << 16 |
+			 from->sll_addr[4] << 8 | from->sll_addr[5]);
+	/* a new client has not seen the stream so far */
+	if(lz && (moved || clientlz != conf.clientlz))
+		lz_reset(lz);
+	memcpy(conf.client.sll_addr, from->sll_addr, 6);
+	if(from->sll_ifindex != conf.client.sll_ifindex)
+		console_move(from->sll_ifindex, 0);
+	conf.clientver = h->version;
+	conf.clientpack = console_pack(h);
+	conf.clientlz = clientlz;
+}
+
+static void lz_stats(void)
+{
+	static unsigned long long shown;
 
-	p = skb_push(skb, 4);
-	*p++ = EGETTY_HELLO;
-	*p++ = conf.console;
-	*p++ = skb->len >> 8;
-	*p = skb->len & 0xff;
+	if(!conf.debug || !lz || lz->msgs == shown)
+		return;
+	shown = lz->msgs;
+	printf("compressed %llu messages: %llu -> %llu bytes (%llu%%), %llu us\n",
+	       lz->msgs, lz->in, lz->out, lz->out * 100 / lz->in, lz->ns / 1000);
+}
+
+static void upgrade_handler(int sig)
+{
+	upgrade = 1;
+}
+
+static void cloexec(int fd, int on)
+{
+	if(fd >= 0)
+		fcntl(fd, F_SETFD, on ? FD_CLOEXEC : 0);
+}
+
+/*
+ * Upgrade without dropping the session: exec the egetty binary again.
+ * The pid stays the same, so login is still our child and init does not
+ * notice. The packet socket and the pty masters are inherited. The rest,
+ * client, session and the screen, is written as text to a memfd that the
+ * new egetty gets as resume=FD, so a different version can read it.
+ * Returns only if exec failed.
+ */
+static void console_upgrade(int s, pid_t pid, int loginfd)
+{
+	const unsigned char *out;
+	unsigned int len;
+	char **argv, arg[32];
+	FILE *f;
+	int fd, i, n;
+
+	/* queued output is lost in the exec */
+	for(i=0;i<100 && txsched_pending(&txs);i++) {
+		txsched_run(&txs, s);
+		if(txsched_pending(&txs))
+			usleep(1000);
+	}
+
+	fd = memfd_create("egetty", 0);
+	if(fd == -1) {
+		fprintf(stderr, "upgrade: %s\n", strerror(errno));
+		return;
+	}
+	f = fdopen(dup(fd), "w");
+	if(!f) {
+		fprintf(stderr, "upgrade: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+	/* the writer finishes, the new egetty appends where it stopped */
+	memset(&recpos, 0, sizeof(recpos));
+	rec_detach(rec, &recpos);
+	rec = NULL;
+	fprintf(f, "egetty-handoff 1\n");
+	fprintf(f, "socket %d\n", s);
+	fprintf(f, "login %d %d\n", pid, loginfd);
+	fprintf(f, "standby %d %d %d\n", standby.pid, standby.fd, standby.go);
+	fprintf(f, "session %u\n", conf.session);
+	fprintf(f, "client %02x:%02x:%02x:%02x:%02x:%02x %d %d %d %d\n",
+		conf.client.sll_addr[0], conf.client.sll_addr[1], conf.client.sll_addr[2],
+		conf.client.sll_addr[3], conf.client.sll_addr[4], conf.client.sll_addr[5],
+		conf.client.sll_ifindex, conf.clientver, conf.clientpack, conf.clientlz);
+	if(recpos.start)
+		fprintf(f, "record %lld %lld %d\n", recpos.start, recpos.fstart, recpos.seq);
+	/* last: raw bytes follow */
+	if(view.scr) {
+		/* the new model is built from a full repaint of this one */
+		n = !view.lag && !view.len;
+		len = screen_render(view.scr, 1, &out);
+		fprintf(f, "screen %d %d %d %u\n", view.scr->rows, view.scr->cols, n, len);
+		fwrite(out, 1, len, f);
+	}
+	if(fclose(f)) {
+		fprintf(stderr, "upgrade: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	for(n=0;conf.argv[n];n++);
+	argv = malloc((n + 2) * sizeof(char *));
+	if(!argv)
+		goto fail;
+	for(n=0,i=0;conf.argv[i];i++)
+		if(strncmp(conf.argv[i], "resume=", 7))
+			argv[n++] = conf.argv[i];
+	snprintf(arg, sizeof(arg), "resume=%d", fd);
+	argv[n++] = arg;
+	argv[n] = NULL;
+
+	cloexec(ring.fd, 1);
+	cloexec(conf.devsocket, 1);
+	cloexec(conf.ifs.nl, 1);
+	cloexec(conf.xferdir, 1);
+	cloexec(xf.fd, 1);
+	if(standby.pid != -1)
+		cloexec(standby.go, 0);
+	if(conf.debug)
+		printf("upgrade: exec %s\n", argv[0]);
+	execvp(argv[0], argv);
+
+	fprintf(stderr, "upgrade: %s: %s\n", argv[0], strerror(errno));
+	if(standby.pid != -1)
+		cloexec(standby.go, 1);
+	free(argv);
+fail:
+	close(fd);
+	if(recpos.start)
+		rec = rec_continue(conf.record, conf.recordsize, &recpos);
+}
+
+/* take over from the egetty that exec'd us, see console_upgrade() */
+static int console_resume(int fd, int *s, pid_t *pid, int *loginfd)
+{
+	unsigned char mac[6], buf[4096];
+	int rows, cols, synced, a, b, c, d;
+	unsigned int len, n;
+	char line[128];
+	FILE *f;
 
-	rc = console_bcast(s, ifindex, skb);
-	if(rc == -1) {
-		printf("sendto failed: %s\n", strerror(errno));
+	lseek(fd, 0, SEEK_SET);
+	f = fdopen(fd, "r");
+	if(!f) {
+		close(fd);
 		return -1;
 	}
+	if(!fgets(line, sizeof(line), f) || strcmp(line, "egetty-handoff 1\n")) {
+		fclose(f);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "socket %d", &a) == 1) {
+			/* frames that arrived during exec wait there */
+			dup2(a, *s);
+			close(a);
+			continue;
+		}
+		if(sscanf(line, "login %d %d", &a, &b) == 2) {
+			*pid = a;
+			*loginfd = b;
+			lastuse = lowlat_now();
+			continue;
+		}
+		if(sscanf(line, "standby %d %d %d", &a, &b, &c) == 3) {
+			standby.pid = a;
+			standby.fd = b;
+			standby.go = c;
+			cloexec(standby.go, 1);
+			continue;
+		}
+		if(sscanf(line, "session %u", &conf.session) == 1)
+			continue;
+		if(sscanf(line, "record %lld %lld %d", &recpos.start, &recpos.fstart, &recpos.seq) == 3)
+			continue;
+		if(sscanf(line, "client %hhx:%hhx:%hhx:%hhx:%hhx:%hhx %d %d %d %d",
+			  &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &a, &b, &c, &d) == 10) {
+			memcpy(conf.client.sll_addr, mac, 6);
+			conf.client.sll_ifindex = a;
+			conf.clientver = b;
+			conf.clientpack = c;
+			conf.clientlz = d;
+			continue;
+		}
+		if(sscanf(line, "screen %d %d %d %u", &rows, &cols, &synced, &len) == 4) {
+			if(view.scr)
+				screen_resize(view.scr, rows, cols);
+			while(len) {
+				n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), f);
+				if(!n)
+					break;
+				if(view.scr)
+					screen_feed(view.scr, buf, n);
+				len -= n;
+			}
+			if(view.scr) {
+				if(synced)
+					screen_sync(view.scr);
+				else
+					view_lost();
+			}
+		}
+	}
+	fclose(f);
 	return 0;
 }
 
+/* handle one message from the network */
+static void console_msg(int ifindex, const struct sockaddr_ll *from, const struct proto_hdr *h,
+			const uint8_t *p, unsigned int len, pid_t pid, int loginfd)
+{
+	trace_ev(&trace, TRACE_RX, h->type, h->console, len);
+	if(h->type == EGETTY_SCAN) {
+		console_scanned(ifindex, from, h, p);
+		return;
+	}
+
+	if(h->console != conf.console) {
+		if(conf.debug)
+			printf("Wrong console %u not %d\n", h->console, conf.console);
+		return;
+	}
+
+	if(h->type == EGETTY_PING) {
+		console_pong(ifindex, from, h, p, len);
+		return;
+	}
+
+	if(h->type == EGETTY_HUP) {
+		/* a hangup meant for an earlier login session */
+		if(h->session && h->session != conf.session)
+			return;
+		if(pid != -1) kill(pid, 9);
+		return;
+	}
+	
+	if(h->type == EGETTY_LZRESET) {
+		if(!lz || memcmp(conf.client.sll_addr, from->sll_addr, 6))
+			return;
+		/* the client cannot decode what is queued either */
+		txsched_flush(&txs, TXQ_BULK);
+		lz_reset(lz);
+		view_lost();
+		if(conf.debug)
+			printf("compression stream reset\n");
+		return;
+	}
+
+	if(h->type == EGETTY_STATS) {
+		console_stats(ifindex, from, h);
+		return;
+	}
+
+	if(h->type == EGETTY_SNAPSHOT) {
+		if(!view.scr)
+			return;
+		console_client(from, h);
+		view_snapshot();
+		return;
+	}
+
+	if(h->type == EGETTY_FILE) {
+		if(conf.xferdir == -1)
+			return;
+		xfer_msg(ifindex, from, h, p, len);
+		return;
+	}
+
+	if(h->type == EGETTY_REPLAY) {
+		uint64_t want;
+
+		if(len < 4 || !ring.hdr)
+			return;
+		console_client(from, h);
+		want = ((uint64_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		replay.pos = ring.hdr->head > want ? ring.hdr->head - want : 0;
+		replay.active = 1;
+		if(conf.debug)
+			printf("replay %llu bytes\n", (unsigned long long)want);
+		return;
+	}
+
+	if(h->type == EGETTY_WINCH) {
+		struct winsize winp;
+
+		if(h->version == PROTO_V1) {
+			winp.ws_row = p[0];
+			winp.ws_col = p[1];
+		} else {
+			if(len < 4)
+				return;
+			winp.ws_row = (p[0] << 8) | p[1];
+			winp.ws_col = (p[2] << 8) | p[3];
+		}
+		winp.ws_xpixel = 0;
+		winp.ws_ypixel = 0;
+		ioctl(loginfd, TIOCSWINSZ, &winp);
+		rec_resize(rec, winp.ws_col, winp.ws_row);
+		if(view.scr)
+			screen_resize(view.scr, winp.ws_row, winp.ws_col);
+		if(conf.debug)
+			printf("WINCH to %d, %d\n", winp.ws_row, winp.ws_col);
+		return;
+	}
+	
+	if(h->type != EGETTY_IN) {
+		if(conf.debug)
+			printf("Not EGETTY_IN: %d\n", h->type);
+		return;
+	}
+	console_client(from, h);
+	if(conf.debug) printf("Sent %u bytes to child\n", len);
+	console_intr(loginfd, p, len);
+	rec_event(rec, 'i', p, len);
+	write(loginfd, p, len);
+	lastuse = lowlat_now();
+	trace_ev(&trace, TRACE_PTYIN, 0, 0, len);
+	if(stamps.enable) {
+		ptytime = lowlat_now();
+		tstamp_add(&stamps, TSTAMP_INPUT, ptytime - rxtime);
+	}
+}
+
 int main(int argc, char **argv, char **arge)
 {
 	int s;
 	struct sockaddr_ll from;
 	socklen_t fromlen = sizeof(from);
 	int ifindex=-1;
-	uint8_t *buf, *p;
+	uint8_t *buf;
 	ssize_t n;
-	unsigned int len;
-	int count=1;
-	int timeout = -1;
+	struct proto_hdr h;
+	const uint8_t *p;
+	unsigned int off;
+	int count=1, i, resumed;
+	int timeout = -1, tmo, hellotmo;
 	int loginfd = -1;
 	pid_t pid=-1;
 	struct sk_buff *skb;
@@ -251,6 +1233,12 @@ int main(int argc, char **argv, char **arge)
 	conf.debug = 0;
 	conf.device = "eth0";
 	conf.devsocket = -1;
+	conf.ringsize = 1048576;
+	conf.xferdir = -1;
+	conf.resume = -1;
+	conf.argv = argv;
+	xf.fd = -1;
+	lowlat_init(&conf.lowlat);
 	
 	while(--argc > 0) {
 		if(strcmp(argv[argc], "debug")==0) {
@@ -266,46 +1254,205 @@ int main(int argc, char **argv, char **arge)
 			conf.waitif = 1;
 			continue;
 		}
-		if( (strlen(argv[argc]) < 3) && isdigit(*argv[argc])) {
+		if(strcmp(argv[argc], "hardened")==0) {
+			conf.hardened = 1;
+			continue;
+		}
+		if(strncmp(argv[argc], "resume=", 7)==0) {
+			conf.resume = atoi(argv[argc]+7);
+			continue;
+		}
+		if(strcmp(argv[argc], "lazy")==0) {
+			conf.lazy = 1;
+			conf.idle = 900;
+			continue;
+		}
+		if(strncmp(argv[argc], "lazy=", 5)==0) {
+			conf.lazy = 1;
+			conf.idle = atoi(argv[argc]+5);
+			continue;
+		}
+		if(strncmp(argv[argc], "record=", 7)==0) {
+			conf.record = argv[argc]+7;
+			continue;
+		}
+		if(strncmp(argv[argc], "recordsize=", 11)==0) {
+			conf.recordsize = strtoul(argv[argc]+11, NULL, 10);
+			continue;
+		}
+		if(strncmp(argv[argc], "ringlog=", 8)==0) {
+			conf.ringlog = argv[argc]+8;
+			continue;
+		}
+		if(strncmp(argv[argc], "ringsize=", 9)==0) {
+			conf.ringsize = strtoul(argv[argc]+9, NULL, 10);
+			if(!conf.ringsize) {
+				fprintf(stderr, "bad ringsize %s\n", argv[argc]+9);
+				exit(1);
+			}
+			continue;
+		}
+		if(strncmp(argv[argc], "xfer=", 5)==0) {
+			conf.xferdir = open(argv[argc]+5, O_RDONLY|O_DIRECTORY);
+			if(conf.xferdir == -1) {
+				fprintf(stderr, "xfer %s: %s\n", argv[argc]+5, strerror(errno));
+				exit(1);
+			}
+			continue;
+		}
+		if(strncmp(argv[argc], "bundle=", 7)==0) {
+			conf.bundle = atoi(argv[argc]+7);
+			continue;
+		}
+		if(strcmp(argv[argc], "compress")==0) {
+			conf.compress = 256;
+			continue;
+		}
+		if(strncmp(argv[argc], "compress=", 9)==0) {
+			conf.compress = atoi(argv[argc]+9);
+			continue;
+		}
+		if(strcmp(argv[argc], "screen")==0) {
+			conf.screen = 1;
+			continue;
+		}
+		if(strcmp(argv[argc], "vlan")==0) {
+			conf.vlan = 1;
+			continue;
+		}
+		if(strncmp(argv[argc], "vlan=", 5)==0) {
+			conf.vlan = 1;
+			conf.nvlan = vlan_parse(argv[argc]+5, conf.vlans, 64);
+			if(conf.nvlan <= 0) {
+				fprintf(stderr, "bad vlan list %s\n", argv[argc]+5);
+				exit(1);
+			}
+			continue;
+		}
+		if(strncmp(argv[argc], "broker=", 7)==0) {
+			conf.broker = argv[argc]+7;
+			continue;
+		}
+		if(strncmp(argv[argc], "workers=", 8)==0) {
+			conf.workers = atoi(argv[argc]+8);
+			continue;
+		}
+		if(strncmp(argv[argc], "tty=", 4)==0) {
+			if(conf.ntty < 64)
+				conf.ttys[conf.ntty++] = argv[argc]+4;
+			continue;
+		}
+		if(strncmp(argv[argc], "trace=", 6)==0) {
+			conf.trace = argv[argc]+6;
+			continue;
+		}
+		if(strcmp(argv[argc], "timestamp")==0) {
+			stamps.enable = 1;
+			continue;
+		}
+		if(strcmp(argv[argc], "timestamp=hw")==0) {
+			stamps.enable = 1;
+			stamps.hw = 1;
+			continue;
+		}
+		if(strcmp(argv[argc], "lowlat")==0) {
+			conf.lowlat.enable = 1;
+			continue;
+		}
+		if(strncmp(argv[argc], "busypoll=", 9)==0) {
+			conf.lowlat.enable = 1;
+			conf.lowlat.busypoll = atoi(argv[argc]+9);
+			continue;
+		}
+		if(strncmp(argv[argc], "prio=", 5)==0) {
+			conf.lowlat.enable = 1;
+			conf.lowlat.prio = atoi(argv[argc]+5);
+			continue;
+		}
+		if(strncmp(argv[argc], "cpu=", 4)==0) {
+			conf.lowlat.enable = 1;
+			conf.lowlat.cpu = atoi(argv[argc]+4);
+			continue;
+		}
+		if( (strlen(argv[argc]) < 6) && isdigit(*argv[argc])) {
 			conf.console = atoi(argv[argc]);
+			if(conf.console > 65535) {
+				fprintf(stderr, "console number too large\n");
+				exit(1);
+			}
 			continue;
 		}
-		conf.device = argv[argc];
+		/* arguments are read last first: keep devices in given order */
+		if(conf.ndev < IFSET_MAX) {
+			memmove(conf.devices + 1, conf.devices, conf.ndev * sizeof(char *));
+			conf.devices[0] = argv[argc];
+			conf.ndev++;
+		}
 	}
+	if(conf.ndev)
+		conf.device = conf.devices[0];
+	else
+		conf.devices[conf.ndev++] = conf.device;
+
+	if(!conf.trace) {
+		static char path[32];
+
+		snprintf(path, sizeof(path), "/run/egetty-%d.trace", conf.console);
+		conf.trace = path;
+	}
+	trace_signals(trace_handler);
+	atexit(trace_exit);
+	/* a broker has many consoles in threads, it does not upgrade */
+	signal(SIGUSR2, conf.broker || conf.ntty ? SIG_IGN : upgrade_handler);
+	/* scan answer spreading */
+	srandom(lowlat_now() ^ getpid());
 
 	conf.devsocket = devsocket();
 	
 	if(conf.waitif) {
-		/* wait for interface to become available */
-		while(check_flag(conf.device, (IFF_UP | IFF_RUNNING))) {
+		/* wait for an interface to become available */
+		while(1) {
+			for(i=0;i<conf.ndev;i++)
+				if(check_flag(conf.devices[i], (IFF_UP | IFF_RUNNING)) == 0)
+					break;
+			if(i < conf.ndev)
+				break;
 			sleep(1);
 		}
 	} else {
-		/* active interface */
-		while(set_flag(conf.device, (IFF_UP | IFF_RUNNING))) {
-			sleep(1);
+		/* active interfaces */
+		for(i=0;i<conf.ndev;i++) {
+			while(set_flag(conf.devices[i], (IFF_UP | IFF_RUNNING))) {
+				sleep(1);
+			}
 		}
 	}
 	
 	memset(conf.client.sll_addr, 255, 6);
+	conf.clientver = proto_version(PROTO_V1, conf.console);
 	
-	s = socket(PF_PACKET, SOCK_DGRAM, htons(ETH_P_EGETTY));
+	/* on a trunk tagged frames only reach ETH_P_ALL sockets */
+	s = socket(PF_PACKET, SOCK_DGRAM, htons(conf.vlan ? ETH_P_ALL : ETH_P_EGETTY));
 	if(s == -1)
 	{
 		fprintf(stderr, "socket(): %s\n", strerror(errno));
 		exit(1);
 	}
 	
-	if(conf.device)
-	{
-		ifindex = if_nametoindex(conf.device);
-		if(!ifindex)
-		{
-			fprintf(stderr, "Not an interface\n");
+	ifset_init(&conf.ifs);
+	for(i=0;i<conf.ndev;i++) {
+		if(ifset_add(&conf.ifs, conf.devices[i])) {
+			fprintf(stderr, "%s: Not an interface\n", conf.devices[i]);
 			exit(1);
 		}
 	}
-	
+	/* several interfaces: listen on all, frames from others are dropped */
+	ifindex = conf.ifs.dev[0].index;
+	if(conf.ifs.n > 1 && !conf.broker && !conf.ntty)
+		ifindex = 0;
+	conf.client.sll_ifindex = conf.ifs.dev[0].index;
+	if(conf.ifs.n > 1 && ifset_watch(&conf.ifs))
+		fprintf(stderr, "link changes: %s\n", strerror(errno));
 	
 	if(ifindex >= 0)
 	{
@@ -313,7 +1460,7 @@ int main(int argc, char **argv, char **arge)
 		memset(&addr, 0, sizeof(addr));
 		
 		addr.sll_family = AF_PACKET;
-		addr.sll_protocol = htons(ETH_P_EGETTY);
+		addr.sll_protocol = htons(conf.vlan ? ETH_P_ALL : ETH_P_EGETTY);
 		addr.sll_ifindex = ifindex;
 		
 		if(bind(s, (const struct sockaddr *)&addr, sizeof(addr)))
@@ -322,138 +1469,284 @@ int main(int argc, char **argv, char **arge)
 			exit(1);
 		}
 	}
+	if(conf.vlan && vlan_socket(s, conf.vlans, conf.nvlan)) {
+		fprintf(stderr, "vlan: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	lowlat_socket(s, &conf.lowlat);
+	if(!conf.broker && !conf.ntty)
+		tstamp_socket(&stamps, s, conf.device);
+	if(conf.xferdir != -1)
+		xfer_socket(s);
+	lowlat_process(&conf.lowlat);
 	
 	skb = alloc_skb(1500);
+	if(txsched_init(&txs, 1500)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	txs.hold = conf.bundle;
+	if((conf.broker || conf.ntty) && conf.vlan) {
+		fprintf(stderr, "broker mode does not take vlan\n");
+		exit(1);
+	}
+	if(conf.broker || conf.ntty)
+		exit(broker_run(s, conf.ifs.dev[0].index, &txs, conf.broker, conf.ttys, conf.ntty,
+				conf.workers, &conf.lowlat, conf.debug));
+	if(stamps.enable)
+		txs.tstamp = &stamps;
+	if(conf.screen) {
+		view.scr = screen_new(24, 80);
+		if(!view.scr) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	if(conf.compress > 0) {
+		lz = lz_new();
+		if(!lz) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	/* before the recording is opened: it may go on from the old one */
+	resumed = conf.resume != -1 && !console_resume(conf.resume, &s, &pid, &loginfd);
+	if(resumed && conf.debug)
+		printf("resumed pid = %d loginfd = %d\n", pid, loginfd);
+
+	if(conf.record) {
+		if(recpos.start)
+			rec = rec_continue(conf.record, conf.recordsize, &recpos);
+		else
+			rec = rec_open(conf.record, conf.recordsize, 0, 0);
+		if(!rec)
+			fprintf(stderr, "record %s: %s\n", conf.record, strerror(errno));
+		atexit(rec_stop);
+		/* let the writer finish the file when we are told to stop */
+		signal(SIGTERM, terminate_handler);
+	}
+
+	if(conf.ringlog) {
+		if(ringlog_open(&ring, conf.ringlog, conf.ringsize, 0))
+			fprintf(stderr, "ringlog %s: %s\n", conf.ringlog, strerror(errno));
+	}
 
-	skb_reset(skb);
-	skb_reserve(skb, 4);
-	console_hello(s, ifindex, skb);
+	if(conf.hardened)
+		hardened_init();
+
+	if(resumed)
+		;
+	else if(conf.nvlan) {
+		for(i=0;i<conf.nvlan;i++)
+			console_hello(0, conf.vlans[i]);
+	} else
+		console_hello(0, 0);
 	
-	while(count)
+	while(count && !terminate)
 	{
-		struct pollfd fds[2];
+		struct pollfd fds[3];
+
+		if(upgrade) {
+			upgrade = 0;
+			console_upgrade(s, pid, loginfd);
+		}
+		if(replay.active)
+			replay_run(conf.client.sll_ifindex);
+		if(view.scr)
+			view_run(conf.client.sll_ifindex);
+		if(xf.fd >= 0)
+			xfer_run();
+		hellotmo = hello_run();
+		if(txsched_pending(&txs)) {
+			n = txsched_run(&txs, s);
+			trace_ev(&trace, TRACE_SEND, txs.blocked, 0, n);
+		}
 
 		if(pid) {
 			int status;
-			if(waitpid(-1, &status, WNOHANG)>0) {
+			pid_t child;
+			while((child = waitpid(-1, &status, WNOHANG))>0) {
+				if(child == standby.pid) {
+					standby.pid = -1;
+					close(standby.fd);
+					close(standby.go);
+					continue;
+				}
+				if(child != pid)
+					continue;
+				trace_ev(&trace, TRACE_EXIT, 0, status, pid);
 				pid = -1;
+				lz_stats();
 				close(loginfd);
+				loginfd = -1;
 			}
 		}
-		if(pid == -1) {
-			pid = login(&loginfd);
-			if(pid == -1)
-				exit(1);
-			if(conf.debug) {
-				printf("child pid = %d\n", pid);
-				printf("loginfd = %d\n", loginfd);
-			}
+		if(pid == -1 && !conf.lazy)
+			pid = console_spawn(&loginfd);
+		/* lazy: no standby before anyone has attached */
+		if(conf.hardened && standby.pid == -1 && pid != -1) {
+			standby.pid = login(&standby.fd, &standby.go);
+			if(conf.debug && standby.pid != -1)
+				printf("standby pid = %d\n", standby.pid);
 		}
 		
 		fds[0].fd = s;
 		fds[0].events = POLLIN;
 		fds[0].revents = 0;
+		tmo = timeout;
+		if(xf.fd >= 0)
+			tmo = XFER_RTO / 4;
+		if(hellotmo >= 0 && (tmo == -1 || hellotmo < tmo))
+			tmo = hellotmo;
+		if(conf.lazy && conf.idle && pid != -1) {
+			long long now = lowlat_now(), left;
+
+			if(idlehup)
+				left = idlehup + IDLE_GRACE * 1000000000LL - now;
+			else
+				left = lastuse + conf.idle * 1000000000LL - now;
+			if(left <= 0) {
+				/* nobody used it: hang up, the next attach starts a new one */
+				if(conf.debug)
+					printf("login idle, %s pid %d\n", idlehup ? "killing" : "hanging up", pid);
+				kill(pid, idlehup ? SIGKILL : SIGHUP);
+				idlehup = now;
+				left = IDLE_GRACE * 1000000000LL;
+			}
+			if(tmo == -1 || left / 1000000 < tmo)
+				tmo = left / 1000000 + 1;
+		}
+		if(txs.due) {
+			/* bundle waiting to fill up */
+			if(tmo == -1 || txsched_timeout(&txs) < tmo)
+				tmo = txsched_timeout(&txs);
+		} else if(txsched_pending(&txs)) {
+			/* device queue full: POLLOUT would not wait for it */
+			if(txs.blocked == ENOBUFS)
+				tmo = 1;
+			else
+				fds[0].events |= POLLOUT;
+		}
+		/* queue drained: screen changes are due */
+		if(view.lag && !txs.q[TXQ_BULK].count)
+			tmo = 0;
 		
-		fds[1].fd = loginfd;
+		/*
+		 * no free buffers: leave output in the pty until the queues drain,
+		 * or let the screen model take it
+		 */
+		fds[1].fd = (view.scr || txsched_avail(&txs, TXQ_BULK)) ? loginfd : -1;
 		fds[1].events = POLLIN;
 		fds[1].revents = 0;
+		fds[2].fd = conf.ifs.nl;
+		fds[2].events = POLLIN;
+		fds[2].revents = 0;
 
-		n = poll(fds, 2, timeout);
-		if(n == 0) {
+		n = poll(fds, 3, tmo);
+		trace_ev(&trace, TRACE_POLL, n, (fds[0].revents & 0xff) << 8 | (fds[1].revents & 0xff), tmo);
+		if(n == -1)
+			continue;
+		if(n == 0 && tmo == timeout) {
 			printf("timeout\n");
 			exit(1);
 		}
 
 		if(fds[1].revents & POLLIN) {
+			static uint8_t skipbuf[1500];
+			struct sk_buff *oskb;
+
 			if(conf.debug) printf("POLLIN child\n");
-			skb_reset(skb);
-			skb_reserve(skb, 4);
-			buf = skb_put(skb, 0);
-			n = read(loginfd, buf, skb_tailroom(skb));
+			/* only the screen model reads with the queue full */
+			oskb = txsched_avail(&txs, TXQ_BULK) ? txsched_alloc(&txs, TXQ_BULK) : NULL;
+			if(oskb) {
+				skb_reserve(oskb, PROTO_HDRMAX);
+				buf = skb_put(oskb, 0);
+				n = read(loginfd, buf, skb_tailroom(oskb) - 1);
+			} else {
+				buf = skipbuf;
+				n = read(loginfd, buf, sizeof(skipbuf) - 1);
+			}
 			if(n == -1) {
 				fprintf(stderr, "read() failed\n");
 				exit(1);
 			}
 			
 			buf[n] = 0;
+			trace_ev(&trace, TRACE_PTYOUT, 0, 0, n);
 			if(conf.debug)
-				printf("child: %d bytes\n", n);
-			skb_put(skb, n);
-			console_put(s, ifindex, skb);
+				printf("child: %d bytes\n", (int)n);
+			if(ptytime) {
+				tstamp_add(&stamps, TSTAMP_PTY, lowlat_now() - ptytime);
+				ptytime = 0;
+			}
+			lastuse = lowlat_now();
+			if(spawntime) {
+				/* time to prompt of the new login */
+				trace_ev(&trace, TRACE_PROMPT, 0, 0, (lastuse - spawntime) / 1000);
+				if(stamps.enable)
+					tstamp_add(&stamps, TSTAMP_PROMPT, lastuse - spawntime);
+				if(conf.debug)
+					printf("login output after %lld usecs\n", (lastuse - spawntime) / 1000);
+				spawntime = 0;
+			}
+			rec_event(rec, 'o', buf, n);
+			ringlog_write(&ring, buf, n);
+			if(view.scr && (!oskb || view.lag || view.len)) {
+				/* behind: the model keeps up, the client gets a diff later */
+				view_skip(buf, n);
+				if(oskb)
+					txsched_free(&txs, oskb);
+			} else {
+				if(view.scr)
+					screen_feed(view.scr, buf, n);
+				skb_put(oskb, n);
+				if(replay.active)
+					txsched_free(&txs, oskb);
+				else
+					console_put(conf.client.sll_ifindex, oskb);
+			}
+		}
+		if((fds[2].revents & POLLIN) && ifset_update(&conf.ifs)) {
+			/* the client's link died: output goes out on another */
+			i = ifset_pick(&conf.ifs, conf.client.sll_ifindex);
+			if(i != conf.client.sll_ifindex)
+				console_move(i, 1);
 		}
-		if(fds[0].revents) {
+		if(fds[0].revents & POLLERR)
+			tstamp_errqueue(&stamps, s);
+		if(fds[0].revents & POLLIN) {
 			skb_reset(skb);
 			buf = skb_put(skb, 0);
-			n = recvfrom(s, buf, skb_tailroom(skb), 0, (struct sockaddr *)&from, &fromlen);
+			n = tstamp_recv(&stamps, s, buf, skb_tailroom(skb), 0, (struct sockaddr *)&from, &fromlen,
+					conf.vlan ? &rxvlan : NULL);
 			if(n == -1) {
+				if(errno == EAGAIN)
+					continue;
 				fprintf(stderr, "recvfrom() failed. ifconfig up?\n");
 				exit(1);
 			}
 
 			skb_put(skb, n);
+			if(stamps.enable)
+				rxtime = lowlat_now();
 			if(conf.debug) printf("received packet %d bytes\n", skb->len);
 			
-			if(ntohs(from.sll_protocol) == ETH_P_EGETTY) {
+			/* unicast for other hosts reaches us on flooding switches */
+			if(ntohs(from.sll_protocol) == ETH_P_EGETTY &&
+			   from.sll_pkttype != PACKET_OTHERHOST &&
+			   ifset_find(&conf.ifs, from.sll_ifindex) >= 0) {
 				if(conf.debug)
 					printf("Received EGETTY\n");
 				
-				p = skb->data;
-				if(*p == EGETTY_HUP) {
-					if(pid != -1) kill(pid, 9);
-					continue;
-				}
-				
-				if(*p == EGETTY_SCAN) {
-					skb_reset(skb);
-					skb_reserve(skb, 4);
-					console_hello(s, ifindex, skb);
-					continue;
-				}
-				
-				if(*p == EGETTY_WINCH) {
-					p++;
-					if(*p != conf.console) {
-						if(conf.debug)
-							printf("Wrong console %d not %d\n", *p, conf.console);
-						continue;
-					}
-					p++;
-					{
-						struct winsize winp;
-						winp.ws_row = *p++;
-						winp.ws_col = *p++;
-						winp.ws_xpixel = 0;
-						winp.ws_ypixel = 0;
-						ioctl(loginfd, TIOCSWINSZ, &winp);
-						if(conf.debug)
-							printf("WINCH to %d, %d\n", winp.ws_row, winp.ws_col);
-					}
-					continue;
-				}
-				
-				if(*p != EGETTY_IN) {
-					if(conf.debug)
-						printf("Not EGETTY_IN: %d\n", *p);
-					continue;
-				}
-				p++;
-				if(*p != conf.console) {
-					if(conf.debug)
-						printf("Wrong console %d not %d\n", *p, conf.console);
-					continue;
-				}
-				memcpy(conf.client.sll_addr, from.sll_addr, 6);
-				p++;
-				len = *p++ << 8;
-				len += *p;
-				if(len > n) {
-					printf("Length field too long: %d\n", len);
-					continue;
+				off = 0;
+				while((p = proto_next(skb->data, skb->len, &off, &h))) {
+					if(pid == -1 && console_attach(&h))
+						pid = console_spawn(&loginfd);
+					console_msg(from.sll_ifindex, &from, &h, p + h.hlen, h.len - h.hlen, pid, loginfd);
 				}
-				skb_trim(skb, len);
-				skb_pull(skb, 4);
-				if(conf.debug) printf("Sent %d bytes to child\n", skb->len);
-				write(loginfd, skb->data, skb->len);
 				continue;
 			}
 		}
@@ -3,7 +3,9 @@
 
 #define ETH_P_EGETTY 0x6811
 
-enum { EGETTY_SCAN=0, EGETTY_KMSG, EGETTY_HUP, EGETTY_HELLO, EGETTY_IN, EGETTY_OUT, EGETTY_WINCH };
+enum { EGETTY_SCAN=0, EGETTY_KMSG, EGETTY_HUP, EGETTY_HELLO, EGETTY_IN, EGETTY_OUT, EGETTY_WINCH,
+       EGETTY_PING, EGETTY_PONG, EGETTY_REPLAY, EGETTY_FILE, EGETTY_BUNDLE,
+       EGETTY_LZRESET, EGETTY_SNAPSHOT, EGETTY_STATS };
 
 /*
  Format of packet:
@@ -14,6 +16,27 @@ enum { EGETTY_SCAN=0, EGETTY_KMSG, EGETTY_HUP, EGETTY_HELLO, EGETTY_IN, EGETTY_O
 
  uint8_t data[];
 
+ This is version 1 of the header. Version 2, with 16 bit console
+ numbers, is described in proto.h.
+
+ EGETTY_REPLAY asks for console history. data is a 32 bit big endian
+ byte count. History is sent as EGETTY_OUT and live output follows it.
+
+ EGETTY_FILE carries file transfer messages, see xfer.h.
+
+ EGETTY_BUNDLE (version 2 only) holds several messages, see proto.h.
+
+ EGETTY_LZRESET asks egetty to start a new compression stream, see lz.h.
+
+ EGETTY_SNAPSHOT asks egetty, when it keeps a screen model, to redraw
+ the whole screen as EGETTY_OUT. Sent by a client that attaches.
+
+ EGETTY_STATS asks egetty for its latency histograms, see tstamp.h.
+ The reply is an EGETTY_STATS with a text table.
+
+ EGETTY_PING data is opaque to egetty and returned unchanged in an
+ EGETTY_PONG to the sender. The pty is never involved.
+
  */
 
 #endif
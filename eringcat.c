@@ -0,0 +1,48 @@
+/*
+ * File: eringcat.c
+ * Implements: print console history from an egetty ring file
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "ringlog.h"
+
+int main(int argc, char **argv)
+{
+	struct ringlog rl;
+	struct iovec iov[2];
+	uint64_t pos, head;
+	ssize_t n;
+	int cnt;
+
+	if(argc < 2) {
+		printf("eringcat FILE [BYTES]\n");
+		exit(2);
+	}
+	if(ringlog_open(&rl, argv[1], 0, 1)) {
+		fprintf(stderr, "%s: not a ring file: %s\n", argv[1], strerror(errno));
+		exit(1);
+	}
+
+	head = rl.hdr->head;
+	pos = ringlog_start(&rl);
+	if(argc > 2 && head - pos > strtoull(argv[2], NULL, 10))
+		pos = head - strtoull(argv[2], NULL, 10);
+
+	/* write straight from the mapping */
+	while((cnt = ringlog_iov(&rl, pos, head - pos, iov)) > 0) {
+		n = writev(1, iov, cnt);
+		if(n <= 0) exit(1);
+		pos += n;
+	}
+	ringlog_close(&rl);
+	return 0;
+}
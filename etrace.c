@@ -0,0 +1,117 @@
+/*
+ * File: etrace.c
+ * Implements: print an egetty flight recorder dump as a timeline
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "egetty.h"
+#include "trace.h"
+
+static const char *msgnames[] = {
+	"SCAN", "KMSG", "HUP", "HELLO", "IN", "OUT", "WINCH", "PING", "PONG",
+	"REPLAY", "FILE", "BUNDLE", "LZRESET", "SNAPSHOT", "STATS"
+};
+
+static void trace_print(const struct trace_ev *e)
+{
+	switch(e->type) {
+	case TRACE_POLL:
+		printf("poll     ready=%d socket=%#x pty=%#x timeout=%d\n",
+		       (int8_t)e->a, e->b >> 8, e->b & 0xff, (int)e->c);
+		break;
+	case TRACE_RX:
+		if(e->a < sizeof(msgnames) / sizeof(msgnames[0]))
+			printf("rx       %s", msgnames[e->a]);
+		else
+			printf("rx       type=%u", e->a);
+		printf(" console=%u len=%u\n", e->b, e->c);
+		break;
+	case TRACE_PTYIN:
+		printf("pty in   %u bytes\n", e->c);
+		break;
+	case TRACE_PTYOUT:
+		printf("pty out  %u bytes\n", e->c);
+		break;
+	case TRACE_SEND:
+		printf("send     %u messages%s%s\n", e->c, e->a ? ", stopped: " : "",
+		       e->a ? strerror(e->a) : "");
+		break;
+	case TRACE_SPAWN:
+		printf("spawn    pid %u\n", e->c);
+		break;
+	case TRACE_EXIT:
+		printf("exit     pid %u status %#x\n", e->c, e->b);
+		break;
+	case TRACE_CLIENT:
+		printf("client   %02x:%02x:%02x:%02x:%02x:%02x version %u\n",
+		       e->b >> 8, e->b & 0xff, e->c >> 24, (e->c >> 16) & 0xff,
+		       (e->c >> 8) & 0xff, e->c & 0xff, e->a);
+		break;
+	case TRACE_FLUSH:
+		printf("flush    %u messages dropped\n", e->c);
+		break;
+	case TRACE_DUMP:
+		if(e->a)
+			printf("dump     on signal %u (%s)\n", e->a, strsignal(e->a));
+		else
+			printf("dump     on exit\n");
+		break;
+	case TRACE_IFACE:
+		printf("iface    %u -> %u, %s\n", e->b, e->c,
+		       e->a ? "link lost" : "client moved");
+		break;
+	case TRACE_PROMPT:
+		printf("prompt   %u usecs after spawn\n", e->c);
+		break;
+	default:
+		printf("type %u  %u %u %u\n", e->type, e->a, e->b, e->c);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_hdr hdr;
+	struct trace_ev e;
+	uint64_t prev = 0, wall;
+	unsigned int i;
+	time_t sec;
+	struct tm tm;
+	char stamp[32];
+	FILE *f;
+
+	if(argc < 2) {
+		printf("etrace FILE\n");
+		exit(2);
+	}
+	f = fopen(argv[1], "r");
+	if(!f) {
+		perror(argv[1]);
+		exit(1);
+	}
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		exit(1);
+	}
+	printf("pid %u, %u events\n", hdr.pid, hdr.count);
+	for(i = 0; i < hdr.count && fread(&e, sizeof(e), 1, f) == 1; i++) {
+		wall = e.ns + hdr.realtime;
+		sec = wall / 1000000000ULL;
+		localtime_r(&sec, &tm);
+		strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+		/* gaps stand out in the delta column */
+		printf("%s.%06u %+10.3f ms  ", stamp, (unsigned int)(wall % 1000000000ULL / 1000),
+		       prev ? (e.ns - prev) / 1e6 : 0.0);
+		prev = e.ns;
+		trace_print(&e);
+	}
+	fclose(f);
+	return 0;
+}
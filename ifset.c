@@ -0,0 +1,120 @@
+/*
+ * File: ifset.c
+ * Implements: set of interfaces with link state
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ifset.h"
+
+#define LINK_UP (IFF_UP|IFF_RUNNING)
+
+void ifset_init(struct ifset *set)
+{
+	memset(set, 0, sizeof(struct ifset));
+	set->nl = -1;
+}
+
+int ifset_add(struct ifset *set, const char *name)
+{
+	int index;
+
+	if(set->n == IFSET_MAX)
+		return -1;
+	index = if_nametoindex(name);
+	if(!index)
+		return -1;
+	if(ifset_find(set, index) >= 0)
+		return 0;
+	set->dev[set->n].index = index;
+	strncpy(set->dev[set->n].name, name, IF_NAMESIZE - 1);
+	set->dev[set->n].up = 1;
+	set->n++;
+	return 0;
+}
+
+int ifset_find(const struct ifset *set, int ifindex)
+{
+	int i;
+
+	for(i=0;i<set->n;i++)
+		if(set->dev[i].index == ifindex)
+			return i;
+	return -1;
+}
+
+int ifset_watch(struct ifset *set)
+{
+	struct sockaddr_nl addr;
+	struct ifreq ifr;
+	int i, fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	for(i=0;fd != -1 && i<set->n;i++) {
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, set->dev[i].name);
+		if(ioctl(fd, SIOCGIFFLAGS, &ifr) == 0)
+			set->dev[i].up = (ifr.ifr_flags & LINK_UP) == LINK_UP;
+	}
+	if(fd != -1)
+		close(fd);
+
+	set->nl = socket(AF_NETLINK, SOCK_RAW|SOCK_NONBLOCK|SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(set->nl == -1)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+	if(bind(set->nl, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(set->nl);
+		set->nl = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int ifset_update(struct ifset *set)
+{
+	char buf[8192];
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	int n, i, up, changed = 0;
+
+	while((n = recv(set->nl, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for(nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+			if(nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+				continue;
+			ifi = NLMSG_DATA(nh);
+			i = ifset_find(set, ifi->ifi_index);
+			if(i < 0)
+				continue;
+			up = nh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & LINK_UP) == LINK_UP;
+			if(up != set->dev[i].up) {
+				set->dev[i].up = up;
+				changed++;
+			}
+		}
+	}
+	return changed;
+}
+
+int ifset_pick(const struct ifset *set, int ifindex)
+{
+	int i = ifset_find(set, ifindex);
+
+	if(i >= 0 && set->dev[i].up)
+		return ifindex;
+	for(i=0;i<set->n;i++)
+		if(set->dev[i].up)
+			return set->dev[i].index;
+	return ifindex;
+}
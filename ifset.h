@@ -0,0 +1,44 @@
+#ifndef IFSET_H
+#define IFSET_H
+
+#include <net/if.h>
+
+/*
+ * The interfaces egetty is reachable through, and which of them have
+ * link. Link changes come from a rtnetlink socket, so a dead port is
+ * noticed in the same poll loop that serves the console.
+ */
+
+#define IFSET_MAX 8
+
+struct ifset {
+	int n;
+	struct {
+		int index;
+		char name[IF_NAMESIZE];
+		int up; /* IFF_UP and IFF_RUNNING */
+	} dev[IFSET_MAX];
+	int nl; /* rtnetlink socket, -1 until ifset_watch() */
+};
+
+void ifset_init(struct ifset *set);
+
+/* add interface by name. -1 if there is no such interface or no room */
+int ifset_add(struct ifset *set, const char *name);
+
+/* position of 'ifindex' in the set, -1 if not there */
+int ifset_find(const struct ifset *set, int ifindex);
+
+/* read link state of all interfaces and start listening for changes */
+int ifset_watch(struct ifset *set);
+
+/* read pending link changes. Returns number of interfaces that changed */
+int ifset_update(struct ifset *set);
+
+/*
+ * Interface to use instead of 'ifindex': itself if it has link, else
+ * the first one in the set that has. 'ifindex' if none has.
+ */
+int ifset_pick(const struct ifset *set, int ifindex);
+
+#endif
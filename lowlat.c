@@ -0,0 +1,124 @@
+/*
+ * File: lowlat.c
+ * Implements: low-latency socket and scheduling settings
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netpacket/packet.h>
+#include <sched.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "lowlat.h"
+
+#ifndef PACKET_QDISC_BYPASS
+#define PACKET_QDISC_BYPASS 20
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+static cpu_set_t lowlat_saved; /* affinity before lowlat_process() */
+static int lowlat_pinned;
+
+void lowlat_init(struct lowlat *ll)
+{
+	memset(ll, 0, sizeof(struct lowlat));
+	ll->busypoll = 50;
+	ll->cpu = -1;
+}
+
+int lowlat_socket(int s, const struct lowlat *ll)
+{
+	int one = 1, rc = 0;
+
+	if(!ll->enable) return 0;
+	
+	/* frames go straight to the driver, skipping the qdisc layer */
+	if(setsockopt(s, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one))) {
+		fprintf(stderr, "PACKET_QDISC_BYPASS: %s\n", strerror(errno));
+		rc = -1;
+	}
+	if(ll->busypoll > 0) {
+		if(setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &ll->busypoll, sizeof(ll->busypoll))) {
+			fprintf(stderr, "SO_BUSY_POLL: %s\n", strerror(errno));
+			rc = -1;
+		}
+	}
+	return rc;
+}
+
+int lowlat_process(const struct lowlat *ll)
+{
+	int rc = 0;
+
+	if(!ll->enable) return 0;
+
+	if(ll->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(ll->cpu, &set);
+		lowlat_pinned = !sched_getaffinity(0, sizeof(lowlat_saved), &lowlat_saved);
+		if(sched_setaffinity(0, sizeof(set), &set)) {
+			fprintf(stderr, "sched_setaffinity: %s\n", strerror(errno));
+			lowlat_pinned = 0;
+			rc = -1;
+		}
+	}
+	if(ll->prio > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = ll->prio;
+		/*
+		 * children (login, shell) must not inherit realtime priority,
+		 * nor the cpu pin: see lowlat_child()
+		 */
+		if(sched_setscheduler(0, SCHED_FIFO|SCHED_RESET_ON_FORK, &param)) {
+			fprintf(stderr, "sched_setscheduler: %s\n", strerror(errno));
+			rc = -1;
+		}
+	}
+	return rc;
+}
+
+int lowlat_child(void)
+{
+	if(!lowlat_pinned) return 0;
+	return sched_setaffinity(0, sizeof(lowlat_saved), &lowlat_saved);
+}
+
+int lowlat_thread(const struct lowlat *ll, int index)
+{
+	cpu_set_t set;
+	long n;
+
+	if(!ll->enable || ll->cpu < 0) return 0;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+		n = 1;
+	CPU_ZERO(&set);
+	CPU_SET((ll->cpu + index) % n, &set);
+	/* pid 0 is the calling thread, not the whole process */
+	if(sched_setaffinity(0, sizeof(set), &set)) {
+		fprintf(stderr, "sched_setaffinity: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+long long lowlat_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,43 @@
+#ifndef LOWLAT_H
+#define LOWLAT_H
+
+/*
+ * Low-latency interactive mode.
+ * Socket side: PACKET_QDISC_BYPASS and SO_BUSY_POLL.
+ * Process side: optional SCHED_FIFO priority and CPU affinity.
+ */
+
+struct lowlat {
+	int enable;
+	int busypoll; /* usecs to busy poll, 0 to leave default */
+	int prio; /* SCHED_FIFO priority, 0 to keep normal scheduling */
+	int cpu; /* cpu to pin to, -1 for no affinity */
+};
+
+void lowlat_init(struct lowlat *ll);
+
+/* apply socket options to packet socket 's' */
+int lowlat_socket(int s, const struct lowlat *ll);
+
+/* apply scheduling policy and affinity to calling process */
+int lowlat_process(const struct lowlat *ll);
+
+/* in a forked child: undo the cpu pin of lowlat_process() */
+int lowlat_child(void);
+
+/* pin the calling thread to the 'index'th cpu from ll->cpu on */
+int lowlat_thread(const struct lowlat *ll, int index);
+
+/*
+ * Echo probe payload carried in EGETTY_PING/EGETTY_PONG.
+ * Sender fills it in, egetty returns it untouched.
+ */
+struct lowlat_probe {
+	unsigned int seq;
+	long long stamp; /* lowlat_now() at send */
+};
+
+/* current CLOCK_MONOTONIC time in nanoseconds */
+long long lowlat_now(void);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * File: lz.c
+ * Implements: streaming LZ77 compression of console output
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz.h"
+
+#define MINMATCH 4
+#define MAXDIST 65535
+
+static long long lz_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned int lz_hash(const unsigned char *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+	return (v * 2654435761U) >> (32 - LZ_HBITS);
+}
+
+struct lz *lz_new(void)
+{
+	struct lz *z;
+
+	z = malloc(sizeof(struct lz));
+	if(!z)
+		return NULL;
+	memset(z, 0, sizeof(struct lz));
+	return z;
+}
+
+void lz_reset(struct lz *z)
+{
+	z->pos = 0;
+	z->len = 0;
+	memset(z->hash, 0, sizeof(z->hash));
+}
+
+/* make room for 'n' more bytes, keeping at least MAXDIST bytes of history */
+static void lz_slide(struct lz *z, unsigned int n)
+{
+	unsigned int shift, i;
+
+	if(z->len + n <= sizeof(z->buf))
+		return;
+	shift = z->len - MAXDIST;
+	memmove(z->buf, z->buf + shift, MAXDIST);
+	z->len = MAXDIST;
+	for(i=0;i<(1 << LZ_HBITS);i++)
+		z->hash[i] = z->hash[i] > shift ? z->hash[i] - shift : 0;
+}
+
+/* write a count that did not fit in the token */
+static int lz_count(unsigned char *out, unsigned int *op, unsigned int max, unsigned int v)
+{
+	while(v >= 255) {
+		if(*op >= max) return -1;
+		out[(*op)++] = 255;
+		v -= 255;
+	}
+	if(*op >= max) return -1;
+	out[(*op)++] = v;
+	return 0;
+}
+
+/* literals lit..lit+nlit, then match of 'mlen' at 'dist' unless mlen is 0 */
+static int lz_seq(unsigned char *out, unsigned int *op, unsigned int max,
+		  const unsigned char *lit, unsigned int nlit, unsigned int dist, unsigned int mlen)
+{
+	unsigned int ml = mlen ? mlen - MINMATCH : 0;
+
+	if(*op >= max) return -1;
+	out[(*op)++] = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+	if(nlit >= 15 && lz_count(out, op, max, nlit - 15))
+		return -1;
+	if(max - *op < nlit) return -1;
+	memcpy(out + *op, lit, nlit);
+	*op += nlit;
+	if(!mlen)
+		return 0;
+	if(max - *op < 2) return -1;
+	out[(*op)++] = dist & 0xff;
+	out[(*op)++] = dist >> 8;
+	if(ml >= 15 && lz_count(out, op, max, ml - 15))
+		return -1;
+	return 0;
+}
+
+/* greedy parse of the new bytes at buf[len..] against everything before */
+static int lz_compress(struct lz *z, const unsigned char *in, unsigned int n,
+		       unsigned char *out, unsigned int max)
+{
+	unsigned char *b = z->buf;
+	unsigned int ip, anchor, end, ref, mlen, h, op = 0;
+
+	lz_slide(z, n);
+	memcpy(b + z->len, in, n);
+	ip = anchor = z->len;
+	end = z->len + n;
+
+	while(ip + MINMATCH <= end) {
+		h = lz_hash(b + ip);
+		ref = z->hash[h];
+		z->hash[h] = ip + 1;
+		if(!ref || ip - (ref - 1) > MAXDIST || memcmp(b + ref - 1, b + ip, MINMATCH)) {
+			ip++;
+			continue;
+		}
+		ref--;
+		mlen = MINMATCH;
+		while(ip + mlen < end && b[ref + mlen] == b[ip + mlen])
+			mlen++;
+		if(lz_seq(out, &op, max, b + anchor, ip - anchor, ip - ref, mlen))
+			return -1;
+		/* index the matched bytes too: output repeats a lot */
+		for(h = ip + 1; h < ip + mlen && h + MINMATCH <= end; h++)
+			z->hash[lz_hash(b + h)] = h + 1;
+		ip += mlen;
+		anchor = ip;
+	}
+	if(lz_seq(out, &op, max, b + anchor, end - anchor, 0, 0))
+		return -1;
+	z->len = end;
+	z->pos += n;
+	return op;
+}
+
+static int lz_decompress(struct lz *z, const unsigned char *in, unsigned int n,
+			 const unsigned char **out)
+{
+	unsigned char *b;
+	unsigned int ip = 0, op, start, limit, nlit, mlen, dist, v;
+
+	lz_slide(z, LZ_MAXMSG);
+	b = z->buf;
+	start = op = z->len;
+	limit = start + LZ_MAXMSG;
+
+	while(ip < n) {
+		v = in[ip++];
+		nlit = v >> 4;
+		mlen = v & 15;
+		if(nlit == 15) {
+			do {
+				if(ip >= n) return -1;
+				v = in[ip++];
+				nlit += v;
+			} while(v == 255);
+		}
+		if(nlit > n - ip || nlit > limit - op)
+			return -1;
+		memcpy(b + op, in + ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if(ip == n)
+			break;
+		if(n - ip < 2)
+			return -1;
+		dist = in[ip] | (in[ip+1] << 8);
+		ip += 2;
+		if(mlen == 15) {
+			do {
+				if(ip >= n) return -1;
+				v = in[ip++];
+				mlen += v;
+			} while(v == 255);
+		}
+		mlen += MINMATCH;
+		if(!dist || dist > op || mlen > limit - op)
+			return -1;
+		if(dist >= mlen) {
+			memcpy(b + op, b + op - dist, mlen);
+			op += mlen;
+			continue;
+		}
+		/* byte by byte: the match overlaps what it produces */
+		while(mlen--) {
+			b[op] = b[op - dist];
+			op++;
+		}
+	}
+	*out = b + start;
+	z->len = op;
+	z->pos += op - start;
+	return op - start;
+}
+
+int lz_msg_encode(struct lz *z, const unsigned char *in, unsigned int n,
+		  unsigned char *out, unsigned int max)
+{
+	long long t = lz_now();
+	int rc;
+
+	if(n > LZ_MAXMSG || n <= LZ_MSGHDR + 1 || max <= LZ_MSGHDR + 1)
+		return -1;
+	/* restart long before pos could wrap to 0 */
+	if(z->pos >= 0x80000000U)
+		lz_reset(z);
+	out[0] = z->pos >> 24;
+	out[1] = z->pos >> 16;
+	out[2] = z->pos >> 8;
+	out[3] = z->pos;
+	max -= LZ_MSGHDR;
+	if(max >= n - LZ_MSGHDR) max = n - LZ_MSGHDR - 1;
+	rc = lz_compress(z, in, n, out + LZ_MSGHDR, max);
+	if(rc == -1)
+		lz_reset(z);
+	else {
+		rc += LZ_MSGHDR;
+		z->in += n;
+		z->out += rc;
+		z->msgs++;
+	}
+	z->ns += lz_now() - t;
+	return rc;
+}
+
+int lz_msg_decode(struct lz *z, const unsigned char *in, unsigned int n,
+		  const unsigned char **out)
+{
+	long long t = lz_now();
+	uint32_t pos;
+	int rc = -1;
+
+	if(n >= LZ_MSGHDR) {
+		pos = ((uint32_t)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+		if(pos == 0) {
+			lz_reset(z);
+			z->broken = 0;
+		}
+		if(!z->broken && pos == z->pos)
+			rc = lz_decompress(z, in + LZ_MSGHDR, n - LZ_MSGHDR, out);
+	}
+	if(rc >= 0) {
+		z->in += rc;
+		z->out += n;
+		z->msgs++;
+	} else {
+		/* our request or the reply may be lost too: ask again after a while */
+		if(z->broken && t - z->asked < 10000000LL)
+			rc = -2;
+		else
+			z->asked = t;
+		z->broken = 1;
+	}
+	z->ns += lz_now() - t;
+	return rc;
+}
+
+int lz_output(struct lz **zp, int compressed, const unsigned char **data, unsigned int *len)
+{
+	int n;
+
+	if(!compressed)
+		return *len;
+	if(!*zp && !(*zp = lz_new()))
+		return -2;
+	n = lz_msg_decode(*zp, *data, *len, data);
+	if(n >= 0)
+		*len = n;
+	return n;
+}
@@ -0,0 +1,71 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/*
+ * Streaming LZ77 codec for console output.
+ * Each message is compressed as a block that may refer back into the
+ * output of earlier messages of the same stream, up to 64 KiB back, so
+ * repeated prompts and log prefixes cost a few bytes each.
+ *
+ * Block format: a row of sequences, each
+ *  uint8_t token;      literal count << 4 | match length - 4
+ *  [count bytes]       if literal count is 15: add bytes until one is not 255
+ *  uint8_t literals[];
+ *  uint16_t offset;    little endian, distance back to the match
+ *  [length bytes]      if match length - 4 is 15: as for the literal count
+ * The last sequence of a block ends after its literals.
+ *
+ * Message format (EGETTY_OUT with PROTO_F_LZ set):
+ *  uint32_t pos;       stream position of the first byte, big endian
+ *  uint8_t block[];
+ * pos 0 starts a new stream. A receiver that misses a message cannot
+ * decode the rest of the stream and asks for a new one with EGETTY_LZRESET.
+ */
+
+#define LZ_WINDOW 65536
+#define LZ_MAXMSG 2048 /* largest message before compression */
+#define LZ_HBITS 12
+#define LZ_MSGHDR 4
+
+struct lz {
+	uint32_t pos; /* stream position of the next byte */
+	unsigned int len; /* bytes of history in buf */
+	int broken; /* decoder: missed a message, waiting for pos 0 */
+	long long asked; /* decoder: when we last asked for a reset */
+	unsigned long long in, out; /* bytes before and after compression */
+	unsigned long long msgs;
+	unsigned long long ns; /* time spent in the codec */
+	uint32_t hash[1 << LZ_HBITS]; /* encoder: buf offset + 1 per hash */
+	unsigned char buf[2 * LZ_WINDOW];
+};
+
+struct lz *lz_new(void);
+
+/* forget history. Next message starts a new stream */
+void lz_reset(struct lz *z);
+
+/*
+ * Compress 'n' bytes into message 'out'. Returns message size, or -1 if
+ * it would not be smaller than 'n' bytes or 'max'. On -1 the stream is
+ * reset and the data should be sent as is.
+ */
+int lz_msg_encode(struct lz *z, const unsigned char *in, unsigned int n,
+		  unsigned char *out, unsigned int max);
+
+/*
+ * Decompress message. Returns length of data at *out (valid until the
+ * next call), -1 if the stream cannot be decoded and a reset should be
+ * requested, -2 if a reset was asked for recently.
+ */
+int lz_msg_decode(struct lz *z, const unsigned char *in, unsigned int n,
+		  const unsigned char **out);
+
+/*
+ * Clear data of a received console message, decompressed if 'compressed'.
+ * Allocates decoder *zp on first use. Returns as lz_msg_decode().
+ */
+int lz_output(struct lz **zp, int compressed, const unsigned char **data, unsigned int *len);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * File: proto.c
+ * Implements: egetty frame header, version 1 and 2
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <string.h>
+
+#include "egetty.h"
+#include "proto.h"
+
+static unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v & 0xff;
+}
+
+int proto_parse(const unsigned char *p, unsigned int n, struct proto_hdr *h)
+{
+	memset(h, 0, sizeof(struct proto_hdr));
+	if(n < 2)
+		return -1;
+
+	if(!(p[0] & EGETTY_V2)) {
+		h->version = PROTO_V1;
+		h->type = p[0];
+		h->console = p[1];
+		if(h->type == EGETTY_WINCH) {
+			/* rows and columns sit where the length should be */
+			if(n < 4)
+				return -1;
+			h->hlen = 2;
+			h->len = 4;
+			return 0;
+		}
+		if(n < 4 || get16(p + 2) < 4) {
+			/* HUP and SCAN may be sent without length */
+			h->hlen = h->len = n < 4 ? n : 4;
+			return 0;
+		}
+		h->hlen = 4;
+		h->len = get16(p + 2);
+		return h->len > n ? -1 : 0;
+	}
+
+	if(n < PROTO_HDR2)
+		return -1;
+	h->type = p[0] & ~EGETTY_V2;
+	h->flags = p[1];
+	h->console = get16(p + 2);
+	h->len = get16(p + 4);
+	h->hlen = p[6];
+	h->version = p[7];
+	h->session = get32(p + 8);
+	if(h->version < PROTO_V2 || h->hlen < PROTO_HDR2 || h->hlen > h->len || h->len > n)
+		return -1;
+	h->ext = p + PROTO_HDR2;
+	h->extlen = h->hlen - PROTO_HDR2;
+	return 0;
+}
+
+int proto_pull(struct sk_buff *skb, struct proto_hdr *h)
+{
+	if(proto_parse(skb->data, skb->len, h))
+		return -1;
+	skb_trim(skb, h->len);
+	skb_pull(skb, h->hlen);
+	return 0;
+}
+
+int proto_flags = PROTO_F_BUNDLE;
+
+void proto_push(struct sk_buff *skb, int version, int type, unsigned int console, uint32_t session)
+{
+	proto_push_flags(skb, version, type, console, session, proto_flags);
+}
+
+void proto_push_flags(struct sk_buff *skb, int version, int type, unsigned int console,
+		      uint32_t session, int flags)
+{
+	unsigned char *p;
+
+	if(version < PROTO_V2) {
+		p = skb_push(skb, PROTO_HDR1);
+		p[0] = type;
+		p[1] = console;
+		put16(p + 2, skb->len);
+		return;
+	}
+	p = skb_push(skb, PROTO_HDR2);
+	p[0] = type | EGETTY_V2;
+	p[1] = flags;
+	put16(p + 2, console);
+	put16(p + 4, skb->len);
+	p[6] = PROTO_HDR2;
+	p[7] = PROTO_V2;
+	put32(p + 8, session);
+}
+
+int proto_version(int version, unsigned int console)
+{
+	return console > 255 ? PROTO_V2 : version;
+}
+
+void proto_winch(struct sk_buff *skb, int version, unsigned int console, uint32_t session,
+		 unsigned int rows, unsigned int cols)
+{
+	unsigned char *p;
+
+	if(version < PROTO_V2) {
+		p = skb_push(skb, 2);
+		p[0] = EGETTY_WINCH;
+		p[1] = console;
+		p = skb_put(skb, 6);
+		p[0] = rows > 255 ? 255 : rows;
+		p[1] = cols > 255 ? 255 : cols;
+		memset(p + 2, 0, 4);
+		return;
+	}
+	p = skb_put(skb, 4);
+	put16(p, rows);
+	put16(p + 2, cols);
+	proto_push(skb, version, EGETTY_WINCH, console, session);
+}
+
+void proto_put_caps(struct sk_buff *skb, unsigned int console, uint32_t session)
+{
+	unsigned char *p = skb_put(skb, PROTO_CAPS);
+
+	p[0] = PROTO_V2;
+	p[1] = proto_flags;
+	put16(p + 2, console);
+	put32(p + 4, session);
+}
+
+void proto_put_spread(struct sk_buff *skb, unsigned int ms)
+{
+	put16(skb_put(skb, 2), ms > 0xffff ? 0xffff : ms);
+}
+
+unsigned int proto_spread(const struct proto_hdr *h, const unsigned char *data)
+{
+	if(h->len - h->hlen < PROTO_CAPS + 2 || data[0] < PROTO_V2)
+		return 0;
+	return get16(data + PROTO_CAPS);
+}
+
+int proto_caps(const struct proto_hdr *h, const unsigned char *data, unsigned int *console,
+	       uint32_t *session, int *flags)
+{
+	if(h->len - h->hlen < PROTO_CAPS || data[0] < PROTO_V2) {
+		if(console) *console = h->console;
+		if(session) *session = h->session;
+		if(flags) *flags = h->flags;
+		return h->version;
+	}
+	if(console) *console = get16(data + 2);
+	if(session) *session = get32(data + 4);
+	if(flags) *flags = data[1];
+	return data[0] > PROTO_V2 ? PROTO_V2 : data[0];
+}
+
+void proto_bundle_hdr(unsigned char *p, unsigned int len)
+{
+	p[0] = EGETTY_BUNDLE | EGETTY_V2;
+	p[1] = PROTO_F_BUNDLE;
+	put16(p + 2, 0);
+	put16(p + 4, PROTO_HDR2 + len);
+	p[6] = PROTO_HDR2;
+	p[7] = PROTO_V2;
+	put32(p + 8, 0);
+}
+
+int proto_bundle_add(struct sk_buff *bundle, const unsigned char *msg, unsigned int len)
+{
+	if(PROTO_HDR2 + bundle->len + len > PROTO_MTU || skb_tailroom(bundle) < (int)len)
+		return -1;
+	memcpy(skb_put(bundle, len), msg, len);
+	return 0;
+}
+
+void proto_bundle_close(struct sk_buff *bundle)
+{
+	proto_bundle_hdr(skb_push(bundle, PROTO_HDR2), bundle->len);
+}
+
+const unsigned char *proto_next(const unsigned char *frame, unsigned int n, unsigned int *off,
+				struct proto_hdr *h)
+{
+	struct proto_hdr b;
+	const unsigned char *msg;
+
+	if(proto_parse(frame, n, &b))
+		return NULL;
+	if(b.type != EGETTY_BUNDLE) {
+		if(*off)
+			return NULL;
+		*off = b.len;
+		memcpy(h, &b, sizeof(b));
+		return frame;
+	}
+	if(*off < b.hlen)
+		*off = b.hlen;
+	if(*off >= b.len)
+		return NULL;
+	msg = frame + *off;
+	if(proto_parse(msg, b.len - *off, h))
+		return NULL;
+	if(h->version < PROTO_V2 || h->type == EGETTY_BUNDLE)
+		return NULL;
+	*off += h->len;
+	return msg;
+}
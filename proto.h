@@ -0,0 +1,135 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+#include "skbuff.h"
+
+/*
+ * Frame header codec shared by egetty and econsole.
+ *
+ * Version 1 is the 4 byte header in egetty.h. Version 2:
+ *  uint8_t type | EGETTY_V2;
+ *  uint8_t flags;
+ *  uint16_t console;
+ *  uint16_t len;      whole frame, header included
+ *  uint8_t hlen;      header length including extensions
+ *  uint8_t version;   2
+ *  uint32_t session;  login session of the console, 0 if not known
+ *  uint8_t ext[hlen - 12];  extensions: uint8_t type, uint8_t len, data[len]
+ *  uint8_t data[];
+ * All fields big endian. Unknown extensions are skipped. Version 1 peers
+ * do not know the types with EGETTY_V2 set and drop the frame.
+ *
+ * EGETTY_WINCH data is uint8_t rows, cols in version 1 (in place of the
+ * length field) and uint16_t rows, cols in version 2.
+ *
+ * Negotiation: SCAN and HELLO carry capabilities as data:
+ *  uint8_t version;   highest version the sender speaks
+ *  uint8_t flags;
+ *  uint16_t console;
+ *  uint32_t session;
+ * egetty answers SCAN with a version 1 HELLO (version 2 if the console
+ * number does not fit in 8 bits), which old clients read as before.
+ * The HELLO goes to the scanner only. SCAN capabilities may be followed by
+ *  uint16_t spread;   ms over which to spread answers, picked at random
+ * so the answers of a large segment do not all arrive at once.
+ * A peer is sent version 2 frames once it has announced version 2 or
+ * sent a version 2 frame.
+ *
+ * Flag PROTO_F_BUNDLE in a version 2 header or in capabilities says the
+ * sender can take EGETTY_BUNDLE. A bundle is a version 2 frame, console
+ * and session 0, whose data is a row of complete version 2 messages.
+ * The len field of each message header says where the next one starts.
+ * Messages in a bundle may be of any type and for any console on the
+ * receiving host. Bundles do not nest.
+ *
+ * Flag PROTO_F_LZ from a client says it can decode compressed output.
+ * On EGETTY_OUT it says the data is compressed, see lz.h. egetty only
+ * compresses for a client that set the flag in its last version 2 frame.
+ */
+
+#define EGETTY_V2 0x80
+
+#define PROTO_V1 1
+#define PROTO_V2 2
+
+#define PROTO_HDR1 4
+#define PROTO_HDR2 12
+#define PROTO_HDRMAX PROTO_HDR2 /* headroom for any header */
+#define PROTO_CAPS 8
+#define PROTO_MTU 1500 /* largest frame we send */
+
+#define PROTO_F_BUNDLE 0x01
+#define PROTO_F_LZ 0x02
+
+/* flags we send in version 2 headers and capabilities */
+extern int proto_flags;
+
+struct proto_hdr {
+	int type; /* without EGETTY_V2 */
+	int version;
+	int flags;
+	unsigned int console;
+	unsigned int len; /* whole frame */
+	unsigned int hlen; /* data starts here */
+	uint32_t session;
+	const unsigned char *ext;
+	unsigned int extlen;
+};
+
+/* parse header of frame 'p' of 'n' bytes. Returns 0 if valid */
+int proto_parse(const unsigned char *p, unsigned int n, struct proto_hdr *h);
+
+/* parse header and leave only the data in skb */
+int proto_pull(struct sk_buff *skb, struct proto_hdr *h);
+
+/* prepend header. skb must have PROTO_HDRMAX bytes headroom */
+void proto_push(struct sk_buff *skb, int version, int type, unsigned int console, uint32_t session);
+void proto_push_flags(struct sk_buff *skb, int version, int type, unsigned int console,
+		      uint32_t session, int flags);
+
+/* version to use for a console: v1 cannot address consoles above 255 */
+int proto_version(int version, unsigned int console);
+
+/* build WINCH in skb, which must be empty with PROTO_HDRMAX headroom */
+void proto_winch(struct sk_buff *skb, int version, unsigned int console, uint32_t session,
+		 unsigned int rows, unsigned int cols);
+
+/* append capabilities for SCAN/HELLO */
+void proto_put_caps(struct sk_buff *skb, unsigned int console, uint32_t session);
+
+/* append answer spread window to SCAN capabilities */
+void proto_put_spread(struct sk_buff *skb, unsigned int ms);
+
+/* answer spread window of SCAN data, 0 if none */
+unsigned int proto_spread(const struct proto_hdr *h, const unsigned char *data);
+
+/*
+ * Read capabilities from SCAN/HELLO data. Returns version the peer
+ * speaks, 1 if the frame carries none.
+ */
+int proto_caps(const struct proto_hdr *h, const unsigned char *data, unsigned int *console,
+	       uint32_t *session, int *flags);
+
+/* write header of a bundle with 'len' bytes of messages to p */
+void proto_bundle_hdr(unsigned char *p, unsigned int len);
+
+/*
+ * Append complete message to bundle skb, which must have PROTO_HDRMAX
+ * headroom. Returns -1 if the frame would grow past PROTO_MTU.
+ */
+int proto_bundle_add(struct sk_buff *bundle, const unsigned char *msg, unsigned int len);
+
+/* prepend bundle header to messages added */
+void proto_bundle_close(struct sk_buff *bundle);
+
+/*
+ * Step through the messages of a received frame: the frame itself, or
+ * each message in it if it is a bundle. Start with *off = 0.
+ * Returns the next message, with its header in h, or NULL at the end.
+ */
+const unsigned char *proto_next(const unsigned char *frame, unsigned int n, unsigned int *off,
+				struct proto_hdr *h);
+
+#endif
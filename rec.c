@@ -0,0 +1,395 @@
+/*
+ * File: rec.c
+ * Implements: asciicast recording with asynchronous writer
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "rec.h"
+
+#define REC_BUFSIZE 65536
+
+struct rec_ev {
+	long long t; /* nsecs since session start */
+	unsigned int len;
+	char type;
+};
+
+struct rec_buf {
+	unsigned char *data;
+	unsigned int len;
+};
+
+/* UTF-8 sequence cut off at the end of an event */
+struct rec_utf8 {
+	unsigned char part[4];
+	unsigned int len;
+};
+
+struct rec {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rec_buf buf[2];
+	int active; /* buffer events are added to */
+	int busy; /* writer owns the other buffer */
+	int quit;
+	
+	char *path;
+	unsigned long maxsize;
+	int width, height;
+	long long start;
+	
+	/* writer state */
+	FILE *f;
+	unsigned long size;
+	long long fstart;
+	int seq;
+	struct rec_utf8 utf8[2]; /* of the last 'o' and 'i' event */
+
+	unsigned long dropped;
+};
+
+static long long rec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int rec_file(struct rec *r, long long t)
+{
+	int n;
+	
+	r->f = fopen(r->path, "w");
+	if(!r->f) return -1;
+	r->fstart = t;
+	n = fprintf(r->f, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld}\n",
+		    r->width, r->height, (long)time(0));
+	r->size = n > 0 ? n : 0;
+	return 0;
+}
+
+static void rec_rotate(struct rec *r, long long t)
+{
+	char *name;
+
+	fclose(r->f);
+	r->f = NULL;
+	name = malloc(strlen(r->path) + 16);
+	if(name) {
+		sprintf(name, "%s.%d", r->path, ++r->seq);
+		rename(r->path, name);
+		free(name);
+	}
+	rec_file(r, t);
+}
+
+int rec_utf8(const unsigned char *p, unsigned int len)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	unsigned int i, n;
+
+	if(p[0] < 0xc2 || p[0] > 0xf4)
+		return 0;
+	n = p[0] < 0xe0 ? 2 : p[0] < 0xf0 ? 3 : 4;
+	/* no overlongs, surrogates or code points past U+10FFFF */
+	if(p[0] == 0xe0) lo = 0xa0;
+	if(p[0] == 0xed) hi = 0x9f;
+	if(p[0] == 0xf0) lo = 0x90;
+	if(p[0] == 0xf4) hi = 0x8f;
+	for(i=1;i<n;i++) {
+		if(i == len)
+			return -1;
+		if(p[i] < lo || p[i] > hi)
+			return 0;
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	return n;
+}
+
+/*
+ * asciicast wants valid UTF-8. Invalid bytes become U+FFFD. A sequence
+ * split over two reads is held back and written with the next event of
+ * the same type.
+ */
+static void rec_string(struct rec *r, char type, const unsigned char *data, unsigned int len)
+{
+	struct rec_utf8 *u = NULL;
+	unsigned char seq[4];
+	unsigned int i = 0, n = 0;
+	int k;
+
+	if(type == 'o' || type == 'i') {
+		u = &r->utf8[type == 'i'];
+		n = u->len;
+	}
+	putc('"', r->f);
+	if(n) {
+		memcpy(seq, u->part, n);
+		while(n < 4 && i < len)
+			seq[n++] = data[i++];
+		k = rec_utf8(seq, n);
+		if(k == -1) {
+			memcpy(u->part, seq, n);
+			u->len = n;
+			i = len;
+		} else {
+			i -= n - (k ? k : u->len);
+			if(k) {
+				fwrite(seq, 1, k, r->f);
+				r->size += k;
+			} else {
+				fputs("\\ufffd", r->f);
+				r->size += 6;
+			}
+			u->len = 0;
+		}
+	}
+	for(;i<len;i++) {
+		if(data[i] == '"' || data[i] == '\\') {
+			putc('\\', r->f);
+			putc(data[i], r->f);
+			r->size += 2;
+			continue;
+		}
+		if(data[i] < 0x20 || data[i] == 0x7f) {
+			fprintf(r->f, "\\u%04x", data[i]);
+			r->size += 6;
+			continue;
+		}
+		if(data[i] >= 0x80) {
+			k = rec_utf8(data + i, len - i);
+			if(k == -1 && u) {
+				memcpy(u->part, data + i, len - i);
+				u->len = len - i;
+				break;
+			}
+			if(k <= 0) {
+				fputs("\\ufffd", r->f);
+				r->size += 6;
+				continue;
+			}
+			fwrite(data + i, 1, k, r->f);
+			r->size += k;
+			i += k - 1;
+			continue;
+		}
+		putc(data[i], r->f);
+		r->size++;
+	}
+	putc('"', r->f);
+	r->size += 2;
+}
+
+static void rec_write(struct rec *r, struct rec_buf *b)
+{
+	struct rec_ev ev;
+	unsigned int pos = 0;
+	long long t;
+	int n;
+
+	while(pos < b->len) {
+		memcpy(&ev, b->data + pos, sizeof(ev));
+		pos += sizeof(ev);
+		if(r->f && r->maxsize && r->size >= r->maxsize)
+			rec_rotate(r, ev.t);
+		if(!r->f) {
+			pos += ev.len;
+			continue;
+		}
+		t = ev.t - r->fstart;
+		n = fprintf(r->f, "[%lld.%06lld, \"%c\", ", t / 1000000000LL, (t / 1000) % 1000000, ev.type);
+		r->size += n > 0 ? n : 0;
+		rec_string(r, ev.type, b->data + pos, ev.len);
+		fputs("]\n", r->f);
+		r->size += 2;
+		pos += ev.len;
+	}
+	b->len = 0;
+	if(r->f) fflush(r->f);
+}
+
+static void *rec_thread(void *arg)
+{
+	struct rec *r = arg;
+	struct rec_buf *b;
+	struct timespec ts;
+
+	pthread_mutex_lock(&r->lock);
+	while(1) {
+		while(!r->busy && !r->quit) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 200000000;
+			if(ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			if(pthread_cond_timedwait(&r->cond, &r->lock, &ts) == ETIMEDOUT &&
+			   r->buf[r->active].len) {
+				r->active ^= 1;
+				r->busy = 1;
+			}
+		}
+		if(!r->busy) {
+			/* quit: write what is left */
+			if(!r->buf[r->active].len)
+				break;
+			r->active ^= 1;
+			r->busy = 1;
+		}
+		b = &r->buf[!r->active];
+		pthread_mutex_unlock(&r->lock);
+		
+		rec_write(r, b);
+
+		pthread_mutex_lock(&r->lock);
+		r->busy = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static struct rec *rec_start(const char *path, unsigned long maxsize, int width, int height,
+			     const struct rec_pos *pos)
+{
+	struct rec *r;
+
+	r = malloc(sizeof(struct rec));
+	if(!r) return NULL;
+	memset(r, 0, sizeof(struct rec));
+	r->path = strdup(path);
+	r->buf[0].data = malloc(REC_BUFSIZE);
+	r->buf[1].data = malloc(REC_BUFSIZE);
+	if(!r->path || !r->buf[0].data || !r->buf[1].data)
+		goto fail;
+	r->maxsize = maxsize;
+	r->width = width ? width : 80;
+	r->height = height ? height : 24;
+	r->start = rec_now();
+	if(pos) {
+		/* times go on from the first process, on the same clock */
+		r->start = pos->start;
+		r->seq = pos->seq;
+		r->f = fopen(r->path, "a");
+		if(r->f && fseek(r->f, 0, SEEK_END) == 0 && ftell(r->f) > 0) {
+			r->fstart = pos->fstart;
+			r->size = ftell(r->f);
+		} else {
+			if(r->f)
+				fclose(r->f);
+			r->f = NULL;
+		}
+	}
+	if(!r->f && rec_file(r, pos ? rec_now() - r->start : 0))
+		goto fail;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if(pthread_create(&r->thread, NULL, rec_thread, r)) {
+		fclose(r->f);
+		goto fail;
+	}
+	return r;
+fail:
+	free(r->path);
+	free(r->buf[0].data);
+	free(r->buf[1].data);
+	free(r);
+	return NULL;
+}
+
+struct rec *rec_open(const char *path, unsigned long maxsize, int width, int height)
+{
+	return rec_start(path, maxsize, width, height, NULL);
+}
+
+struct rec *rec_continue(const char *path, unsigned long maxsize, const struct rec_pos *pos)
+{
+	return rec_start(path, maxsize, 0, 0, pos);
+}
+
+int rec_event(struct rec *r, char type, const unsigned char *data, unsigned int len)
+{
+	struct rec_ev ev;
+	struct rec_buf *b;
+
+	if(!r) return 0;
+	
+	ev.t = rec_now() - r->start;
+	ev.len = len;
+	ev.type = type;
+	if(sizeof(ev) + len > REC_BUFSIZE)
+		len = ev.len = REC_BUFSIZE - sizeof(ev);
+
+	pthread_mutex_lock(&r->lock);
+	b = &r->buf[r->active];
+	if(b->len + sizeof(ev) + len > REC_BUFSIZE) {
+		if(r->busy) {
+			r->dropped++;
+			pthread_mutex_unlock(&r->lock);
+			return -1;
+		}
+		r->active ^= 1;
+		r->busy = 1;
+		pthread_cond_signal(&r->cond);
+		b = &r->buf[r->active];
+	}
+	memcpy(b->data + b->len, &ev, sizeof(ev));
+	memcpy(b->data + b->len + sizeof(ev), data, len);
+	b->len += sizeof(ev) + len;
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
+
+int rec_resize(struct rec *r, int width, int height)
+{
+	char size[32];
+
+	if(!r) return 0;
+	
+	snprintf(size, sizeof(size), "%dx%d", width, height);
+	return rec_event(r, 'r', (unsigned char *)size, strlen(size));
+}
+
+unsigned long rec_detach(struct rec *r, struct rec_pos *pos)
+{
+	unsigned long dropped;
+
+	if(!r) return 0;
+	
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	if(pos) {
+		pos->start = r->start;
+		pos->fstart = r->fstart;
+		pos->seq = r->seq;
+	}
+
+	if(r->f) fclose(r->f);
+	dropped = r->dropped;
+	free(r->path);
+	free(r->buf[0].data);
+	free(r->buf[1].data);
+	free(r);
+	return dropped;
+}
+
+unsigned long rec_close(struct rec *r)
+{
+	return rec_detach(r, NULL);
+}
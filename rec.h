@@ -0,0 +1,40 @@
+#ifndef REC_H
+#define REC_H
+
+/*
+ * Session recording in asciicast v2 format.
+ * Events are appended to an in-memory buffer and written to disk by a
+ * background thread, so a slow disk never delays the caller. If both
+ * buffers are full the event is dropped and counted.
+ * When a file grows past 'maxsize' it is renamed to <path>.<n> and a new
+ * file is started.
+ */
+
+struct rec;
+
+/* where a recording stands, for another process to continue it */
+struct rec_pos {
+	long long start; /* CLOCK_MONOTONIC ns of the recording start */
+	long long fstart; /* ns after start that the current file begins */
+	int seq; /* last rotated file number */
+};
+
+struct rec *rec_open(const char *path, unsigned long maxsize, int width, int height);
+
+/* append to the recording that rec_detach() left at 'pos' */
+struct rec *rec_continue(const char *path, unsigned long maxsize, const struct rec_pos *pos);
+
+/* type is 'o' for output or 'i' for input */
+int rec_event(struct rec *r, char type, const unsigned char *data, unsigned int len);
+int rec_resize(struct rec *r, int width, int height);
+
+/* length of the UTF-8 sequence at p, 0 if invalid, -1 if cut off at len */
+int rec_utf8(const unsigned char *p, unsigned int len);
+
+/* flush everything and stop writer. Returns number of dropped events */
+unsigned long rec_close(struct rec *r);
+
+/* rec_close() that also tells where the recording stands */
+unsigned long rec_detach(struct rec *r, struct rec_pos *pos);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * File: ringlog.c
+ * Implements: memory-mapped ring file for console history
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ringlog.h"
+
+int ringlog_open(struct ringlog *rl, const char *path, uint64_t size, int readonly)
+{
+	struct stat st;
+	void *map;
+	int init = 0;
+
+	memset(rl, 0, sizeof(struct ringlog));
+	rl->fd = -1;
+	if(!readonly && !size) {
+		errno = EINVAL;
+		return -1;
+	}
+	rl->fd = open(path, readonly ? O_RDONLY : O_RDWR|O_CREAT, 0600);
+	if(rl->fd == -1)
+		return -1;
+	if(fstat(rl->fd, &st))
+		goto fail;
+
+	if(readonly) {
+		if(st.st_size < sizeof(struct ringlog_hdr))
+			goto fail;
+		rl->maplen = st.st_size;
+	} else {
+		rl->maplen = sizeof(struct ringlog_hdr) + size;
+		if(st.st_size != rl->maplen) {
+			if(ftruncate(rl->fd, rl->maplen))
+				goto fail;
+			init = 1;
+		}
+	}
+
+	map = mmap(NULL, rl->maplen, readonly ? PROT_READ : PROT_READ|PROT_WRITE,
+		   MAP_SHARED, rl->fd, 0);
+	if(map == MAP_FAILED)
+		goto fail;
+	rl->hdr = map;
+	rl->data = (unsigned char *)map + sizeof(struct ringlog_hdr);
+
+	if(!readonly && (init || memcmp(rl->hdr->magic, RINGLOG_MAGIC, 8) || rl->hdr->size != size)) {
+		memset(rl->hdr, 0, sizeof(struct ringlog_hdr));
+		rl->hdr->size = size;
+		memcpy(rl->hdr->magic, RINGLOG_MAGIC, 8);
+	}
+	/* a size of 0 would divide by zero in the readers */
+	if(memcmp(rl->hdr->magic, RINGLOG_MAGIC, 8) || !rl->hdr->size ||
+	   rl->hdr->size != rl->maplen - sizeof(struct ringlog_hdr)) {
+		munmap(map, rl->maplen);
+		errno = EINVAL;
+		goto fail;
+	}
+	return 0;
+fail:
+	close(rl->fd);
+	rl->fd = -1;
+	rl->hdr = NULL;
+	return -1;
+}
+
+void ringlog_close(struct ringlog *rl)
+{
+	if(!rl->hdr) return;
+	munmap(rl->hdr, rl->maplen);
+	close(rl->fd);
+	rl->hdr = NULL;
+	rl->fd = -1;
+}
+
+void ringlog_write(struct ringlog *rl, const void *buf, size_t len)
+{
+	uint64_t head, off;
+	size_t n;
+
+	if(!rl->hdr) return;
+
+	head = rl->hdr->head;
+	if(len > rl->hdr->size) {
+		buf = (const unsigned char *)buf + (len - rl->hdr->size);
+		head += len - rl->hdr->size;
+		len = rl->hdr->size;
+	}
+	off = head % rl->hdr->size;
+	n = rl->hdr->size - off;
+	if(n > len) n = len;
+	memcpy(rl->data + off, buf, n);
+	memcpy(rl->data, (const unsigned char *)buf + n, len - n);
+
+	/* data must be in place before a reader can see the new head */
+	__atomic_store_n(&rl->hdr->head, head + len, __ATOMIC_RELEASE);
+}
+
+uint64_t ringlog_start(const struct ringlog *rl)
+{
+	uint64_t head = __atomic_load_n(&rl->hdr->head, __ATOMIC_ACQUIRE);
+
+	return head > rl->hdr->size ? head - rl->hdr->size : 0;
+}
+
+int ringlog_iov(const struct ringlog *rl, uint64_t pos, size_t len, struct iovec *iov)
+{
+	uint64_t head = __atomic_load_n(&rl->hdr->head, __ATOMIC_ACQUIRE);
+	uint64_t off;
+	size_t n;
+
+	if(pos < ringlog_start(rl))
+		pos = ringlog_start(rl);
+	if(pos >= head)
+		return 0;
+	if(len > head - pos)
+		len = head - pos;
+
+	off = pos % rl->hdr->size;
+	n = rl->hdr->size - off;
+	if(n >= len) {
+		iov[0].iov_base = rl->data + off;
+		iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_base = rl->data + off;
+	iov[0].iov_len = n;
+	iov[1].iov_base = rl->data;
+	iov[1].iov_len = len - n;
+	return 2;
+}
@@ -0,0 +1,44 @@
+#ifndef RINGLOG_H
+#define RINGLOG_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Console history in a memory-mapped ring file.
+ * The file survives a crash or restart of the writer; a new writer
+ * continues where the old one stopped. Readers map the same file and
+ * get the data in place, without read().
+ */
+
+#define RINGLOG_MAGIC "EGRING1"
+
+struct ringlog_hdr {
+	char magic[8];
+	uint64_t size; /* size of data area */
+	uint64_t head; /* total number of bytes ever written */
+};
+
+struct ringlog {
+	int fd;
+	size_t maplen;
+	struct ringlog_hdr *hdr;
+	unsigned char *data;
+};
+
+/* size is ignored when opening readonly, else it must not be 0 */
+int ringlog_open(struct ringlog *rl, const char *path, uint64_t size, int readonly);
+void ringlog_close(struct ringlog *rl);
+
+void ringlog_write(struct ringlog *rl, const void *buf, size_t len);
+
+/* absolute position of oldest byte still in the ring */
+uint64_t ringlog_start(const struct ringlog *rl);
+
+/*
+ * Fill iov with at most 'len' bytes starting at absolute position 'pos'.
+ * Returns number of iovecs used (0-2).
+ */
+int ringlog_iov(const struct ringlog *rl, uint64_t pos, size_t len, struct iovec *iov);
+
+#endif
@@ -0,0 +1,888 @@
+/*
+ * File: screen.c
+ * Implements: terminal screen model with diff rendering
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "screen.h"
+
+enum { S_GROUND, S_ESC, S_CSI, S_STR, S_STRESC, S_CHARSET, S_SKIP };
+
+#define SCREEN_RAW 0x80000000 /* byte that was not valid UTF-8 */
+
+#define DEFMODES (SCREEN_M_AUTOWRAP|SCREEN_M_CURSOR)
+
+static struct screen_cell *cell(struct screen *s, int y, int x)
+{
+	return s->buf[s->alt] + y * s->cols + x;
+}
+
+static int wide(uint32_t ch)
+{
+	return (ch >= 0x1100 && ch <= 0x115f) ||
+		(ch >= 0x2e80 && ch <= 0xa4cf && ch != 0x303f) ||
+		(ch >= 0xac00 && ch <= 0xd7a3) ||
+		(ch >= 0xf900 && ch <= 0xfaff) ||
+		(ch >= 0xfe30 && ch <= 0xfe4f) ||
+		(ch >= 0xff00 && ch <= 0xff60) ||
+		(ch >= 0xffe0 && ch <= 0xffe6) ||
+		(ch >= 0x1f300 && ch <= 0x1f64f) ||
+		(ch >= 0x1f900 && ch <= 0x1f9ff) ||
+		(ch >= 0x20000 && ch <= 0x3fffd);
+}
+
+/* erase with the current background, as xterm does */
+static void blank(struct screen *s, struct screen_cell *c, int n)
+{
+	while(n-- > 0) {
+		c->ch = ' ';
+		c->attr = 0;
+		c->fg = 0;
+		c->bg = s->cur.pen.bg;
+		c++;
+	}
+}
+
+static void erase(struct screen *s, int y, int x0, int x1)
+{
+	if(x0 < 0) x0 = 0;
+	if(x1 > s->cols) x1 = s->cols;
+	if(x0 < x1)
+		blank(s, cell(s, y, x0), x1 - x0);
+}
+
+static void scroll_up(struct screen *s, int top, int bottom, int n)
+{
+	int rows = bottom - top + 1;
+
+	if(n > rows) n = rows;
+	memmove(cell(s, top, 0), cell(s, top + n, 0),
+		(rows - n) * s->cols * sizeof(struct screen_cell));
+	blank(s, cell(s, bottom - n + 1, 0), n * s->cols);
+}
+
+static void scroll_down(struct screen *s, int top, int bottom, int n)
+{
+	int rows = bottom - top + 1;
+
+	if(n > rows) n = rows;
+	memmove(cell(s, top + n, 0), cell(s, top, 0),
+		(rows - n) * s->cols * sizeof(struct screen_cell));
+	blank(s, cell(s, top, 0), n * s->cols);
+}
+
+static void linefeed(struct screen *s)
+{
+	if(s->cur.y == s->bottom)
+		scroll_up(s, s->top, s->bottom, 1);
+	else if(s->cur.y < s->rows - 1)
+		s->cur.y++;
+}
+
+static void moveto(struct screen *s, int x, int y)
+{
+	int top = 0, bottom = s->rows - 1;
+
+	if(s->modes & SCREEN_M_ORIGIN) {
+		top = s->top;
+		bottom = s->bottom;
+		y += top;
+	}
+	s->cur.x = x < 0 ? 0 : x >= s->cols ? s->cols - 1 : x;
+	s->cur.y = y < top ? top : y > bottom ? bottom : y;
+	s->wrapnext = 0;
+}
+
+static void set_alt(struct screen *s, int alt, int clear)
+{
+	if(s->alt == alt)
+		return;
+	s->alt = alt;
+	if(clear)
+		blank(s, s->buf[alt], s->rows * s->cols);
+}
+
+static void insert_chars(struct screen *s, int n)
+{
+	struct screen_cell *c = cell(s, s->cur.y, s->cur.x);
+	int left = s->cols - s->cur.x;
+
+	if(n > left) n = left;
+	memmove(c + n, c, (left - n) * sizeof(struct screen_cell));
+	blank(s, c, n);
+}
+
+static void delete_chars(struct screen *s, int n)
+{
+	struct screen_cell *c = cell(s, s->cur.y, s->cur.x);
+	int left = s->cols - s->cur.x;
+
+	if(n > left) n = left;
+	memmove(c, c + n, (left - n) * sizeof(struct screen_cell));
+	blank(s, c + left - n, n);
+}
+
+static void print(struct screen *s, uint32_t ch)
+{
+	struct screen_cell *c;
+	int w = wide(ch) ? 2 : 1;
+
+	if(s->wrapnext || (w == 2 && s->cur.x == s->cols - 1 && (s->modes & SCREEN_M_AUTOWRAP))) {
+		s->wrapnext = 0;
+		if(s->modes & SCREEN_M_AUTOWRAP) {
+			s->cur.x = 0;
+			linefeed(s);
+		}
+	}
+	if(w > s->cols - s->cur.x)
+		w = 1;
+	if(s->modes & SCREEN_M_INSERT)
+		insert_chars(s, w);
+
+	c = cell(s, s->cur.y, s->cur.x);
+	/* overwriting half of a wide character blanks the other half */
+	if(c->ch == 0 && s->cur.x > 0)
+		c[-1].ch = ' ';
+	if(s->cur.x + w < s->cols && c[w].ch == 0)
+		c[w].ch = ' ';
+
+	*c = s->cur.pen;
+	c->ch = ch;
+	if(s->cur.charset[s->cur.gl] && ch >= 0x5f && ch <= 0x7e)
+		c->attr |= SCREEN_A_ACS;
+	if(w == 2) {
+		c[1] = s->cur.pen;
+		c[1].ch = 0;
+	}
+	if(s->cur.x + w >= s->cols) {
+		s->cur.x = s->cols - 1;
+		s->wrapnext = (s->modes & SCREEN_M_AUTOWRAP) != 0;
+	} else
+		s->cur.x += w;
+}
+
+static int param(struct screen *s, int i, int def)
+{
+	return i < s->nparam && s->param[i] > 0 ? s->param[i] : def;
+}
+
+static uint32_t sgr_color(struct screen *s, int *i)
+{
+	int n = *i;
+
+	if(n + 2 < s->nparam && s->param[n+1] == 5) {
+		*i += 2;
+		return SCREEN_C_INDEX | (s->param[n+2] & 0xff);
+	}
+	if(n + 4 < s->nparam && s->param[n+1] == 2) {
+		*i += 4;
+		return SCREEN_C_RGB | ((s->param[n+2] & 0xff) << 16) |
+			((s->param[n+3] & 0xff) << 8) | (s->param[n+4] & 0xff);
+	}
+	*i = s->nparam;
+	return 0;
+}
+
+static void sgr(struct screen *s)
+{
+	struct screen_cell *pen = &s->cur.pen;
+	int i, p;
+
+	for(i=0;i<s->nparam;i++) {
+		p = s->param[i];
+		switch(p) {
+		case 0: pen->attr = 0; pen->fg = pen->bg = 0; break;
+		case 1: pen->attr |= SCREEN_A_BOLD; break;
+		case 2: pen->attr |= SCREEN_A_DIM; break;
+		case 3: pen->attr |= SCREEN_A_ITALIC; break;
+		case 4: pen->attr |= SCREEN_A_UNDERLINE; break;
+		case 5: pen->attr |= SCREEN_A_BLINK; break;
+		case 7: pen->attr |= SCREEN_A_REVERSE; break;
+		case 8: pen->attr |= SCREEN_A_INVISIBLE; break;
+		case 9: pen->attr |= SCREEN_A_STRIKE; break;
+		case 22: pen->attr &= ~(SCREEN_A_BOLD|SCREEN_A_DIM); break;
+		case 23: pen->attr &= ~SCREEN_A_ITALIC; break;
+		case 24: pen->attr &= ~SCREEN_A_UNDERLINE; break;
+		case 25: pen->attr &= ~SCREEN_A_BLINK; break;
+		case 27: pen->attr &= ~SCREEN_A_REVERSE; break;
+		case 28: pen->attr &= ~SCREEN_A_INVISIBLE; break;
+		case 29: pen->attr &= ~SCREEN_A_STRIKE; break;
+		case 38: pen->fg = sgr_color(s, &i); break;
+		case 39: pen->fg = 0; break;
+		case 48: pen->bg = sgr_color(s, &i); break;
+		case 49: pen->bg = 0; break;
+		default:
+			if(p >= 30 && p <= 37) pen->fg = SCREEN_C_INDEX | (p - 30);
+			else if(p >= 40 && p <= 47) pen->bg = SCREEN_C_INDEX | (p - 40);
+			else if(p >= 90 && p <= 97) pen->fg = SCREEN_C_INDEX | (p - 90 + 8);
+			else if(p >= 100 && p <= 107) pen->bg = SCREEN_C_INDEX | (p - 100 + 8);
+		}
+	}
+}
+
+static void modes(struct screen *s, int set)
+{
+	int i, bit;
+
+	for(i=0;i<s->nparam;i++) {
+		if(!s->priv) {
+			if(s->param[i] == 4)
+				s->modes = set ? s->modes | SCREEN_M_INSERT : s->modes & ~SCREEN_M_INSERT;
+			continue;
+		}
+		if(s->priv != '?')
+			continue;
+		bit = 0;
+		switch(s->param[i]) {
+		case 1: bit = SCREEN_M_CURSORKEYS; break;
+		case 6: bit = SCREEN_M_ORIGIN; break;
+		case 7: bit = SCREEN_M_AUTOWRAP; break;
+		case 25: bit = SCREEN_M_CURSOR; break;
+		case 2004: bit = SCREEN_M_PASTE; break;
+		case 47:
+		case 1047:
+			set_alt(s, set, 1);
+			break;
+		case 1048:
+			if(set) s->saved = s->cur;
+			else s->cur = s->saved;
+			break;
+		case 1049:
+			if(set) {
+				s->saved = s->cur;
+				set_alt(s, 1, 1);
+			} else {
+				set_alt(s, 0, 0);
+				s->cur = s->saved;
+			}
+			break;
+		}
+		s->modes = set ? s->modes | bit : s->modes & ~bit;
+		if(bit == SCREEN_M_ORIGIN)
+			moveto(s, 0, 0);
+	}
+}
+
+static void csi(struct screen *s, int c)
+{
+	int n = param(s, 0, 1), lim;
+
+	if(s->inter == '!' && c == 'p') {
+		/* soft reset */
+		s->modes = DEFMODES;
+		s->top = 0;
+		s->bottom = s->rows - 1;
+		memset(&s->cur.pen, 0, sizeof(s->cur.pen));
+		return;
+	}
+	if(s->inter)
+		return;
+	if(s->priv && c != 'h' && c != 'l')
+		return;
+
+	switch(c) {
+	case '@': insert_chars(s, n); break;
+	case 'A':
+		/* stop at the margin if we start inside the region */
+		lim = s->cur.y >= s->top ? s->top : 0;
+		s->cur.y = s->cur.y - n < lim ? lim : s->cur.y - n;
+		s->wrapnext = 0;
+		break;
+	case 'B':
+	case 'e':
+		lim = s->cur.y <= s->bottom ? s->bottom : s->rows - 1;
+		s->cur.y = s->cur.y + n > lim ? lim : s->cur.y + n;
+		s->wrapnext = 0;
+		break;
+	case 'C':
+	case 'a':
+		s->cur.x = s->cur.x + n >= s->cols ? s->cols - 1 : s->cur.x + n;
+		s->wrapnext = 0;
+		break;
+	case 'D':
+		s->cur.x = s->cur.x - n < 0 ? 0 : s->cur.x - n;
+		s->wrapnext = 0;
+		break;
+	case 'E':
+	case 'F':
+		s->cur.y += c == 'E' ? n : -n;
+		if(s->cur.y < 0) s->cur.y = 0;
+		if(s->cur.y >= s->rows) s->cur.y = s->rows - 1;
+		s->cur.x = 0;
+		s->wrapnext = 0;
+		break;
+	case 'G':
+	case '`':
+		s->cur.x = n > s->cols ? s->cols - 1 : n - 1;
+		s->wrapnext = 0;
+		break;
+	case 'd':
+		moveto(s, s->cur.x, n - 1 - ((s->modes & SCREEN_M_ORIGIN) ? s->top : 0));
+		break;
+	case 'H':
+	case 'f':
+		moveto(s, param(s, 1, 1) - 1, n - 1);
+		break;
+	case 'J':
+		switch(param(s, 0, 0)) {
+		case 0:
+			erase(s, s->cur.y, s->cur.x, s->cols);
+			if(s->cur.y < s->rows - 1)
+				blank(s, cell(s, s->cur.y + 1, 0), (s->rows - s->cur.y - 1) * s->cols);
+			break;
+		case 1:
+			blank(s, cell(s, 0, 0), s->cur.y * s->cols);
+			erase(s, s->cur.y, 0, s->cur.x + 1);
+			break;
+		case 2:
+		case 3:
+			blank(s, cell(s, 0, 0), s->rows * s->cols);
+			break;
+		}
+		break;
+	case 'K':
+		switch(param(s, 0, 0)) {
+		case 0: erase(s, s->cur.y, s->cur.x, s->cols); break;
+		case 1: erase(s, s->cur.y, 0, s->cur.x + 1); break;
+		case 2: erase(s, s->cur.y, 0, s->cols); break;
+		}
+		break;
+	case 'L':
+		if(s->cur.y >= s->top && s->cur.y <= s->bottom)
+			scroll_down(s, s->cur.y, s->bottom, n);
+		s->cur.x = 0;
+		break;
+	case 'M':
+		if(s->cur.y >= s->top && s->cur.y <= s->bottom)
+			scroll_up(s, s->cur.y, s->bottom, n);
+		s->cur.x = 0;
+		break;
+	case 'P': delete_chars(s, n); break;
+	case 'X': erase(s, s->cur.y, s->cur.x, s->cur.x + n); break;
+	case 'S': scroll_up(s, s->top, s->bottom, n); break;
+	case 'T':
+		if(s->nparam <= 1)
+			scroll_down(s, s->top, s->bottom, n);
+		break;
+	case 'h': modes(s, 1); break;
+	case 'l': modes(s, 0); break;
+	case 'm': sgr(s); break;
+	case 'r': {
+		int top = param(s, 0, 1) - 1, bottom = param(s, 1, s->rows) - 1;
+
+		if(bottom >= s->rows) bottom = s->rows - 1;
+		if(top < bottom) {
+			s->top = top;
+			s->bottom = bottom;
+			moveto(s, 0, 0);
+		}
+		break;
+	}
+	case 's': s->saved = s->cur; break;
+	case 'u': s->cur = s->saved; s->wrapnext = 0; break;
+	}
+}
+
+static void esc(struct screen *s, int c)
+{
+	s->state = S_GROUND;
+	switch(c) {
+	case '[':
+		s->state = S_CSI;
+		memset(s->param, 0, sizeof(s->param));
+		s->nparam = 1;
+		s->priv = s->inter = 0;
+		break;
+	case ']': case 'P': case 'X': case '^': case '_':
+		s->state = S_STR;
+		break;
+	case '(': case ')':
+		s->inter = c;
+		s->state = S_CHARSET;
+		break;
+	case '#': case '%': case ' ':
+		s->state = S_SKIP;
+		break;
+	case 'c': screen_reset(s); break;
+	case '7': s->saved = s->cur; break;
+	case '8': s->cur = s->saved; s->wrapnext = 0; break;
+	case 'D': linefeed(s); break;
+	case 'E': s->cur.x = 0; s->wrapnext = 0; linefeed(s); break;
+	case 'M':
+		if(s->cur.y == s->top)
+			scroll_down(s, s->top, s->bottom, 1);
+		else if(s->cur.y > 0)
+			s->cur.y--;
+		break;
+	case '=': s->modes |= SCREEN_M_KEYPAD; break;
+	case '>': s->modes &= ~SCREEN_M_KEYPAD; break;
+	}
+}
+
+/* C0 control. Returns 0 if it was not one */
+static int control(struct screen *s, int c)
+{
+	switch(c) {
+	case 0x08:
+		if(s->cur.x > 0) s->cur.x--;
+		s->wrapnext = 0;
+		break;
+	case 0x09:
+		s->cur.x = (s->cur.x / 8 + 1) * 8;
+		if(s->cur.x >= s->cols) s->cur.x = s->cols - 1;
+		break;
+	case 0x0a: case 0x0b: case 0x0c:
+		linefeed(s);
+		break;
+	case 0x0d:
+		s->cur.x = 0;
+		s->wrapnext = 0;
+		break;
+	case 0x0e: s->cur.gl = 1; break;
+	case 0x0f: s->cur.gl = 0; break;
+	case 0x18: case 0x1a:
+		s->state = S_GROUND;
+		break;
+	case 0x1b:
+		s->state = S_ESC;
+		break;
+	default:
+		if(c >= 0x20)
+			return 0;
+	}
+	return 1;
+}
+
+static void ground(struct screen *s, int c)
+{
+	if(s->utfleft) {
+		if((c & 0xc0) == 0x80) {
+			s->utf = (s->utf << 6) | (c & 0x3f);
+			if(--s->utfleft == 0)
+				print(s, s->utf);
+			return;
+		}
+		s->utfleft = 0;
+		print(s, 0xfffd);
+	}
+	if(c < 0x80) {
+		if(!control(s, c) && c != 0x7f)
+			print(s, c);
+		return;
+	}
+	if(c >= 0xc2 && c <= 0xdf) {
+		s->utf = c & 0x1f;
+		s->utfleft = 1;
+	} else if(c >= 0xe0 && c <= 0xef) {
+		s->utf = c & 0x0f;
+		s->utfleft = 2;
+	} else if(c >= 0xf0 && c <= 0xf4) {
+		s->utf = c & 0x07;
+		s->utfleft = 3;
+	} else
+		print(s, SCREEN_RAW | c);
+}
+
+void screen_feed(struct screen *s, const unsigned char *p, unsigned int len)
+{
+	unsigned int i;
+	int c;
+
+	for(i=0;i<len;i++) {
+		c = p[i];
+		switch(s->state) {
+		case S_GROUND:
+			ground(s, c);
+			break;
+		case S_ESC:
+			if(!control(s, c))
+				esc(s, c);
+			break;
+		case S_CSI:
+			if(c >= '0' && c <= '9') {
+				int *v = &s->param[s->nparam - 1];
+				if(*v < 65536)
+					*v = *v * 10 + c - '0';
+			} else if(c == ';' || c == ':') {
+				if(s->nparam < 16)
+					s->nparam++;
+			} else if(c >= 0x3c && c <= 0x3f)
+				s->priv = c;
+			else if(c >= 0x20 && c <= 0x2f)
+				s->inter = c;
+			else if(c >= 0x40 && c <= 0x7e) {
+				s->state = S_GROUND;
+				csi(s, c);
+			} else
+				control(s, c);
+			break;
+		case S_STR:
+			/* OSC and friends end with BEL or ESC \ */
+			if(c == 0x07)
+				s->state = S_GROUND;
+			else if(c == 0x1b)
+				s->state = S_STRESC;
+			break;
+		case S_STRESC:
+			s->state = S_GROUND;
+			if(c != '\\')
+				esc(s, c);
+			break;
+		case S_CHARSET:
+			s->cur.charset[s->inter == ')'] = (c == '0');
+			s->inter = 0;
+			s->state = S_GROUND;
+			break;
+		case S_SKIP:
+			s->state = S_GROUND;
+			break;
+		}
+	}
+}
+
+void screen_reset(struct screen *s)
+{
+	memset(&s->cur, 0, sizeof(s->cur));
+	s->saved = s->cur;
+	s->alt = 0;
+	s->wrapnext = 0;
+	s->top = 0;
+	s->bottom = s->rows - 1;
+	s->modes = DEFMODES;
+	s->state = S_GROUND;
+	s->utfleft = 0;
+	blank(s, s->buf[0], s->rows * s->cols);
+	blank(s, s->buf[1], s->rows * s->cols);
+}
+
+struct screen *screen_new(int rows, int cols)
+{
+	struct screen *s;
+
+	s = malloc(sizeof(struct screen));
+	if(!s)
+		return NULL;
+	memset(s, 0, sizeof(struct screen));
+	if(screen_resize(s, rows, cols)) {
+		free(s);
+		return NULL;
+	}
+	screen_reset(s);
+	return s;
+}
+
+int screen_resize(struct screen *s, int rows, int cols)
+{
+	struct screen_cell *buf[3];
+	int i, y, n;
+
+	if(rows < 1) rows = 1;
+	if(cols < 1) cols = 1;
+	if(rows > SCREEN_MAXROWS) rows = SCREEN_MAXROWS;
+	if(cols > SCREEN_MAXCOLS) cols = SCREEN_MAXCOLS;
+	if(rows == s->rows && cols == s->cols)
+		return 0;
+
+	for(i=0;i<3;i++) {
+		buf[i] = malloc(rows * cols * sizeof(struct screen_cell));
+		if(!buf[i]) {
+			while(i--) free(buf[i]);
+			return -1;
+		}
+	}
+	for(i=0;i<2;i++) {
+		struct screen_cell *old = s->buf[i];
+
+		s->buf[i] = buf[i];
+		blank(s, buf[i], rows * cols);
+		if(!old)
+			continue;
+		n = cols < s->cols ? cols : s->cols;
+		for(y=0;y<rows && y<s->rows;y++)
+			memcpy(buf[i] + y * cols, old + y * s->cols, n * sizeof(struct screen_cell));
+		free(old);
+	}
+	free(s->shadow);
+	s->shadow = buf[2];
+	s->shadowok = 0;
+
+	s->rows = rows;
+	s->cols = cols;
+	s->top = 0;
+	s->bottom = rows - 1;
+	if(s->cur.x >= cols) s->cur.x = cols - 1;
+	if(s->cur.y >= rows) s->cur.y = rows - 1;
+	if(s->saved.x >= cols) s->saved.x = cols - 1;
+	if(s->saved.y >= rows) s->saved.y = rows - 1;
+	s->wrapnext = 0;
+	return 0;
+}
+
+void screen_sync(struct screen *s)
+{
+	memcpy(s->shadow, s->buf[s->alt], s->rows * s->cols * sizeof(struct screen_cell));
+	s->shadowalt = s->alt;
+	s->shadowok = 1;
+}
+
+void screen_invalidate(struct screen *s)
+{
+	s->shadowok = 0;
+}
+
+/*
+ * Rendering. 'r' is where the client's cursor is (x -1 if not known) and
+ * which pen and character set it writes with.
+ */
+struct render {
+	int x, y;
+	struct screen_cell pen;
+	int penok;
+	int acs;
+};
+
+static void out(struct screen *s, const void *p, unsigned int n)
+{
+	unsigned char *buf;
+
+	if(s->outlen + n > s->outsize) {
+		buf = realloc(s->out, s->outlen + n + 4096);
+		if(!buf)
+			return;
+		s->out = buf;
+		s->outsize = s->outlen + n + 4096;
+	}
+	memcpy(s->out + s->outlen, p, n);
+	s->outlen += n;
+}
+
+static void outf(struct screen *s, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if(n > 0)
+		out(s, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+static void outs(struct screen *s, const char *str)
+{
+	out(s, str, strlen(str));
+}
+
+static void out_color(struct screen *s, uint32_t c, int base)
+{
+	if(c & SCREEN_C_RGB)
+		outf(s, ";%d;2;%u;%u;%u", base + 8, (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+	else if((c & 0xff) < 8)
+		outf(s, ";%u", base + (c & 0xff));
+	else if((c & 0xff) < 16)
+		outf(s, ";%u", base + 60 + (c & 0xff) - 8);
+	else
+		outf(s, ";%d;5;%u", base + 8, c & 0xff);
+}
+
+static void out_sgr(struct screen *s, const struct screen_cell *c)
+{
+	static const struct { int attr, code; } map[] = {
+		{ SCREEN_A_BOLD, 1 }, { SCREEN_A_DIM, 2 }, { SCREEN_A_ITALIC, 3 },
+		{ SCREEN_A_UNDERLINE, 4 }, { SCREEN_A_BLINK, 5 }, { SCREEN_A_REVERSE, 7 },
+		{ SCREEN_A_INVISIBLE, 8 }, { SCREEN_A_STRIKE, 9 } };
+	unsigned int i;
+
+	outs(s, "\033[0");
+	for(i=0;i<sizeof(map)/sizeof(map[0]);i++)
+		if(c->attr & map[i].attr)
+			outf(s, ";%d", map[i].code);
+	if(c->fg)
+		out_color(s, c->fg, 30);
+	if(c->bg)
+		out_color(s, c->bg, 40);
+	outs(s, "m");
+}
+
+static void out_char(struct screen *s, uint32_t ch)
+{
+	unsigned char b[4];
+
+	if(ch & SCREEN_RAW) {
+		b[0] = ch;
+		out(s, b, 1);
+	} else if(ch < 0x80) {
+		b[0] = ch;
+		out(s, b, 1);
+	} else if(ch < 0x800) {
+		b[0] = 0xc0 | (ch >> 6);
+		b[1] = 0x80 | (ch & 0x3f);
+		out(s, b, 2);
+	} else if(ch < 0x10000) {
+		b[0] = 0xe0 | (ch >> 12);
+		b[1] = 0x80 | ((ch >> 6) & 0x3f);
+		b[2] = 0x80 | (ch & 0x3f);
+		out(s, b, 3);
+	} else {
+		b[0] = 0xf0 | (ch >> 18);
+		b[1] = 0x80 | ((ch >> 12) & 0x3f);
+		b[2] = 0x80 | ((ch >> 6) & 0x3f);
+		b[3] = 0x80 | (ch & 0x3f);
+		out(s, b, 4);
+	}
+}
+
+static int same(const struct screen_cell *a, const struct screen_cell *b)
+{
+	return !memcmp(a, b, sizeof(struct screen_cell));
+}
+
+static int blankcell(const struct screen_cell *c)
+{
+	return c->ch == ' ' && !c->attr && !c->fg && !c->bg;
+}
+
+static void render_goto(struct screen *s, struct render *r, int x, int y)
+{
+	if(r->y == y && r->x == x)
+		return;
+	if(r->y == y && r->x >= 0 && x == 0)
+		outs(s, "\r");
+	else if(r->y == y && r->x >= 0 && x > r->x)
+		outf(s, "\033[%dC", x - r->x);
+	else
+		outf(s, "\033[%d;%dH", y + 1, x + 1);
+	r->x = x;
+	r->y = y;
+}
+
+/* write cell at the client's cursor. Returns columns used */
+static int render_cell(struct screen *s, struct render *r, const struct screen_cell *c)
+{
+	int acs = (c->attr & SCREEN_A_ACS) != 0, w = 1;
+	struct screen_cell pen = *c;
+
+	pen.ch = 0;
+	pen.attr &= ~SCREEN_A_ACS;
+	if(!r->penok || !same(&pen, &r->pen)) {
+		out_sgr(s, &pen);
+		r->pen = pen;
+		r->penok = 1;
+	}
+	if(acs != r->acs) {
+		outs(s, acs ? "\033(0" : "\033(B");
+		r->acs = acs;
+	}
+	if(!(c->ch & SCREEN_RAW) && wide(c->ch))
+		w = 2;
+	out_char(s, c->ch);
+	r->x += w;
+	/* the cursor stays at the margin with a wrap pending: position again */
+	if(r->x >= s->cols)
+		r->x = -1;
+	return w;
+}
+
+static void render_row(struct screen *s, struct render *r, int y,
+		       const struct screen_cell *c, const struct screen_cell *o)
+{
+	int x = 0, end = s->cols, k, erase;
+
+	/* the rest of the row past 'end' is blank */
+	while(end > 0 && blankcell(&c[end-1]))
+		end--;
+
+	while(x < end) {
+		/* after a full clear the client has blanks everywhere */
+		if(o ? same(&c[x], &o[x]) : blankcell(&c[x])) {
+			x++;
+			continue;
+		}
+		if(c[x].ch == 0 && x > 0)
+			x--;
+		/* a short run of unchanged cells is cheaper to write again */
+		if(r->y == y && r->x >= 0 && r->x < x && x - r->x <= 4) {
+			k = r->x;
+			while(k < x)
+				k += c[k].ch ? render_cell(s, r, &c[k]) : 1;
+		}
+		render_goto(s, r, x, y);
+		x += c[x].ch ? render_cell(s, r, &c[x]) : 1;
+	}
+
+	erase = 0;
+	for(k=end;o && k<s->cols;k++)
+		if(!blankcell(&o[k]))
+			erase = 1;
+	if(erase) {
+		render_goto(s, r, end, y);
+		if(!r->penok || r->pen.attr || r->pen.fg || r->pen.bg) {
+			outs(s, "\033[0m");
+			memset(&r->pen, 0, sizeof(r->pen));
+			r->penok = 1;
+		}
+		outs(s, "\033[K");
+	}
+}
+
+unsigned int screen_render(struct screen *s, int full, const unsigned char **outp)
+{
+	const struct screen_cell *c = s->buf[s->alt];
+	struct render r;
+	int y;
+
+	s->outlen = 0;
+	memset(&r, 0, sizeof(r));
+	r.x = -1;
+
+	/* known state: no region, no origin or insert mode, ASCII in G0 */
+	outs(s, "\033[?25l\033[r\033[?6l\033[4l\033(B\017");
+	if(!s->shadowok || s->shadowalt != s->alt) {
+		full = 1;
+		outs(s, s->alt ? "\033[?1049h" : "\033[?1049l");
+	}
+	if(full)
+		outs(s, "\033[0m\033[H\033[2J");
+	r.penok = full;
+	for(y=0;y<s->rows;y++)
+		render_row(s, &r, y, c + y * s->cols, full ? NULL : s->shadow + y * s->cols);
+
+	outf(s, "\033[?1%c\033[?7%c\033[?2004%c\033%c",
+	     (s->modes & SCREEN_M_CURSORKEYS) ? 'h' : 'l',
+	     (s->modes & SCREEN_M_AUTOWRAP) ? 'h' : 'l',
+	     (s->modes & SCREEN_M_PASTE) ? 'h' : 'l',
+	     (s->modes & SCREEN_M_KEYPAD) ? '=' : '>');
+	/* both home the cursor */
+	if(s->top || s->bottom != s->rows - 1)
+		outf(s, "\033[%d;%dr", s->top + 1, s->bottom + 1);
+	if(s->modes & SCREEN_M_ORIGIN)
+		outf(s, "\033[?6h\033[%d;%dH", s->cur.y - s->top + 1, s->cur.x + 1);
+	else
+		outf(s, "\033[%d;%dH", s->cur.y + 1, s->cur.x + 1);
+	/* a pending wrap is recreated by writing the last column again */
+	if(s->wrapnext) {
+		r.x = s->cur.x;
+		r.y = s->cur.y;
+		render_cell(s, &r, cell(s, s->cur.y, s->cur.x));
+	}
+	if(s->modes & SCREEN_M_INSERT)
+		outs(s, "\033[4h");
+	outf(s, "\033(%c\033)%c%c", s->cur.charset[0] ? '0' : 'B', s->cur.charset[1] ? '0' : 'B',
+	     s->cur.gl ? 0x0e : 0x0f);
+	out_sgr(s, &s->cur.pen);
+	if(s->modes & SCREEN_M_CURSOR)
+		outs(s, "\033[?25h");
+
+	screen_sync(s);
+	*outp = s->out;
+	return s->outlen;
+}
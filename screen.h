@@ -0,0 +1,106 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdint.h>
+
+/*
+ * Model of the terminal screen a console shows, built from pty output.
+ * Covers what full-screen programs use: cursor movement, erasing, scroll
+ * regions, insert/delete, SGR colors (16, 256 and direct), the DEC line
+ * drawing set, the alternate screen and the modes that change what keys
+ * send.
+ *
+ * A second copy, the shadow, holds what the client is known to show.
+ * screen_render() produces the bytes that take the client from the
+ * shadow to the current screen, or repaint it fully.
+ */
+
+#define SCREEN_MAXROWS 512
+#define SCREEN_MAXCOLS 1024
+
+struct screen_cell {
+	uint32_t ch; /* unicode */
+	uint32_t attr; /* SCREEN_A_ */
+	uint32_t fg, bg; /* 0 default, SCREEN_C_INDEX | n or SCREEN_C_RGB | rgb */
+};
+
+#define SCREEN_A_BOLD 0x01
+#define SCREEN_A_DIM 0x02
+#define SCREEN_A_ITALIC 0x04
+#define SCREEN_A_UNDERLINE 0x08
+#define SCREEN_A_BLINK 0x10
+#define SCREEN_A_REVERSE 0x20
+#define SCREEN_A_INVISIBLE 0x40
+#define SCREEN_A_STRIKE 0x80
+#define SCREEN_A_ACS 0x100 /* DEC line drawing */
+
+#define SCREEN_C_INDEX 0x100
+#define SCREEN_C_RGB 0x1000000
+
+#define SCREEN_M_CURSORKEYS 0x01 /* DECCKM */
+#define SCREEN_M_ORIGIN 0x02
+#define SCREEN_M_AUTOWRAP 0x04
+#define SCREEN_M_CURSOR 0x08 /* cursor visible */
+#define SCREEN_M_INSERT 0x10
+#define SCREEN_M_KEYPAD 0x20 /* DECKPAM */
+#define SCREEN_M_PASTE 0x40 /* bracketed paste */
+
+struct screen_cursor {
+	int x, y;
+	struct screen_cell pen; /* attributes for new characters */
+	int charset[2]; /* G0, G1: 1 for line drawing */
+	int gl; /* 0 or 1: set in use */
+};
+
+struct screen {
+	int rows, cols;
+	struct screen_cell *buf[2]; /* main and alternate screen */
+	int alt;
+	struct screen_cursor cur, saved; /* DECSC */
+	int wrapnext; /* next character goes on the next line */
+	int top, bottom; /* scroll region */
+	int modes;
+
+	/* parser */
+	int state;
+	int param[16], nparam;
+	int priv; /* '?', '>' or '=' after CSI */
+	int inter; /* intermediate byte */
+	uint32_t utf;
+	int utfleft;
+
+	/* what the client shows */
+	struct screen_cell *shadow;
+	int shadowalt;
+	int shadowok;
+
+	unsigned char *out; /* rendered bytes */
+	unsigned int outlen, outsize;
+};
+
+/* NULL if out of memory */
+struct screen *screen_new(int rows, int cols);
+
+/* back to a blank screen and default modes */
+void screen_reset(struct screen *s);
+
+/* keeps the top left part of the screen */
+int screen_resize(struct screen *s, int rows, int cols);
+
+/* run pty output through the model */
+void screen_feed(struct screen *s, const unsigned char *p, unsigned int len);
+
+/* client now shows the current screen */
+void screen_sync(struct screen *s);
+
+/* client screen is unknown: the next render repaints everything */
+void screen_invalidate(struct screen *s);
+
+/*
+ * Bytes that bring the client from the shadow to the current screen,
+ * everything if 'full'. The shadow is updated. Returns length of *out,
+ * valid until the next call.
+ */
+unsigned int screen_render(struct screen *s, int full, const unsigned char **out);
+
+#endif
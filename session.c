@@ -0,0 +1,144 @@
+/*
+ * File: session.c
+ * Implements: hash table of console sessions
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "session.h"
+#include "proto.h"
+
+static unsigned int session_hash(const unsigned char *mac, int console, unsigned int hsize)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for(i=0;i<6;i++)
+		h = (h ^ mac[i]) * 16777619u;
+	h = (h ^ (console & 0xff)) * 16777619u;
+	h = (h ^ (console >> 8)) * 16777619u;
+	return h % hsize;
+}
+
+int session_table_init(struct session_table *t, unsigned int hsize)
+{
+	memset(t, 0, sizeof(struct session_table));
+	t->hash = calloc(hsize, sizeof(struct session *));
+	if(!t->hash) return -1;
+	t->hsize = hsize;
+	return 0;
+}
+
+struct session *session_find(const struct session_table *t, const unsigned char *mac, int console)
+{
+	struct session *sess;
+
+	for(sess = t->hash[session_hash(mac, console, t->hsize)]; sess; sess = sess->next)
+		if(sess->console == console && !memcmp(sess->mac, mac, 6))
+			return sess;
+	return NULL;
+}
+
+struct session *session_add(struct session_table *t, const unsigned char *mac, int console)
+{
+	struct session *sess;
+	unsigned int h;
+
+	sess = session_find(t, mac, console);
+	if(sess) return sess;
+
+	if(t->count == t->alloc) {
+		struct session **list;
+		int alloc = t->alloc ? t->alloc * 2 : 64;
+		list = realloc(t->list, alloc * sizeof(struct session *));
+		if(!list) return NULL;
+		t->list = list;
+		t->alloc = alloc;
+	}
+	sess = malloc(sizeof(struct session));
+	if(!sess) return NULL;
+	memset(sess, 0, sizeof(struct session));
+	memcpy(sess->mac, mac, 6);
+	sess->console = console;
+	sess->version = proto_version(PROTO_V1, console);
+	sess->selected = 1;
+	sess->bol = 1;
+	sess->index = t->count;
+	t->list[t->count++] = sess;
+
+	h = session_hash(mac, console, t->hsize);
+	sess->next = t->hash[h];
+	t->hash[h] = sess;
+	return sess;
+}
+
+struct session *session_hello(struct session_table *t, const unsigned char *mac,
+			      const struct proto_hdr *h, const unsigned char *data)
+{
+	struct session *sess;
+	unsigned int console;
+	uint32_t sid;
+	int version, flags;
+
+	version = proto_caps(h, data, &console, &sid, &flags);
+	sess = session_find(t, mac, console);
+	if(sess) {
+		sess->version = proto_version(version, console);
+		sess->flags = version >= PROTO_V2 ? flags : 0;
+		sess->sid = sid;
+	}
+	return sess;
+}
+
+int session_parse(const char *s, unsigned char *mac, int *console)
+{
+	unsigned int a[6];
+	int n;
+
+	if(sscanf(s, "%x:%x:%x:%x:%x:%x%n", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &n) != 6)
+		return -1;
+	for(n=0;n<6;n++)
+		mac[n] = a[n];
+	s = strchr(s, '/');
+	if(s)
+		*console = atoi(s+1);
+	return 0;
+}
+
+int session_load(struct session_table *t, const char *fn, int console)
+{
+	FILE *f;
+	char line[256], *p;
+	unsigned char mac[6];
+	int c, count = 0;
+
+	f = fopen(fn, "r");
+	if(!f) return -1;
+	
+	while(fgets(line, sizeof(line), f)) {
+		c = console;
+		p = line;
+		if(strncmp(p, "Console:", 8) == 0) {
+			/* output of scan */
+			p += 8;
+			c = strtol(p, &p, 10);
+		}
+		while(isspace(*p)) p++;
+		if(session_parse(p, mac, &c))
+			continue;
+		p = strchr(p, ' ');
+		if(p && isdigit(p[1]))
+			c = atoi(p+1);
+		if(session_add(t, mac, c))
+			count++;
+	}
+	fclose(f);
+	return count;
+}
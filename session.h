@@ -0,0 +1,59 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+/*
+ * Table of console sessions keyed by (MAC, console number).
+ * Lookup is a hash; sessions are also kept in the order they were added.
+ */
+
+struct lz;
+
+struct session {
+	unsigned char mac[6];
+	int console;
+	int version; /* protocol version the target speaks */
+	int flags; /* PROTO_F_ flags the target announced */
+	uint32_t sid; /* login session id last seen from target */
+	int index; /* position in table list */
+	int selected;
+	int bol; /* output is at beginning of line */
+	void *priv; /* per-mode state */
+	struct lz *lz; /* decoder for compressed output */
+	struct session *next; /* hash chain */
+};
+
+struct session_table {
+	struct session **hash;
+	unsigned int hsize;
+	struct session **list;
+	int count, alloc;
+};
+
+int session_table_init(struct session_table *t, unsigned int hsize);
+struct session *session_find(const struct session_table *t, const unsigned char *mac, int console);
+
+/* returns existing session if already in table */
+struct session *session_add(struct session_table *t, const unsigned char *mac, int console);
+
+struct proto_hdr;
+
+/*
+ * Note protocol version and login session told by a HELLO from 'mac'.
+ * Returns the session it was about, if it is in the table.
+ */
+struct session *session_hello(struct session_table *t, const unsigned char *mac,
+			      const struct proto_hdr *h, const unsigned char *data);
+
+/* parse "MAC[/CONSOLE]". Returns 0 on success */
+int session_parse(const char *s, unsigned char *mac, int *console);
+
+/*
+ * read targets from file, one per line: "MAC [CONSOLE]" or the
+ * "Console: N MAC" lines printed by scan.
+ * Returns number of targets added or -1.
+ */
+int session_load(struct session_table *t, const char *fn, int console);
+
+#endif
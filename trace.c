@@ -0,0 +1,100 @@
+/*
+ * File: trace.c
+ * Implements: in-memory flight recorder of egetty events
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "trace.h"
+
+static uint64_t trace_clock(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_ev(struct trace *t, int type, int a, int b, uint32_t c)
+{
+	struct trace_ev *e = &t->ev[t->head & (TRACE_EVENTS - 1)];
+
+	e->ns = trace_clock(CLOCK_MONOTONIC);
+	e->type = type;
+	e->a = a;
+	e->b = b;
+	e->c = c;
+	t->head++;
+}
+
+static int trace_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while(len) {
+		n = write(fd, p, len);
+		if(n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int trace_dump(struct trace *t, const char *path, int sig)
+{
+	struct trace_hdr hdr;
+	uint64_t start;
+	unsigned int first;
+	char tmp[1024];
+	size_t len = strlen(path);
+	int fd, rc;
+
+	trace_ev(t, TRACE_DUMP, sig, 0, 0);
+	if(len + 5 > sizeof(tmp))
+		return -1;
+	/* a new file renamed into place: never write through a planted link */
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if(fd == -1 && errno == EEXIST) {
+		/* left by a dump that did not finish */
+		unlink(tmp);
+		fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	}
+	if(fd == -1)
+		return -1;
+	start = t->head > TRACE_EVENTS ? t->head - TRACE_EVENTS : 0;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, 8);
+	hdr.realtime = trace_clock(CLOCK_REALTIME) - trace_clock(CLOCK_MONOTONIC);
+	hdr.count = t->head - start;
+	hdr.pid = getpid();
+
+	/* oldest first: from the oldest slot to the end, then from the start */
+	first = start & (TRACE_EVENTS - 1);
+	rc = trace_write(fd, &hdr, sizeof(hdr));
+	if(!rc)
+		rc = trace_write(fd, &t->ev[first], (hdr.count < TRACE_EVENTS - first ?
+						   hdr.count : TRACE_EVENTS - first) * sizeof(struct trace_ev));
+	if(!rc && hdr.count > TRACE_EVENTS - first)
+		rc = trace_write(fd, t->ev, (hdr.count - (TRACE_EVENTS - first)) * sizeof(struct trace_ev));
+	close(fd);
+	if(!rc)
+		rc = rename(tmp, path);
+	if(rc)
+		unlink(tmp);
+	return rc;
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Flight recorder. A fixed ring of small binary events kept in memory
+ * all the time; recording one costs a clock read and a few stores.
+ * The ring is written to a file on request or when the process dies,
+ * and etrace prints it as a timeline.
+ *
+ * File format: struct trace_hdr, then 'count' struct trace_ev, oldest
+ * first, in host byte order.
+ */
+
+#define TRACE_MAGIC "EGTRACE1"
+#define TRACE_EVENTS 8192 /* power of two */
+
+enum { TRACE_POLL=1,	/* a: fds ready or -1, b: revents socket << 8 | pty, c: timeout ms */
+       TRACE_RX,	/* a: type, b: console, c: length */
+       TRACE_PTYIN,	/* c: bytes written to pty */
+       TRACE_PTYOUT,	/* c: bytes read from pty */
+       TRACE_SEND,	/* a: errno that stopped sending, c: messages sent */
+       TRACE_SPAWN,	/* c: pid */
+       TRACE_EXIT,	/* b: wait status, c: pid */
+       TRACE_CLIENT,	/* a: protocol version, b, c: MAC */
+       TRACE_FLUSH,	/* c: messages dropped on interrupt */
+       TRACE_DUMP,	/* a: signal, 0 on exit */
+       TRACE_IFACE,	/* a: 1 on link loss, 0 client moved, b: from ifindex, c: to */
+       TRACE_PROMPT,	/* c: usecs from spawn to first output of the login */
+       TRACE_TYPES };
+
+struct trace_ev {
+	uint64_t ns; /* CLOCK_MONOTONIC */
+	uint8_t type;
+	uint8_t a;
+	uint16_t b;
+	uint32_t c;
+};
+
+struct trace_hdr {
+	char magic[8];
+	uint64_t realtime; /* CLOCK_REALTIME minus CLOCK_MONOTONIC, ns */
+	uint32_t count;
+	uint32_t pid;
+};
+
+struct trace {
+	uint64_t head; /* events ever recorded */
+	struct trace_ev ev[TRACE_EVENTS];
+};
+
+void trace_ev(struct trace *t, int type, int a, int b, uint32_t c);
+
+/*
+ * write the ring to 'path', by way of a new file path.tmp that is renamed
+ * into place. Only async-signal-safe calls
+ */
+int trace_dump(struct trace *t, const char *path, int sig);
+
+#endif
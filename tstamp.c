@@ -0,0 +1,263 @@
+/*
+ * File: tstamp.c
+ * Implements: kernel packet timestamps and latency histograms
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netpacket/packet.h>
+#include <net/if.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tstamp.h"
+#include "vlan.h"
+
+#ifndef PACKET_TX_TIMESTAMP
+#define PACKET_TX_TIMESTAMP 16
+#endif
+#ifndef SOF_TIMESTAMPING_OPT_TSONLY
+#define SOF_TIMESTAMPING_OPT_TSONLY (1<<11)
+#endif
+
+static const char *tstamp_names[TSTAMP_STAGES] = {
+	"nic", "wire", "input", "pty", "queue", "tx", "term", "echo", "rtt", "prompt"
+};
+
+static long long tstamp_ns(const struct timespec *ts)
+{
+	return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+long long tstamp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return tstamp_ns(&ts);
+}
+
+/* ask the driver to stamp all received frames. Needs CAP_NET_ADMIN */
+static int tstamp_hwenable(int s, const char *ifname)
+{
+	struct hwtstamp_config hw;
+	struct ifreq ifr;
+
+	memset(&hw, 0, sizeof(hw));
+	hw.tx_type = HWTSTAMP_TX_OFF;
+	hw.rx_filter = HWTSTAMP_FILTER_ALL;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+	ifr.ifr_data = (void *)&hw;
+	return ioctl(s, SIOCSHWTSTAMP, &ifr);
+}
+
+int tstamp_socket(struct tstamp *t, int s, const char *ifname)
+{
+	int flags, rc = 0;
+
+	if(!t->enable) return 0;
+
+	flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if(t->hw) {
+		if(tstamp_hwenable(s, ifname)) {
+			fprintf(stderr, "hardware timestamps on %s: %s\n", ifname, strerror(errno));
+			rc = -1;
+		} else
+			flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	}
+	/* tx stamps are matched to sends by id */
+	t->tx = 1;
+	t->txid = 0;
+	flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	if(setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+		t->tx = 0;
+		flags &= ~(SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+			   SOF_TIMESTAMPING_OPT_TSONLY);
+		if(setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+			fprintf(stderr, "SO_TIMESTAMPING: %s\n", strerror(errno));
+			t->enable = 0;
+			return -1;
+		}
+	}
+	return rc;
+}
+
+void tstamp_add(struct tstamp *t, int stage, long long ns)
+{
+	struct tstamp_hist *h = &t->hist[stage];
+	unsigned long us, max;
+	int b = 0;
+
+	/* stamps from clocks that are not in step */
+	if(ns < 0)
+		return;
+	us = ns / 1000;
+	if(us > 1)
+		b = 8 * sizeof(long) - 1 - __builtin_clzl(us);
+	if(b >= TSTAMP_BUCKETS)
+		b = TSTAMP_BUCKETS - 1;
+	__atomic_fetch_add(&h->count[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while(us > max && !__atomic_compare_exchange_n(&h->max, &max, us, 1,
+						      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+ssize_t tstamp_recv(struct tstamp *t, int s, void *buf, size_t len, int flags,
+		    struct sockaddr *from, socklen_t *fromlen, int *vlan)
+{
+	char ctrl[256];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct scm_timestamping *ts;
+	long long now;
+	ssize_t n;
+
+	if(!t->enable && !vlan)
+		return recvfrom(s, buf, len, flags, from, fromlen);
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_name = from;
+	msg.msg_namelen = *fromlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	n = recvmsg(s, &msg, flags);
+	if(n == -1)
+		return -1;
+	*fromlen = msg.msg_namelen;
+	if(vlan)
+		*vlan = vlan_id(&msg);
+	if(!t->enable)
+		return n;
+	now = tstamp_now();
+	for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING)
+			continue;
+		ts = (struct scm_timestamping *)CMSG_DATA(cm);
+		if(ts->ts[0].tv_sec)
+			tstamp_add(t, TSTAMP_WIRE, now - tstamp_ns(&ts->ts[0]));
+		/* only comparable when the NIC clock is synced to system time */
+		if(ts->ts[2].tv_sec && ts->ts[0].tv_sec)
+			tstamp_add(t, TSTAMP_NIC, tstamp_ns(&ts->ts[0]) - tstamp_ns(&ts->ts[2]));
+	}
+	return n;
+}
+
+/* the software tx stamp is taken inside the send call: stamp before it */
+ssize_t tstamp_sendmsg(struct tstamp *t, int s, const struct msghdr *msg, int flags)
+{
+	long long now;
+	ssize_t rc;
+
+	if(!t->tx)
+		return sendmsg(s, msg, flags);
+	now = tstamp_now();
+	rc = sendmsg(s, msg, flags);
+	if(rc != -1)
+		t->txsent[t->txid++ % TSTAMP_TXRING] = now;
+	return rc;
+}
+
+ssize_t tstamp_sendto(struct tstamp *t, int s, const void *buf, size_t len, int flags,
+		      const struct sockaddr *dest, socklen_t destlen)
+{
+	struct iovec iov;
+	struct msghdr msg;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (void *)dest;
+	msg.msg_namelen = destlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	return tstamp_sendmsg(t, s, &msg, flags);
+}
+
+int tstamp_errqueue(struct tstamp *t, int s)
+{
+	char ctrl[256];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct scm_timestamping *ts;
+	struct sock_extended_err *ee;
+	int n = 0;
+
+	while(1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		if(recvmsg(s, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1)
+			return n;
+		n++;
+		ts = NULL;
+		ee = NULL;
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPING)
+				ts = (struct scm_timestamping *)CMSG_DATA(cm);
+			if(cm->cmsg_level == SOL_PACKET && cm->cmsg_type == PACKET_TX_TIMESTAMP)
+				ee = (struct sock_extended_err *)CMSG_DATA(cm);
+		}
+		if(!ts || !ee || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || !ts->ts[0].tv_sec)
+			continue;
+		/* too old, or a send we did not see */
+		if(t->txid - ee->ee_data - 1 >= TSTAMP_TXRING)
+			continue;
+		tstamp_add(t, TSTAMP_TX, tstamp_ns(&ts->ts[0]) - t->txsent[ee->ee_data % TSTAMP_TXRING]);
+	}
+}
+
+/* upper bound in usecs of the bucket where 'pct' percent of samples are below */
+static unsigned long tstamp_pct(const struct tstamp_hist *h, unsigned long total, int pct)
+{
+	unsigned long sum = 0, max;
+	int b;
+
+	for(b = 0; b < TSTAMP_BUCKETS; b++) {
+		sum += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+		if(sum * 100 >= total * pct)
+			break;
+	}
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	return (2UL << b) < max ? (2UL << b) : max;
+}
+
+int tstamp_format(const struct tstamp *t, char *buf, int size)
+{
+	const struct tstamp_hist *h;
+	unsigned long total;
+	int i, b, n;
+
+	n = snprintf(buf, size, "%-6s %10s %8s %8s %8s %8s  usecs\n",
+		     "stage", "count", "avg", "p50<", "p99<", "max");
+	for(i = 0; i < TSTAMP_STAGES && n < size; i++) {
+		h = &t->hist[i];
+		total = 0;
+		for(b = 0; b < TSTAMP_BUCKETS; b++)
+			total += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+		if(!total)
+			continue;
+		n += snprintf(buf + n, size - n, "%-6s %10lu %8llu %8lu %8lu %8lu\n",
+			      tstamp_names[i], total,
+			      __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / total,
+			      tstamp_pct(h, total, 50), tstamp_pct(h, total, 99),
+			      __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+	}
+	return n < size ? n : size - 1;
+}
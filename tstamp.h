@@ -0,0 +1,73 @@
+#ifndef TSTAMP_H
+#define TSTAMP_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Where console latency goes.
+ * Kernel timestamps (SO_TIMESTAMPING) on the packet socket, software and
+ * hardware where the NIC has it, plus stamps at the points in egetty and
+ * econsole that data passes. Each stage has a histogram with power of two
+ * buckets. Samples are added with atomic increments, so readers never
+ * take a lock.
+ */
+
+enum { TSTAMP_NIC=0,	/* rx: hardware to software stamp */
+       TSTAMP_WIRE,	/* rx: kernel stamp to recvmsg() return */
+       TSTAMP_INPUT,	/* egetty: frame received to pty write */
+       TSTAMP_PTY,	/* egetty: pty write to next pty read */
+       TSTAMP_QUEUE,	/* egetty: pty read to sendmsg() */
+       TSTAMP_TX,	/* sendmsg() to kernel tx stamp */
+       TSTAMP_TERM,	/* econsole: output received to terminal write */
+       TSTAMP_ECHO,	/* econsole: key sent to next output */
+       TSTAMP_RTT,	/* econsole: echo probe round trip */
+       TSTAMP_PROMPT,	/* egetty: login spawned to its first output */
+       TSTAMP_STAGES };
+
+#define TSTAMP_BUCKETS 24 /* bucket i: [2^i, 2^(i+1)) usecs, up to 16 s */
+#define TSTAMP_TXRING 64 /* sends waiting for their tx stamp */
+
+struct tstamp_hist {
+	unsigned long count[TSTAMP_BUCKETS];
+	unsigned long long sum; /* usecs */
+	unsigned long max;
+};
+
+struct tstamp {
+	int enable;
+	int hw; /* hardware stamps asked for */
+	int tx; /* tx stamps enabled */
+	unsigned int txid; /* id of the next send */
+	long long txsent[TSTAMP_TXRING]; /* CLOCK_REALTIME ns per send id */
+	struct tstamp_hist hist[TSTAMP_STAGES];
+};
+
+/* turn on kernel stamps for packet socket 's' bound to 'ifname' */
+int tstamp_socket(struct tstamp *t, int s, const char *ifname);
+
+/* CLOCK_REALTIME in nanoseconds, the clock kernel stamps use */
+long long tstamp_now(void);
+
+/* add 'ns' to stage histogram */
+void tstamp_add(struct tstamp *t, int stage, long long ns);
+
+/*
+ * recvfrom() that adds the kernel rx stamp of the frame to TSTAMP_NIC
+ * and TSTAMP_WIRE. Stores the 802.1Q VLAN of the frame in *vlan if set.
+ */
+ssize_t tstamp_recv(struct tstamp *t, int s, void *buf, size_t len, int flags,
+		    struct sockaddr *from, socklen_t *fromlen, int *vlan);
+
+/* sendmsg() and sendto() that remember when, to match the tx stamp */
+ssize_t tstamp_sendmsg(struct tstamp *t, int s, const struct msghdr *msg, int flags);
+ssize_t tstamp_sendto(struct tstamp *t, int s, const void *buf, size_t len, int flags,
+		      const struct sockaddr *dest, socklen_t destlen);
+
+/* read tx stamps from the socket error queue */
+int tstamp_errqueue(struct tstamp *t, int s);
+
+/* text table of stages with samples: count, avg, p50, p99, max */
+int tstamp_format(const struct tstamp *t, char *buf, int size);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * File: txq.c
+ * Implements: prioritized transmit queues
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "txq.h"
+#include "proto.h"
+#include "vlan.h"
+
+int txsched_init(struct txsched *ts, unsigned int size)
+{
+	memset(ts, 0, sizeof(struct txsched));
+	for(ts->nfree = 0; ts->nfree < TXQ_POOL; ts->nfree++) {
+		ts->pool[ts->nfree] = alloc_skb(size);
+		if(!ts->pool[ts->nfree])
+			return -1;
+	}
+	return 0;
+}
+
+int txsched_avail(const struct txsched *ts, int class)
+{
+	if(class == TXQ_CTRL)
+		return ts->nfree;
+	return ts->nfree > TXQ_RESERVE ? ts->nfree - TXQ_RESERVE : 0;
+}
+
+struct sk_buff *txsched_alloc(struct txsched *ts, int class)
+{
+	struct sk_buff *skb;
+
+	if(!txsched_avail(ts, class))
+		return NULL;
+	skb = ts->pool[--ts->nfree];
+	skb_reset(skb);
+	return skb;
+}
+
+void txsched_free(struct txsched *ts, struct sk_buff *skb)
+{
+	ts->pool[ts->nfree++] = skb;
+}
+
+static long long txq_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int txsched_enqueue(struct txsched *ts, int class, struct sk_buff *skb,
+		    const struct sockaddr_ll *dest, int flags)
+{
+	struct txq *q = &ts->q[class];
+	struct txq_ent *e;
+
+	if(q->count == TXQ_POOL) {
+		txsched_free(ts, skb);
+		return -1;
+	}
+	e = &q->ent[(q->head + q->count) % TXQ_POOL];
+	e->skb = skb;
+	e->flags = flags;
+	e->stamp = (ts->hold || ts->tstamp) ? txq_now() : 0;
+	memcpy(&e->dest, dest, sizeof(struct sockaddr_ll));
+	q->count++;
+	return 0;
+}
+
+int txsched_class(const struct txsched *ts, unsigned int len)
+{
+	if(len <= TXQ_SMALL && !ts->q[TXQ_BULK].count)
+		return TXQ_ECHO;
+	return TXQ_BULK;
+}
+
+int txsched_pending(const struct txsched *ts)
+{
+	int class, n = 0;
+
+	for(class = 0; class < TXQ_CLASSES; class++)
+		n += ts->q[class].count;
+	return n;
+}
+
+static void txq_pop(struct txsched *ts, int class, int count)
+{
+	struct txq *q = &ts->q[class];
+
+	while(count--) {
+		txsched_free(ts, q->ent[q->head].skb);
+		q->head = (q->head + 1) % TXQ_POOL;
+		q->count--;
+	}
+}
+
+static int txq_packable(const struct txq_ent *a, const struct txq_ent *b)
+{
+	return (a->flags & TXQ_PACK) && (b->flags & TXQ_PACK) &&
+		TXQ_VID(a->flags) == TXQ_VID(b->flags) &&
+		a->dest.sll_ifindex == b->dest.sll_ifindex &&
+		!memcmp(a->dest.sll_addr, b->dest.sll_addr, 6);
+}
+
+/*
+ * Collect messages for the same peer as 'first' into iov[1..], highest
+ * class first and in queue order within a class. take[] gets the number
+ * taken from each class. Returns number of messages.
+ * Gathering stops at the first entry left behind: a lower class must not
+ * overtake it, output of one pty goes to both echo and bulk.
+ */
+static int txq_gather(struct txsched *ts, const struct txq_ent *first, struct iovec *iov,
+		      int *take, unsigned int *len, long long *oldest)
+{
+	const struct txq *q;
+	const struct txq_ent *e;
+	int class, i, n = 0;
+
+	*len = 0;
+	*oldest = first->stamp;
+	memset(take, 0, TXQ_CLASSES * sizeof(int));
+	for(class = 0; class < TXQ_CLASSES; class++) {
+		q = &ts->q[class];
+		for(i = 0; i < q->count; i++) {
+			e = &q->ent[(q->head + i) % TXQ_POOL];
+			if(e != first && !txq_packable(first, e))
+				return n;
+			if(n && PROTO_HDR2 + *len + e->skb->len > PROTO_MTU)
+				return n;
+			n++;
+			iov[n].iov_base = e->skb->data;
+			iov[n].iov_len = e->skb->len;
+			*len += e->skb->len;
+			if(e->stamp < *oldest)
+				*oldest = e->stamp;
+			take[class]++;
+			if(!(first->flags & TXQ_PACK))
+				return n;
+		}
+	}
+	return n;
+}
+
+int txsched_run(struct txsched *ts, int s)
+{
+	int class, i, n = 0, count;
+	int take[TXQ_CLASSES];
+	struct iovec iov[TXQ_POOL * TXQ_CLASSES + 2];
+	unsigned char hdr[PROTO_HDR2], tag[VLAN_HLEN];
+	struct sockaddr_ll tagged;
+	struct msghdr msg;
+	struct txq_ent *e;
+	unsigned int len;
+	long long oldest;
+	ssize_t rc;
+
+	ts->blocked = 0;
+	ts->due = 0;
+	while(1) {
+		for(class = 0; class < TXQ_CLASSES; class++)
+			if(ts->q[class].count) break;
+		if(class == TXQ_CLASSES)
+			return n;
+		
+		e = &ts->q[class].ent[ts->q[class].head];
+		/* iov[0]: vlan tag, iov[1]: bundle header, then messages */
+		count = txq_gather(ts, e, iov + 1, take, &len, &oldest);
+		if(ts->hold && (e->flags & TXQ_PACK) && class != TXQ_CTRL &&
+		   PROTO_HDR2 + len + TXQ_SMALL <= PROTO_MTU &&
+		   txq_now() - oldest < ts->hold) {
+			/* room for more: wait a little for it */
+			ts->due = oldest + ts->hold;
+			return n;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &e->dest;
+		msg.msg_namelen = sizeof(e->dest);
+		msg.msg_iov = iov + 2;
+		msg.msg_iovlen = count;
+		if(count > 1) {
+			proto_bundle_hdr(hdr, len);
+			iov[1].iov_base = hdr;
+			iov[1].iov_len = PROTO_HDR2;
+			msg.msg_iov--;
+			msg.msg_iovlen++;
+		}
+		if(TXQ_VID(e->flags)) {
+			vlan_dest(TXQ_VID(e->flags), &e->dest, &tagged, tag);
+			msg.msg_name = &tagged;
+			msg.msg_iov--;
+			msg.msg_iov->iov_base = tag;
+			msg.msg_iov->iov_len = VLAN_HLEN;
+			msg.msg_iovlen++;
+		}
+		if(ts->tstamp)
+			rc = tstamp_sendmsg(ts->tstamp, s, &msg, 0);
+		else
+			rc = sendmsg(s, &msg, 0);
+		if(rc == -1 && (errno == EAGAIN || errno == ENOBUFS)) {
+			ts->blocked = errno;
+			return n;
+		}
+		/* on other errors retrying will not help. drop them */
+		if(rc != -1) {
+			if(ts->tstamp)
+				tstamp_add(ts->tstamp, TSTAMP_QUEUE, (txq_now() - oldest) * 1000);
+			ts->frames++;
+			if(count > 1)
+				ts->bundles++;
+		}
+		for(i = 0; i < TXQ_CLASSES; i++) {
+			if(rc != -1)
+				ts->sent[i] += take[i];
+			txq_pop(ts, i, take[i]);
+		}
+		n += count;
+	}
+}
+
+int txsched_timeout(const struct txsched *ts)
+{
+	long long now;
+
+	if(!ts->due)
+		return -1;
+	now = txq_now();
+	if(ts->due <= now)
+		return 0;
+	return (ts->due - now + 999) / 1000;
+}
+
+int txsched_flush(struct txsched *ts, int class)
+{
+	struct txq *q = &ts->q[class];
+	int n = q->count;
+
+	txq_pop(ts, class, n);
+	ts->flushed[class] += n;
+	return n;
+}
+
+int txsched_redirect(struct txsched *ts, int from, int to)
+{
+	struct txq_ent *e;
+	unsigned int i;
+	int class, n = 0;
+
+	for(class = 0; class < TXQ_CLASSES; class++) {
+		for(i = 0; i < ts->q[class].count; i++) {
+			e = &ts->q[class].ent[(ts->q[class].head + i) % TXQ_POOL];
+			if(e->dest.sll_ifindex != from)
+				continue;
+			e->dest.sll_ifindex = to;
+			n++;
+		}
+	}
+	return n;
+}
@@ -0,0 +1,98 @@
+#ifndef TXQ_H
+#define TXQ_H
+
+#include <netpacket/packet.h>
+
+#include "skbuff.h"
+#include "tstamp.h"
+
+/*
+ * Transmit queues, one per traffic class.
+ * Classes are served in strict priority order, lowest number first.
+ * All skbs come from a pool allocated at init, so queueing never
+ * allocates memory.
+ *
+ * Skbs queued with TXQ_PACK hold a complete version 2 message. Such
+ * messages for the same peer are sent together as one EGETTY_BUNDLE
+ * frame. With 'hold' set, a bundle that is not full waits up to that
+ * many usecs for more messages.
+ */
+
+enum { TXQ_CTRL=0, TXQ_ECHO, TXQ_KMSG, TXQ_BULK, TXQ_CLASSES };
+
+#define TXQ_POOL 64
+#define TXQ_RESERVE 4 /* skbs only available to TXQ_CTRL */
+#define TXQ_SMALL 128 /* writes up to this size are considered interactive */
+
+#define TXQ_PACK 1 /* peer takes bundles */
+#define TXQ_VLAN(vid) ((vid) << 16) /* frames get an 802.1Q tag for 'vid' */
+#define TXQ_VID(flags) ((flags) >> 16)
+
+struct txq_ent {
+	struct sk_buff *skb;
+	struct sockaddr_ll dest;
+	int flags;
+	long long stamp; /* usecs, when queued */
+};
+
+struct txq {
+	struct txq_ent ent[TXQ_POOL];
+	unsigned int head, count;
+};
+
+struct txsched {
+	struct txq q[TXQ_CLASSES];
+	struct sk_buff *pool[TXQ_POOL];
+	int nfree;
+	int blocked; /* errno that stopped the last txsched_run() */
+	int hold; /* usecs a bundle may wait to fill */
+	long long due; /* when held messages must go, 0 if none */
+	unsigned long sent[TXQ_CLASSES];
+	unsigned long flushed[TXQ_CLASSES];
+	unsigned long frames, bundles; /* frames sent, of which bundles */
+	struct tstamp *tstamp; /* queueing and send stamps, if set */
+};
+
+int txsched_init(struct txsched *ts, unsigned int size);
+
+/* get a reset skb from the pool. NULL if pool is empty */
+struct sk_buff *txsched_alloc(struct txsched *ts, int class);
+void txsched_free(struct txsched *ts, struct sk_buff *skb);
+
+/* number of skbs available for 'class' */
+int txsched_avail(const struct txsched *ts, int class);
+
+/*
+ * queue skb for transmission to 'dest'. skb belongs to the queue after this.
+ * flags: TXQ_PACK or 0, and TXQ_VLAN(vid) to send on a VLAN.
+ */
+int txsched_enqueue(struct txsched *ts, int class, struct sk_buff *skb,
+		    const struct sockaddr_ll *dest, int flags);
+
+/*
+ * class for 'len' bytes of an ordered stream, like pty output: TXQ_ECHO
+ * for small writes while nothing waits in TXQ_BULK, else TXQ_BULK. The
+ * stream is sent in order, as echo is only ever older than bulk.
+ */
+int txsched_class(const struct txsched *ts, unsigned int len);
+
+/* number of skbs waiting in all queues */
+int txsched_pending(const struct txsched *ts);
+
+/*
+ * send queued skbs in priority order on socket 's' until the queues are
+ * empty or the socket would block.
+ * Returns number of skbs sent.
+ */
+int txsched_run(struct txsched *ts, int s);
+
+/* ms until held messages are due, -1 if nothing is held */
+int txsched_timeout(const struct txsched *ts);
+
+/* drop everything queued in 'class' */
+int txsched_flush(struct txsched *ts, int class);
+
+/* send what is queued for interface 'from' on 'to' instead */
+int txsched_redirect(struct txsched *ts, int from, int to);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * File: vlan.c
+ * Implements: 802.1Q tagging on packet sockets
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "egetty.h"
+#include "vlan.h"
+
+/* from linux/if_packet.h, which cannot be included with netpacket/packet.h */
+struct vlan_auxdata {
+	uint32_t tp_status;
+	uint32_t tp_len;
+	uint32_t tp_snaplen;
+	uint16_t tp_mac;
+	uint16_t tp_net;
+	uint16_t tp_vlan_tci;
+	uint16_t tp_vlan_tpid;
+};
+#define VLAN_STATUS_VALID (1 << 4) /* TP_STATUS_VLAN_VALID */
+
+#define VLAN_IDS 64 /* most VLANs a filter lists */
+
+int vlan_socket(int s, const int *vids, int n)
+{
+	struct sock_filter code[8 + 2 * VLAN_IDS];
+	struct sock_fprog prog;
+	int on = 1, i, len = 0, tagged, untagged = 0;
+
+	if(n > VLAN_IDS)
+		return -1;
+	if(setsockopt(s, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on)))
+		return -1;
+
+	for(i=0;i<n;i++)
+		if(!vids[i])
+			untagged = 1;
+	tagged = n - untagged;
+
+	/* our own frames come back on ETH_P_ALL sockets */
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, 0, 1);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+	code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_EGETTY, 1, 0);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	if(n) {
+		/* untagged: accept if listed. Then one test per VLAN */
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT);
+		code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, untagged ? 0xffff : 0);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_AND|BPF_K, VLAN_MAX);
+		for(i=0;i<n;i++) {
+			if(!vids[i])
+				continue;
+			tagged--;
+			code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, vids[i], tagged + 1, 0);
+		}
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	}
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffff);
+
+	prog.len = len;
+	prog.filter = code;
+	return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int vlan_id(struct msghdr *msg)
+{
+	struct cmsghdr *cm;
+	struct vlan_auxdata *aux;
+
+	for(cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if(cm->cmsg_level != SOL_PACKET || cm->cmsg_type != PACKET_AUXDATA)
+			continue;
+		aux = (struct vlan_auxdata *)CMSG_DATA(cm);
+		if(aux->tp_status & VLAN_STATUS_VALID)
+			return aux->tp_vlan_tci & VLAN_MAX;
+	}
+	return 0;
+}
+
+void vlan_dest(int vid, const struct sockaddr_ll *dest, struct sockaddr_ll *tagged,
+	       unsigned char *tag)
+{
+	memcpy(tagged, dest, sizeof(struct sockaddr_ll));
+	tagged->sll_protocol = htons(ETH_P_8021Q);
+	tag[0] = vid >> 8;
+	tag[1] = vid;
+	memcpy(tag + 2, &dest->sll_protocol, 2);
+}
+
+ssize_t vlan_sendto(struct tstamp *t, int s, int vid, const void *buf, size_t len,
+		    const struct sockaddr_ll *dest)
+{
+	struct sockaddr_ll tagged;
+	unsigned char tag[VLAN_HLEN];
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	if(vid) {
+		vlan_dest(vid, dest, &tagged, tag);
+		iov[0].iov_base = tag;
+		iov[0].iov_len = VLAN_HLEN;
+		msg.msg_name = &tagged;
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+	} else {
+		msg.msg_name = (void *)dest;
+		msg.msg_iov = iov + 1;
+		msg.msg_iovlen = 1;
+	}
+	msg.msg_namelen = sizeof(struct sockaddr_ll);
+	if(t)
+		return tstamp_sendmsg(t, s, &msg, 0);
+	return sendmsg(s, &msg, 0);
+}
+
+int vlan_parse(const char *s, int *vids, int max)
+{
+	char *end;
+	long v;
+	int n = 0;
+
+	while(*s && n < max) {
+		v = strtol(s, &end, 10);
+		if(end == s || v < 0 || v > VLAN_MAX || (*end && *end != ','))
+			return -1;
+		vids[n++] = v;
+		s = *end ? end + 1 : end;
+	}
+	return n;
+}
@@ -0,0 +1,42 @@
+#ifndef VLAN_H
+#define VLAN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netpacket/packet.h>
+
+#include "tstamp.h"
+
+/*
+ * 802.1Q trunks without VLAN subinterfaces.
+ * A packet socket for ETH_P_ALL on the parent interface sees the frames of
+ * every VLAN, the tag already taken off; the VLAN id comes along with
+ * PACKET_AUXDATA. A socket filter passes only incoming egetty frames of
+ * the VLANs asked for. To send, ETH_P_8021Q is given as the protocol and
+ * the tag is sent before the payload.
+ */
+
+#define VLAN_HLEN 4
+#define VLAN_MAX 4095
+
+/*
+ * Set up packet socket 's', opened for ETH_P_ALL, for the VLANs in
+ * vids[0..n-1], 0 meaning untagged frames. n == 0 means every VLAN.
+ */
+int vlan_socket(int s, const int *vids, int n);
+
+/* VLAN id of a frame received with 'msg', 0 if it was untagged */
+int vlan_id(struct msghdr *msg);
+
+/* address and 4 byte tag to send a frame for 'dest' on VLAN 'vid' */
+void vlan_dest(int vid, const struct sockaddr_ll *dest, struct sockaddr_ll *tagged,
+	       unsigned char *tag);
+
+/* sendto() on VLAN 'vid', untagged if 0. 't' may be NULL */
+ssize_t vlan_sendto(struct tstamp *t, int s, int vid, const void *buf, size_t len,
+		    const struct sockaddr_ll *dest);
+
+/* "10,20,0" to vids[]. Returns number of ids, -1 on a bad id */
+int vlan_parse(const char *s, int *vids, int max);
+
+#endif
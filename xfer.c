@@ -0,0 +1,308 @@
+/*
+ * File: xfer.c
+ * Implements: windowed file transfer over the console protocol
+ *
+ * Copyright: Jens Ls, 2011
+ * Copyright license: According to GPL, see file COPYING in this directory.
+ *
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "xfer.h"
+
+static uint32_t crctab[256];
+
+int xfer_socket(int s)
+{
+	int size = XFER_WINDOW * 2 * 2048;
+
+	/* room for a full window of frames, past rmem_max if we are allowed to */
+	if(setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+		return 0;
+	return setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+uint32_t xfer_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t c;
+	int i, j;
+
+	if(!crctab[1]) {
+		for(i=0;i<256;i++) {
+			c = i;
+			for(j=0;j<8;j++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crctab[i] = c;
+		}
+	}
+	crc = ~crc;
+	while(len--)
+		crc = crctab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+int xfer_crc_file(int fd, uint64_t len, uint32_t *crc)
+{
+	unsigned char buf[65536];
+	uint64_t off = 0;
+	ssize_t n;
+
+	*crc = 0;
+	while(off < len) {
+		n = pread(fd, buf, len - off > sizeof(buf) ? sizeof(buf) : len - off, off);
+		if(n <= 0) return -1;
+		*crc = xfer_crc32(*crc, buf, n);
+		off += n;
+	}
+	return 0;
+}
+
+void xfer_init(struct xfer *x, int fd, int sender, uint32_t id, uint64_t size, uint64_t start)
+{
+	memset(x, 0, sizeof(struct xfer));
+	x->fd = fd;
+	x->sender = sender;
+	x->id = id;
+	x->size = size;
+	x->base = x->next = x->crcpos = start;
+	x->window = XFER_WINDOW;
+	x->state = XFER_S_DATA;
+	if(start)
+		xfer_crc_file(fd, start, &x->crc);
+}
+
+int xfer_openat(int dir, const char *path, int flags, mode_t mode)
+{
+	struct open_how how;
+	char buf[256], *p, *next;
+	int fd, d = dir;
+
+	if(path[0] == '/' || strlen(path) >= sizeof(buf)) {
+		errno = EACCES;
+		return -1;
+	}
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_NOFOLLOW | O_CLOEXEC;
+	how.mode = (flags & O_CREAT) ? mode : 0;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+	fd = syscall(SYS_openat2, dir, path, &how, sizeof(how));
+	if(fd != -1 || (errno != ENOSYS && errno != EPERM))
+		return fd;
+
+	/* kernel without openat2: one component at a time, none followed */
+	strcpy(buf, path);
+	for(p = buf; ; p = next) {
+		next = strchr(p, '/');
+		if(next)
+			*next++ = 0;
+		if(!strcmp(p, "..")) {
+			fd = -1;
+			errno = EACCES;
+		} else if(!next) {
+			fd = openat(d, p, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+		} else if(!*p || !strcmp(p, ".")) {
+			continue;
+		} else
+			fd = openat(d, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if(d != dir) {
+			int e = errno;
+			close(d);
+			errno = e;
+		}
+		if(fd == -1 || !next)
+			return fd;
+		d = fd;
+	}
+}
+
+int xfer_expired(struct xfer *x, long long now)
+{
+	if(x->state == XFER_S_DONE || x->state == XFER_S_IDLE)
+		return 0;
+	if(!x->alive)
+		x->alive = now;
+	if(now - x->alive < XFER_TIMEOUT)
+		return 0;
+	x->status = ETIMEDOUT;
+	x->state = XFER_S_DONE;
+	return 1;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void xfer_push(struct sk_buff *skb, int op, int flags, uint32_t id, uint64_t off)
+{
+	unsigned char *p = skb_push(skb, XFER_HDR);
+
+	p[0] = op;
+	p[1] = flags;
+	p[2] = p[3] = 0;
+	put_be32(p + 4, id);
+	put_be32(p + 8, off >> 32);
+	put_be32(p + 12, off & 0xffffffff);
+}
+
+int xfer_parse(const unsigned char *p, unsigned int len, struct xfer_msg *m)
+{
+	if(len < XFER_HDR)
+		return -1;
+	m->op = p[0];
+	m->flags = p[1];
+	m->id = get_be32(p + 4);
+	m->off = ((uint64_t)get_be32(p + 8) << 32) | get_be32(p + 12);
+	m->data = p + XFER_HDR;
+	m->len = len - XFER_HDR;
+	return 0;
+}
+
+void xfer_put32(struct sk_buff *skb, uint32_t v)
+{
+	put_be32(skb_put(skb, 4), v);
+}
+
+int xfer_next(struct xfer *x, struct sk_buff *skb, long long now)
+{
+	unsigned int len;
+	ssize_t n;
+
+	if(!x->sender)
+		return 0;
+	
+	if(x->state == XFER_S_DATA) {
+		if(!x->progress)
+			x->progress = now;
+		if(x->next > x->base && now - x->progress > XFER_RTO) {
+			/* nothing acked for a while: go back */
+			x->resent += (x->next - x->base + XFER_CHUNK - 1) / XFER_CHUNK;
+			x->next = x->base;
+			x->progress = now;
+		}
+		if(x->base == x->size) {
+			x->state = XFER_S_END;
+		} else if(x->next < x->size && x->next - x->base < (uint64_t)x->window * XFER_CHUNK) {
+			len = x->size - x->next > XFER_CHUNK ? XFER_CHUNK : x->size - x->next;
+			n = pread(x->fd, skb_put(skb, 0), len, x->next);
+			if(n <= 0) {
+				x->status = n ? errno : EIO;
+				xfer_put32(skb, x->status);
+				xfer_push(skb, XFER_ERR, 0, x->id, x->next);
+				x->state = XFER_S_DONE;
+				return 1;
+			}
+			skb_put(skb, n);
+			if(x->next == x->crcpos) {
+				x->crc = xfer_crc32(x->crc, skb->data, n);
+				x->crcpos += n;
+			}
+			xfer_push(skb, XFER_DATA, 0, x->id, x->next);
+			x->next += n;
+			x->frames++;
+			return 1;
+		} else
+			return 0;
+	}
+	if(x->state == XFER_S_END) {
+		if(x->lastend && now - x->lastend < XFER_RTO)
+			return 0;
+		x->lastend = now;
+		xfer_put32(skb, x->crc);
+		xfer_push(skb, XFER_END, 0, x->id, x->size);
+		return 1;
+	}
+	return 0;
+}
+
+int xfer_input(struct xfer *x, const struct xfer_msg *m, struct sk_buff *reply, long long now)
+{
+	ssize_t n;
+
+	if(m->id != x->id)
+		return 0;
+	x->alive = now;
+
+	switch(m->op) {
+	case XFER_DATA:
+		if(x->sender || x->state != XFER_S_DATA)
+			return 0;
+		if(m->off != x->base || m->off + m->len > x->size) {
+			/* lost frame before this one. remind sender now and then */
+			if(x->ooo++ % 16)
+				return 0;
+			break;
+		}
+		n = pwrite(x->fd, m->data, m->len, m->off);
+		if(n != m->len) {
+			x->status = errno ? errno : EIO;
+			x->state = XFER_S_DONE;
+			xfer_put32(reply, x->status);
+			xfer_push(reply, XFER_ERR, 0, x->id, x->base);
+			return 1;
+		}
+		x->crc = xfer_crc32(x->crc, m->data, m->len);
+		x->base += m->len;
+		x->frames++;
+		x->ooo = 0;
+		if(++x->unacked < 8 && x->base != x->size)
+			return 0;
+		break;
+	case XFER_ACK:
+		if(!x->sender)
+			return 0;
+		if(m->off > x->base && m->off <= x->size) {
+			x->base = m->off;
+			x->progress = now;
+			x->dupacks = 0;
+			if(x->next < x->base)
+				x->next = x->base;
+		} else if(m->off == x->base && ++x->dupacks == 3) {
+			/* fast retransmit */
+			x->resent += (x->next - x->base + XFER_CHUNK - 1) / XFER_CHUNK;
+			x->next = x->base;
+			x->progress = now;
+		}
+		return 0;
+	case XFER_END:
+		if(x->sender)
+			return 0;
+		if(x->state == XFER_S_DATA) {
+			if(x->base != m->off)
+				break;
+			if(m->len < 4 || get_be32(m->data) != x->crc)
+				x->status = 1;
+			x->state = XFER_S_DONE;
+		}
+		xfer_put32(reply, x->status);
+		xfer_push(reply, XFER_DONE, 0, x->id, x->size);
+		return 1;
+	case XFER_DONE:
+	case XFER_ERR:
+		x->status = m->len >= 4 ? get_be32(m->data) : EIO;
+		x->state = XFER_S_DONE;
+		return 0;
+	default:
+		return 0;
+	}
+	/* cumulative ack */
+	x->unacked = 0;
+	xfer_push(reply, XFER_ACK, 0, x->id, x->base);
+	return 1;
+}
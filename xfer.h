@@ -0,0 +1,107 @@
+#ifndef XFER_H
+#define XFER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "skbuff.h"
+#include "proto.h"
+
+/*
+ * File transfer over EGETTY_FILE messages.
+ *
+ * Payload after the egetty header:
+ *  uint8_t op;
+ *  uint8_t flags;
+ *  uint16_t reserved;
+ *  uint32_t id;     transfer id chosen by client
+ *  uint64_t off;    offset or size, see below
+ *  uint8_t data[];
+ * All fields big endian.
+ *
+ *  XFER_PUT   client->egetty  off=file size, data=path
+ *  XFER_GET   client->egetty  off=resume offset, data=path
+ *  XFER_OPEN  egetty->client  PUT: off=offset to start at. GET: off=file size
+ *  XFER_DATA  sender->receiver off=offset of data
+ *  XFER_ACK   receiver->sender off=next expected offset (cumulative)
+ *  XFER_END   sender->receiver off=size, data=crc32 of whole file
+ *  XFER_DONE  receiver->sender off=size, data=status (0 ok, 1 crc mismatch)
+ *  XFER_ERR   either side, data=errno
+ *
+ * Data is sent go-back-N with a window of frames in flight.
+ */
+
+enum { XFER_PUT=1, XFER_GET, XFER_OPEN, XFER_DATA, XFER_ACK, XFER_END, XFER_DONE, XFER_ERR };
+
+#define XFER_RESUME 1 /* flag in PUT: continue an existing file */
+
+#define XFER_HDR 16
+#define XFER_CHUNK (1500 - PROTO_HDRMAX - XFER_HDR)
+#define XFER_WINDOW 128
+#define XFER_RTO 200 /* ms without progress before data is resent */
+#define XFER_TIMEOUT 10000 /* ms without a message from the peer before giving up */
+
+enum { XFER_S_IDLE=0, XFER_S_OPEN, XFER_S_DATA, XFER_S_END, XFER_S_DONE };
+
+struct xfer_msg {
+	int op, flags;
+	uint32_t id;
+	uint64_t off;
+	const unsigned char *data;
+	unsigned int len;
+};
+
+struct xfer {
+	int fd;
+	int sender;
+	int state;
+	int status; /* 0, 1 for crc mismatch or errno */
+	uint32_t id;
+	uint64_t size;
+	uint64_t base; /* sender: acked. receiver: next expected */
+	uint64_t next; /* sender: next offset to send */
+	uint64_t crcpos; /* crc covers data up to here */
+	uint32_t crc;
+	int window;
+	int dupacks, unacked, ooo;
+	long long progress, lastend, alive; /* ms */
+	unsigned long long frames, resent;
+};
+
+/* size socket receive buffer for a window of frames */
+int xfer_socket(int s);
+
+uint32_t xfer_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* crc32 of first 'len' bytes of fd */
+int xfer_crc_file(int fd, uint64_t len, uint32_t *crc);
+
+void xfer_init(struct xfer *x, int fd, int sender, uint32_t id, uint64_t size, uint64_t start);
+
+/*
+ * openat() of 'path' inside directory 'dir': absolute paths, '..' and
+ * symbolic links are refused in every component.
+ */
+int xfer_openat(int dir, const char *path, int flags, mode_t mode);
+
+/* peer silent for XFER_TIMEOUT: ends the transfer with ETIMEDOUT, returns 1 */
+int xfer_expired(struct xfer *x, long long now);
+
+/* prepend xfer header. skb must have XFER_HDR + PROTO_HDRMAX bytes headroom */
+void xfer_push(struct sk_buff *skb, int op, int flags, uint32_t id, uint64_t off);
+
+/* append 32 bit big endian value */
+void xfer_put32(struct sk_buff *skb, uint32_t v);
+
+int xfer_parse(const unsigned char *p, unsigned int len, struct xfer_msg *m);
+
+/*
+ * Sender: build next frame to send into skb (which must be reset and have
+ * headroom reserved). Returns 1 if a frame was built.
+ */
+int xfer_next(struct xfer *x, struct sk_buff *skb, long long now);
+
+/* handle DATA/ACK/END/DONE/ERR. Returns 1 if a reply was built in 'reply' */
+int xfer_input(struct xfer *x, const struct xfer_msg *m, struct sk_buff *reply, long long now);
+
+#endif